@@ -0,0 +1,475 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Benchmark of the shortener on a corpus shaped like OSM names: Polish
+ * streets named after people, US streets, Spanish, Russian and Turkish
+ * names, each tagged with its language, with the same kind of repetition
+ * as in real data.  Or on names read from a file, one per line, without
+ * languages.  Prints names/s, ns/name and malloc calls per name for each
+ * of the interfaces, and where the time goes inside shorten().
+ *
+ * shorten.c is included here directly so that its phase hooks can time
+ * the dictionary lookups.  Decoding is timed as a separate walk over the
+ * names doing the same classification shorten() does, and what's left is
+ * writing the output, which happens in the same loops.
+ *
+ * Usage: shrtnms-bench [-n <names>] [-r <rounds>] [-o <corpus out>] [<file>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { PHASE_ABBREVS, PHASE_GIVEN_NAMES, N_PHASES };
+
+static int profiling;
+static uint64_t phase_start, phase_ns[N_PHASES], phase_calls[N_PHASES];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define PHASE_BEGIN() \
+    do { if (profiling) phase_start = now_ns(); } while (0)
+#define PHASE_END(phase) \
+    do { \
+	if (profiling) { \
+	    phase_ns[phase] += now_ns() - phase_start; \
+	    phase_calls[phase] ++; \
+	} \
+    } while (0)
+
+#include "shorten.c"
+
+#ifdef __GLIBC__
+/* Count every allocation made while the benchmark runs */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long n_allocs;
+
+void *malloc(size_t size)
+{
+    n_allocs ++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    n_allocs ++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    n_allocs ++;
+    return __libc_realloc(ptr, size);
+}
+#define ALLOCS()	n_allocs
+#else
+#define ALLOCS()	0
+#endif
+
+static const char *pl_types[] = {
+    "ulica", "ulica", "ulica", "aleja", "plac", "osiedle", "rondo",
+};
+static const char *pl_titles[] = {
+    "generała", "księdza", "profesora", "doktora", "marszałka",
+    "kardynała", "świętego", "pułkownika", "majora",
+};
+static const char *pl_given[] = {
+    "Jana", "Adama", "Marii", "Józefa", "Tadeusza", "Władysława",
+    "Stanisława", "Kazimierza", "Henryka", "Juliusza", "Bolesława",
+    "Czesława", "Szymona", "Zygmunta", "Jana Pawła",
+};
+static const char *pl_surnames[] = {
+    "Kościuszki", "Mickiewicza", "Piłsudskiego", "Sienkiewicza",
+    "Kopernika", "Słowackiego", "Chopina", "Reymonta", "Sikorskiego",
+    "Andersa", "Wyszyńskiego", "Konopnickiej", "Skłodowskiej-Curie",
+    "Prusa", "Moniuszki", "Żeromskiego", "Matejki", "Kilińskiego",
+};
+static const char *pl_plain[] = {
+    "Polna", "Leśna", "Krótka", "Ogrodowa", "Słoneczna", "Kwiatowa",
+    "Szkolna", "Lipowa", "Brzozowa", "Kościelna", "Zielona", "Długa",
+};
+static const char *en_dirs[] = {
+    "", "", "", "North ", "South ", "East ", "West ",
+};
+static const char *en_names[] = {
+    "Main", "Oak", "Maple", "Washington", "Lincoln", "Park", "Lake",
+    "Hill", "Cedar", "Elm", "Pine", "Jefferson", "Madison", "Church",
+    "Martin Luther King Jr.", "Saint Mary's", "Mount Vernon",
+};
+static const char *en_types[] = {
+    "Street", "Street", "Avenue", "Road", "Boulevard", "Drive", "Lane",
+    "Court", "Place", "Highway", "Parkway", "Terrace", "Way",
+};
+static const char *es_types[] = {
+    "Calle", "Calle", "Avenida", "Plaza", "Paseo", "Camino", "Carretera",
+};
+static const char *es_names[] = {
+    "Mayor", "Real", "de la Constitución", "del General Prim",
+    "de San Francisco", "de Santa Ana", "de los Reyes Católicos",
+    "del Doctor Fleming", "Nueva", "de la Iglesia",
+};
+static const char *ru_types[] = {
+    "улица", "улица", "проспект", "переулок", "площадь", "бульвар",
+    "проезд",
+};
+static const char *ru_names[] = {
+    "Ленина", "Гагарина", "Пушкина", "Мира", "Советская", "Победы",
+    "Кирова", "Садовая", "Молодёжная", "Лермонтова", "Чехова",
+};
+static const char *tr_names[] = {
+    "Atatürk", "İstiklal", "Cumhuriyet", "Gazi", "Fevzi Çakmak",
+    "Mimar Sinan", "Bağdat", "Barbaros", "Kızılay", "İnönü",
+};
+static const char *tr_types[] = {
+    "Caddesi", "Caddesi", "Sokağı", "Bulvarı", "Mahallesi",
+};
+
+static unsigned int rnd_state = 1;
+
+static unsigned int rnd(unsigned int n)
+{
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return (rnd_state >> 16) % n;
+}
+
+#define PICK(list)	list[rnd(ARRAY_SIZE(list))]
+
+/* Make up a name, returns its language */
+static const char *gen_name(char *buf, size_t size)
+{
+    switch (rnd(10)) {
+    case 0: case 1: case 2: case 3:
+	switch (rnd(4)) {
+	case 0:
+	    snprintf(buf, size, "%s %s %s", PICK(pl_types),
+			    PICK(pl_given), PICK(pl_surnames));
+	    break;
+	case 1:
+	    snprintf(buf, size, "%s %s %s %s", PICK(pl_types), PICK(pl_titles),
+			    PICK(pl_given), PICK(pl_surnames));
+	    break;
+	case 2:
+	    snprintf(buf, size, "%s %s", PICK(pl_types),
+			    PICK(pl_surnames));
+	    break;
+	default:
+	    snprintf(buf, size, "%s", PICK(pl_plain));
+	}
+	return "pl";
+    case 4: case 5: case 6:
+	snprintf(buf, size, "%s%s %s", PICK(en_dirs), PICK(en_names),
+			PICK(en_types));
+	return "en";
+    case 7:
+	snprintf(buf, size, "%s %s", PICK(es_types), PICK(es_names));
+	return "es";
+    case 8:
+	if (rnd(3))
+	    snprintf(buf, size, "%s %s", PICK(ru_types), PICK(ru_names));
+	else
+	    snprintf(buf, size, "%s %s", PICK(ru_names), PICK(ru_types));
+	return "ru";
+    default:
+	snprintf(buf, size, "%s %s", PICK(tr_names), PICK(tr_types));
+	return "tr";
+    }
+}
+
+static struct shortener *sh;
+static char **names;
+static const char **langs;
+static size_t *lens, n_names, n_bytes;
+static char short_name[512], shortest_name[512];
+static unsigned long checksum;
+
+static void run_shorten(void)
+{
+    size_t i;
+
+    for (i = 0; i < n_names; i ++) {
+	shortener_shorten(sh, names[i], short_name, shortest_name);
+	checksum += short_name[0];
+    }
+}
+
+static void run_shorten_lang(void)
+{
+    size_t i;
+
+    for (i = 0; i < n_names; i ++) {
+	shortener_shorten_lang(sh, names[i], langs[i],
+			short_name, shortest_name);
+	checksum += short_name[0];
+    }
+}
+
+static void run_shorten_n(void)
+{
+    size_t i, short_len, shortest_len;
+
+    for (i = 0; i < n_names; i ++) {
+	shortener_shorten_n(sh, names[i], lens[i], langs[i],
+			short_name, sizeof(short_name), &short_len,
+			shortest_name, sizeof(shortest_name), &shortest_len);
+	checksum += short_len;
+    }
+}
+
+static char arena[1 << 20];
+static struct shortener_result results[4096];
+
+static void run_batch(void)
+{
+    size_t done, k;
+
+    for (done = 0; done < n_names; done += k) {
+	k = n_names - done;
+	if (k > ARRAY_SIZE(results))
+	    k = ARRAY_SIZE(results);
+	k = shortener_shorten_batch(sh, k,
+			(const char *const *) names + done, lens + done,
+			langs + done, arena, sizeof(arena), results);
+	checksum += arena[0];
+    }
+}
+
+static struct shortener_cache *cache;
+
+static void run_cache(void)
+{
+    size_t i;
+
+    for (i = 0; i < n_names; i ++) {
+	shortener_cache_shorten(cache, names[i], lens[i], langs[i],
+			short_name, shortest_name);
+	checksum += short_name[0];
+    }
+}
+
+/* A proportional Latin font, sort of, and labels about 12 letters wide */
+static struct shortener_widths *widths;
+
+static void widths_init(void)
+{
+    unsigned int codepoints[0x250 - 0x20];
+    unsigned short advances[ARRAY_SIZE(codepoints)];
+    unsigned int c;
+
+    for (c = 0x20; c < 0x250; c ++) {
+	codepoints[c - 0x20] = c;
+	advances[c - 0x20] = strchr(" .,'il", c) ? 280 :
+		strchr("mwMW", c) ? 880 : uc_isupper(c) ? 700 : 560;
+    }
+
+    widths = shortener_widths_new(codepoints, advances,
+		    ARRAY_SIZE(codepoints), 600);
+}
+
+static void run_fit(void)
+{
+    size_t i, len;
+    unsigned long width;
+
+    for (i = 0; i < n_names; i ++) {
+	shortener_fit(sh, widths, names[i], lens[i], langs[i], 7000,
+			short_name, sizeof(short_name), &len, &width);
+	checksum += len;
+    }
+}
+
+/* The decoding and classification part of shorten() on its own */
+static void run_decode(void)
+{
+    const char *p, *end;
+    wchar_t c;
+    size_t i;
+    int n;
+
+    for (i = 0; i < n_names; i ++)
+	for (p = names[i], end = p + lens[i];
+			(c = utf8_get_n(p, end, &n)); p += n)
+	    checksum += uc_isalnum(c) + uc_isspace(c);
+}
+
+static int rounds = 5;
+
+static uint64_t run(const char *label, void (*fn)(void))
+{
+    unsigned long allocs;
+    uint64_t start, ns;
+    int i;
+
+    allocs = ALLOCS();
+    start = now_ns();
+    for (i = 0; i < rounds; i ++)
+	fn();
+    ns = now_ns() - start;
+    allocs = ALLOCS() - allocs;
+
+    if (label)
+	printf("%-24s %10.0f names/s %8.1f ns/name %8.3f allocs/name\n",
+			label, n_names * rounds * 1e9 / ns,
+			(double) ns / (n_names * rounds),
+			(double) allocs / (n_names * rounds));
+    return ns;
+}
+
+static void read_corpus(const char *path)
+{
+    char line[4096];
+    FILE *f = fopen(path, "r");
+    size_t alloc = 0;
+
+    if (!f) {
+	perror(path);
+	exit(1);
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+	line[strcspn(line, "\n")] = 0;
+	if (n_names == alloc) {
+	    alloc = alloc * 2 + 1024;
+	    names = realloc(names, alloc * sizeof(*names));
+	    langs = realloc(langs, alloc * sizeof(*langs));
+	    lens = realloc(lens, alloc * sizeof(*lens));
+	}
+	names[n_names] = strdup(line);
+	langs[n_names] = NULL;
+	lens[n_names] = strlen(line);
+	n_bytes += lens[n_names ++];
+    }
+    fclose(f);
+}
+
+static void gen_corpus(size_t count)
+{
+    char line[512];
+
+    names = malloc(count * sizeof(*names));
+    langs = malloc(count * sizeof(*langs));
+    lens = malloc(count * sizeof(*lens));
+
+    for (n_names = 0; n_names < count; n_names ++) {
+	langs[n_names] = gen_name(line, sizeof(line));
+	names[n_names] = strdup(line);
+	lens[n_names] = strlen(line);
+	n_bytes += lens[n_names];
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *out = NULL;
+    size_t count = 200000, i;
+    uint64_t total, decode, overhead, start;
+    double per_name;
+    FILE *f;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:o:")) != -1)
+	switch (opt) {
+	case 'n':
+	    count = atol(optarg);
+	    break;
+	case 'r':
+	    rounds = atoi(optarg);
+	    break;
+	case 'o':
+	    out = optarg;
+	    break;
+	default:
+	    fprintf(stderr, "Usage: %s [-n <names>] [-r <rounds>] "
+			    "[-o <corpus out>] [<file>]\n", argv[0]);
+	    return 1;
+	}
+    if (rounds < 1 || !count)
+	return 1;
+
+    if (optind < argc)
+	read_corpus(argv[optind]);
+    else
+	gen_corpus(count);
+
+    if (out) {
+	f = fopen(out, "w");
+	if (!f) {
+	    perror(out);
+	    return 1;
+	}
+	for (i = 0; i < n_names; i ++)
+	    fprintf(f, "%s\n", names[i]);
+	fclose(f);
+    }
+
+    sh = shortener_new();
+    cache = shortener_cache_new(sh, 1 << 16);
+    if (!sh || !cache || !n_names) {
+	fprintf(stderr, "Setup failed\n");
+	return 1;
+    }
+
+    printf("Corpus: %zu names, %zu bytes\n", n_names, n_bytes);
+
+    run(NULL, run_shorten_lang);	/* Warm up */
+    run("shortener_shorten", run_shorten);
+    run("shortener_shorten_lang", run_shorten_lang);
+    run("shortener_shorten_n", run_shorten_n);
+    run("shortener_shorten_batch", run_batch);
+    run(NULL, run_cache);
+    run("cache, warm", run_cache);
+    widths_init();
+    run("shortener_fit", run_fit);
+
+    /* Where the time goes, with the lookups timed individually */
+    start = now_ns();
+    for (i = 0; i < 1000000; i ++)
+	checksum += now_ns() & 1;
+    overhead = (now_ns() - start) / 1000000;
+
+    profiling = 1;
+    total = run(NULL, run_shorten_lang);
+    profiling = 0;
+    decode = run(NULL, run_decode);
+
+    /*
+     * Each timed call adds two clock reads to the total, and about one
+     * to the time of the phase.
+     */
+    for (i = 0; i < N_PHASES; i ++) {
+	total -= phase_calls[i] * overhead * 2;
+	if (phase_ns[i] > phase_calls[i] * overhead)
+	    phase_ns[i] -= phase_calls[i] * overhead;
+	else
+	    phase_ns[i] = 0;
+    }
+
+    per_name = 1.0 / (n_names * rounds);
+    printf("Phases (ns/name): decode %.1f, abbrevs %.1f, "
+		    "given_names %.1f, encode %.1f\n",
+		    decode * per_name,
+		    phase_ns[PHASE_ABBREVS] * per_name,
+		    phase_ns[PHASE_GIVEN_NAMES] * per_name,
+		    ((double) total - decode - phase_ns[PHASE_ABBREVS] -
+		     phase_ns[PHASE_GIVEN_NAMES]) * per_name);
+
+    shortener_widths_free(widths);
+    shortener_cache_free(cache);
+    shortener_free(sh);
+    return checksum == 42;
+}
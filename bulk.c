@@ -0,0 +1,752 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Bulk mode for inputs much larger than memory, with many repeated names,
+ * like all the names in a planet file.  Reads "id<TAB>name" lines and
+ * prints "id<TAB>short<TAB>shortest" lines in the same order, while only
+ * shortening every distinct name once.  Lines without a TAB are names with
+ * an empty id.
+ *
+ * This is done with two external merge sorts.  The records are first
+ * sorted by name: every time the memory budget fills up, the records in
+ * memory are sorted by a few threads, each taking a slice, and the slices
+ * are merged into a run in a temporary file.  Merging all the runs then
+ * gives the records grouped by name.  The distinct names are shortened in
+ * batches, spread over the threads, and the output lines go to the second
+ * sort, by input position, which is merged the same way to write them out
+ * in the original order.  The last part of each sort never goes to disk so
+ * smaller inputs are done all in memory.
+ *
+ * The runs are kept in levels so that they can all be merged at once in
+ * the end: when a level has MAX_RUNS runs they're merged into one run of
+ * the next level, so every record is written once per level and there are
+ * only log of the input size in base MAX_RUNS levels.
+ *
+ * Usage: shrtnms-bulk [-j <threads>] [-m <memory MiB>] [-T <tmp dir>]
+ *                     [-l <languages>] [-d <dictionary>] [<file>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "shortnames.h"
+
+#define MAX_RUNS	64
+#define MAX_LEVELS	8
+#define FILE_BUF_SIZE	(1 << 16)
+#define MAX_SOURCES	(MAX_RUNS + MAX_LEVELS + 64)
+#define BATCH_NAMES	4096
+#define BATCH_RECS	16384
+#define BATCH_SIZE	(1 << 20)
+
+/*
+ * A record is two strings, the id and the name in the first sort or the
+ * output line and nothing in the second, with the input line number.  In
+ * the temporary files it's the three fields followed by the strings.
+ */
+struct rec {
+    uint64_t seq;
+    uint32_t a_len, b_len;
+    const char *data;		/* The two strings one after the other */
+};
+
+#define REC_HEADER_SIZE	16
+
+typedef int (*rec_cmp_fn)(const struct rec *a, const struct rec *b);
+
+/* Where the records being merged come from: a run or a slice in memory */
+struct source {
+    struct rec rec;		/* The current one */
+    FILE *f;
+    char *buf;
+    size_t size;
+    const struct rec *p, *end;
+};
+
+struct merger {
+    struct source *srcs;
+    struct source **heap;
+    int n;
+    rec_cmp_fn cmp;
+};
+
+struct sorter {
+    rec_cmp_fn cmp;
+    char *arena;
+    size_t arena_len, arena_size;
+    struct rec *recs;
+    size_t n_recs, max_recs;
+    FILE *runs[MAX_LEVELS][MAX_RUNS];
+    int n_runs[MAX_LEVELS];
+    int n_merged;		/* Runs in the final merge */
+    unsigned long total_runs;
+    struct source slices[64];
+    int n_slices;
+};
+
+static const char *tmp_dir = "/tmp";
+static int n_threads;
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    return ptr;
+}
+
+static void tmp_error(void)
+{
+    perror("Temporary file");
+    exit(1);
+}
+
+static int cmp_name(const struct rec *a, const struct rec *b)
+{
+    int ret = memcmp(a->data + a->a_len, b->data + b->a_len,
+		    a->b_len < b->b_len ? a->b_len : b->b_len);
+
+    if (ret)
+	return ret;
+    if (a->b_len != b->b_len)
+	return a->b_len < b->b_len ? -1 : 1;
+    return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static int cmp_seq(const struct rec *a, const struct rec *b)
+{
+    return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/* An anonymous file in tmp_dir, gone once closed */
+static FILE *tmp_open(void)
+{
+    char path[4096];
+    FILE *f;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/shrtnms-bulk-XXXXXX", tmp_dir);
+    fd = mkstemp(path);
+    if (fd < 0)
+	tmp_error();
+    unlink(path);
+
+    f = fdopen(fd, "w+");
+    if (!f)
+	tmp_error();
+    setvbuf(f, NULL, _IOFBF, FILE_BUF_SIZE);
+    return f;
+}
+
+static void rec_write(FILE *f, const struct rec *r)
+{
+    char hdr[REC_HEADER_SIZE];
+
+    memcpy(hdr, &r->seq, 8);
+    memcpy(hdr + 8, &r->a_len, 4);
+    memcpy(hdr + 12, &r->b_len, 4);
+    if (fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr) ||
+	    fwrite(r->data, 1, r->a_len + r->b_len, f) !=
+	    r->a_len + r->b_len)
+	tmp_error();
+}
+
+/* Move to the next record, returns 0 at the end */
+static int source_next(struct source *src)
+{
+    char hdr[REC_HEADER_SIZE];
+    size_t len;
+
+    if (!src->f) {
+	if (src->p == src->end)
+	    return 0;
+	src->rec = *src->p ++;
+	return 1;
+    }
+
+    len = fread(hdr, 1, sizeof(hdr), src->f);
+    if (!len && feof(src->f))
+	return 0;
+    if (len != sizeof(hdr))
+	tmp_error();
+
+    memcpy(&src->rec.seq, hdr, 8);
+    memcpy(&src->rec.a_len, hdr + 8, 4);
+    memcpy(&src->rec.b_len, hdr + 12, 4);
+    len = src->rec.a_len + src->rec.b_len;
+    if (len > src->size) {
+	src->size = len;
+	src->buf = xrealloc(src->buf, len);
+    }
+    if (fread(src->buf, 1, len, src->f) != len)
+	tmp_error();
+    src->rec.data = src->buf;
+    return 1;
+}
+
+static int heap_less(const struct merger *m, int i, int j)
+{
+    return m->cmp(&m->heap[i]->rec, &m->heap[j]->rec) < 0;
+}
+
+static void heap_down(struct merger *m, int i)
+{
+    struct source *tmp;
+    int child;
+
+    while ((child = 2 * i + 1) < m->n) {
+	if (child + 1 < m->n && heap_less(m, child + 1, child))
+	    child ++;
+	if (!heap_less(m, child, i))
+	    break;
+	tmp = m->heap[i];
+	m->heap[i] = m->heap[child];
+	m->heap[child] = tmp;
+	i = child;
+    }
+}
+
+/* Start merging the @n sources, which take their first records here */
+static void merger_init(struct merger *m, struct source *srcs, int n,
+		rec_cmp_fn cmp)
+{
+    int i;
+
+    m->srcs = srcs;
+    m->heap = xrealloc(NULL, (n + 1) * sizeof(*m->heap));
+    m->n = 0;
+    m->cmp = cmp;
+
+    for (i = 0; i < n; i ++)
+	if (source_next(&srcs[i]))
+	    m->heap[m->n ++] = &srcs[i];
+    for (i = m->n / 2 - 1; i >= 0; i --)
+	heap_down(m, i);
+}
+
+/* The smallest record, valid until merger_pop(), or NULL at the end */
+static const struct rec *merger_peek(struct merger *m)
+{
+    return m->n ? &m->heap[0]->rec : NULL;
+}
+
+static void merger_pop(struct merger *m)
+{
+    if (!source_next(m->heap[0]))
+	m->heap[0] = m->heap[-- m->n];
+    heap_down(m, 0);
+}
+
+static void merger_free(struct merger *m)
+{
+    free(m->heap);
+}
+
+static void sorter_init(struct sorter *s, rec_cmp_fn cmp, size_t memory)
+{
+    memset(s, 0, sizeof(*s));
+    s->cmp = cmp;
+    s->max_recs = memory / 4 / sizeof(struct rec);
+    s->arena_size = memory - s->max_recs * sizeof(struct rec);
+    s->recs = xrealloc(NULL, s->max_recs * sizeof(struct rec));
+    s->arena = xrealloc(NULL, s->arena_size);
+}
+
+static rec_cmp_fn qsort_cmp;
+
+static int qsort_cmp_fn(const void *a, const void *b)
+{
+    return qsort_cmp(a, b);
+}
+
+static void *sort_thread(void *arg)
+{
+    struct source *slice = arg;
+
+    qsort((void *) slice->p, slice->end - slice->p, sizeof(struct rec),
+		    qsort_cmp_fn);
+    return NULL;
+}
+
+/*
+ * Sort the records in memory into slices, one per thread unless there are
+ * few of them, to be merged by whoever reads them.
+ */
+static void sorter_sort(struct sorter *s)
+{
+    pthread_t threads[ARRAY_SIZE(s->slices)];
+    size_t per_slice;
+    int i;
+
+    s->n_slices = n_threads;
+    if (s->n_slices > (int) ARRAY_SIZE(s->slices))
+	s->n_slices = ARRAY_SIZE(s->slices);
+    if (s->n_recs < 65536)
+	s->n_slices = 1;
+    per_slice = (s->n_recs + s->n_slices - 1) / s->n_slices;
+
+    for (i = 0; i < s->n_slices; i ++) {
+	memset(&s->slices[i], 0, sizeof(s->slices[i]));
+	s->slices[i].p = s->recs + i * per_slice;
+	s->slices[i].end = s->recs + ((i + 1) * per_slice < s->n_recs ?
+			(i + 1) * per_slice : s->n_recs);
+	if (s->slices[i].p > s->slices[i].end)
+	    s->slices[i].p = s->slices[i].end;
+    }
+
+    qsort_cmp = s->cmp;
+    for (i = 1; i < s->n_slices; i ++)
+	pthread_create(&threads[i], NULL, sort_thread, &s->slices[i]);
+    sort_thread(&s->slices[0]);
+    for (i = 1; i < s->n_slices; i ++)
+	pthread_join(threads[i], NULL);
+}
+
+/* Merge the sources into a new run */
+static FILE *merge_to_run(struct source *srcs, int n, rec_cmp_fn cmp)
+{
+    struct merger m;
+    const struct rec *r;
+    FILE *f = tmp_open();
+
+    merger_init(&m, srcs, n, cmp);
+    for (; (r = merger_peek(&m)); merger_pop(&m))
+	rec_write(f, r);
+    merger_free(&m);
+
+    if (fflush(f) || fseek(f, 0, SEEK_SET))
+	tmp_error();
+    return f;
+}
+
+static void sources_from_runs(struct source *srcs, FILE **runs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i ++) {
+	memset(&srcs[i], 0, sizeof(srcs[i]));
+	srcs[i].f = runs[i];
+    }
+}
+
+static void sources_free(struct source *srcs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i ++) {
+	if (srcs[i].f)
+	    fclose(srcs[i].f);
+	free(srcs[i].buf);
+    }
+}
+
+/* Add a run to @level, merging the level into the next one when full */
+static void sorter_add_run(struct sorter *s, int level, FILE *f)
+{
+    struct source srcs[MAX_RUNS];
+
+    s->runs[level][s->n_runs[level] ++] = f;
+    if (s->n_runs[level] < MAX_RUNS)
+	return;
+
+    if (level + 1 == MAX_LEVELS) {
+	fprintf(stderr, "Too many runs, increase the memory limit\n");
+	exit(1);
+    }
+    sources_from_runs(srcs, s->runs[level], MAX_RUNS);
+    f = merge_to_run(srcs, MAX_RUNS, s->cmp);
+    sources_free(srcs, MAX_RUNS);
+    s->n_runs[level] = 0;
+    sorter_add_run(s, level + 1, f);
+}
+
+/* Write the records in memory out as a run and start over */
+static void sorter_spill(struct sorter *s)
+{
+    sorter_sort(s);
+    sorter_add_run(s, 0, merge_to_run(s->slices, s->n_slices, s->cmp));
+    s->total_runs ++;
+    s->n_recs = 0;
+    s->arena_len = 0;
+}
+
+static void sorter_add(struct sorter *s, uint64_t seq,
+		const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    struct rec *r;
+
+    if (a_len + b_len > s->arena_size || a_len + b_len > UINT32_MAX) {
+	fprintf(stderr, "Line %llu too long for the memory limit\n",
+			(unsigned long long) seq + 1);
+	exit(1);
+    }
+    if (s->n_recs == s->max_recs ||
+	    s->arena_len + a_len + b_len > s->arena_size)
+	sorter_spill(s);
+
+    r = &s->recs[s->n_recs ++];
+    r->seq = seq;
+    r->a_len = a_len;
+    r->b_len = b_len;
+    r->data = s->arena + s->arena_len;
+    memcpy(s->arena + s->arena_len, a, a_len);
+    memcpy(s->arena + s->arena_len + a_len, b, b_len);
+    s->arena_len += a_len + b_len;
+}
+
+static int sorter_runs(const struct sorter *s)
+{
+    int level, n = 0;
+
+    for (level = 0; level < MAX_LEVELS; level ++)
+	n += s->n_runs[level];
+
+    return n;
+}
+
+/*
+ * Start merging everything added to the sorter: the runs and the records
+ * still in memory.  @srcs needs room for MAX_SOURCES sources.
+ */
+static void sorter_finish(struct sorter *s, struct merger *m,
+		struct source *srcs)
+{
+    struct source level_srcs[MAX_RUNS];
+    int i, level;
+    FILE *f;
+
+    /*
+     * Until the runs of all levels fit in one merge, merge the lowest
+     * level with more than one run, the smallest runs, into the next one.
+     */
+    for (level = 0; sorter_runs(s) > MAX_RUNS && level < MAX_LEVELS - 1;
+	    level ++) {
+	if (s->n_runs[level] < 2)
+	    continue;
+
+	sources_from_runs(level_srcs, s->runs[level], s->n_runs[level]);
+	f = merge_to_run(level_srcs, s->n_runs[level], s->cmp);
+	sources_free(level_srcs, s->n_runs[level]);
+	s->n_runs[level] = 0;
+	sorter_add_run(s, level + 1, f);
+    }
+
+    sorter_sort(s);
+    for (s->n_merged = level = 0; level < MAX_LEVELS; level ++) {
+	sources_from_runs(srcs + s->n_merged, s->runs[level],
+			s->n_runs[level]);
+	s->n_merged += s->n_runs[level];
+    }
+    for (i = 0; i < s->n_slices; i ++)
+	srcs[s->n_merged + i] = s->slices[i];
+    merger_init(m, srcs, s->n_merged + s->n_slices, s->cmp);
+}
+
+static void sorter_free(struct sorter *s, struct source *srcs)
+{
+    sources_free(srcs, s->n_merged);
+    free(s->recs);
+    free(s->arena);
+}
+
+/*
+ * The records coming out of the merge by name, copied to @data, waiting
+ * for their names to be shortened.  Every distinct name is shortened once,
+ * by one of the threads.
+ */
+struct batch {
+    char *data;
+    size_t data_len, data_size;
+    struct rec recs[BATCH_RECS];
+    size_t rec_name[BATCH_RECS];	/* Index into names */
+    size_t n_recs;
+    const char *names[BATCH_NAMES];
+    size_t lens[BATCH_NAMES];
+    const char *langs[BATCH_NAMES];
+    struct shortener_result results[BATCH_NAMES];
+    size_t n_names;
+};
+
+/* A thread's share of the names of a batch and where its forms go */
+struct shorten_job {
+    const struct shortener *sh;
+    struct batch *b;
+    size_t first, end;
+    char *arena;
+    size_t arena_size;
+};
+
+static void *shorten_thread(void *arg)
+{
+    struct shorten_job *job = arg;
+    struct batch *b = job->b;
+    size_t i, j, k, pos = 0, need;
+
+    for (i = job->first; i < job->end; i += k) {
+	k = shortener_shorten_batch(job->sh, job->end - i,
+			b->names + i, b->lens + i, b->langs + i,
+			job->arena + pos, job->arena_size - pos,
+			b->results + i);
+	if (!k) {
+	    need = pos + b->results[i].short_len + b->results[i].shortest_len;
+	    job->arena_size = job->arena_size * 2 > need ?
+		    job->arena_size * 2 : need;
+	    job->arena = xrealloc(job->arena, job->arena_size);
+	    continue;
+	}
+
+	for (j = i; j < i + k; j ++) {
+	    b->results[j].short_offset += pos;
+	    b->results[j].shortest_offset += pos;
+	}
+	pos = b->results[i + k - 1].shortest_offset +
+		b->results[i + k - 1].shortest_len;
+    }
+
+    return NULL;
+}
+
+/* Shorten the names of the batch and pass its output lines to @by_seq */
+static void batch_flush(struct batch *b, struct shorten_job *jobs,
+		struct sorter *by_seq)
+{
+    pthread_t threads[n_threads];
+    static char *out;
+    static size_t out_size;
+    const struct shortener_result *res;
+    const struct rec *r;
+    const char *forms;
+    size_t i, per_job, len;
+    int n_jobs, t;
+
+    if (!b->n_recs)
+	return;
+
+    per_job = (b->n_names + n_threads - 1) / n_threads;
+    n_jobs = (b->n_names + per_job - 1) / per_job;
+    for (t = 0; t < n_jobs; t ++) {
+	jobs[t].b = b;
+	jobs[t].first = t * per_job;
+	jobs[t].end = (t + 1) * per_job < b->n_names ?
+		(t + 1) * per_job : b->n_names;
+    }
+    for (t = 1; t < n_jobs; t ++)
+	pthread_create(&threads[t], NULL, shorten_thread, &jobs[t]);
+    shorten_thread(&jobs[0]);
+    for (t = 1; t < n_jobs; t ++)
+	pthread_join(threads[t], NULL);
+
+    for (i = 0, r = b->recs; i < b->n_recs; i ++, r ++) {
+	res = &b->results[b->rec_name[i]];
+	forms = jobs[b->rec_name[i] / per_job].arena;
+
+	len = r->a_len + res->short_len + res->shortest_len + 3;
+	if (len > out_size) {
+	    out_size = len;
+	    out = xrealloc(out, out_size);
+	}
+	memcpy(out, r->data, r->a_len);
+	out[r->a_len] = '\t';
+	memcpy(out + r->a_len + 1, forms + res->short_offset, res->short_len);
+	out[r->a_len + 1 + res->short_len] = '\t';
+	memcpy(out + r->a_len + 2 + res->short_len,
+			forms + res->shortest_offset, res->shortest_len);
+	out[len - 1] = '\n';
+	sorter_add(by_seq, r->seq, out, len, "", 0);
+    }
+
+    b->n_recs = 0;
+    b->n_names = 0;
+    b->data_len = 0;
+}
+
+/*
+ * Copy the record to the batch, flushing it first if full.  @new_name
+ * says if the record's name differs from the one before it.
+ */
+static void batch_add(struct batch *b, struct shorten_job *jobs,
+		struct sorter *by_seq, const struct rec *r, int new_name)
+{
+    size_t len = r->a_len + r->b_len;
+    struct rec *copy;
+
+    if (b->n_recs == BATCH_RECS || (new_name && b->n_names == BATCH_NAMES) ||
+	    b->data_len + len > b->data_size)
+	batch_flush(b, jobs, by_seq);
+    if (len > b->data_size) {
+	b->data_size = len;
+	b->data = xrealloc(b->data, b->data_size);
+    }
+
+    copy = &b->recs[b->n_recs];
+    *copy = *r;
+    copy->data = b->data + b->data_len;
+    memcpy(b->data + b->data_len, r->data, len);
+    b->data_len += len;
+
+    if (new_name || !b->n_names) {
+	b->names[b->n_names] = copy->data + copy->a_len;
+	b->lens[b->n_names ++] = copy->b_len;
+    }
+    b->rec_name[b->n_recs ++] = b->n_names - 1;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-j <threads>] [-m <memory MiB>] "
+		    "[-T <tmp dir>] [-l <languages>] [-d <dictionary>] "
+		    "[<file>]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct shortener *sh;
+    struct sorter by_name, by_seq;
+    struct merger m;
+    struct source name_srcs[MAX_SOURCES], seq_srcs[MAX_SOURCES];
+    const struct rec *r;
+    const char *dict = NULL, *langs = NULL, *tab, *name;
+    char *line = NULL, *prev = NULL;
+    size_t memory = 256, line_size = 0, prev_size = 0, prev_len = 0, i;
+    struct batch *batch;
+    struct shorten_job *jobs;
+    unsigned long distinct = 0;
+    uint64_t seq = 0;
+    ssize_t line_len;
+    FILE *in = stdin;
+    int opt, new_name;
+
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads < 1)
+	n_threads = 1;
+    if (getenv("TMPDIR"))
+	tmp_dir = getenv("TMPDIR");
+
+    while ((opt = getopt(argc, argv, "j:m:T:l:d:")) != -1)
+	switch (opt) {
+	case 'j':
+	    n_threads = atoi(optarg);
+	    break;
+	case 'm':
+	    memory = atol(optarg);
+	    break;
+	case 'T':
+	    tmp_dir = optarg;
+	    break;
+	case 'l':
+	    langs = optarg;
+	    break;
+	case 'd':
+	    dict = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    if (optind + 1 < argc || n_threads < 1 || memory < 2)
+	usage(argv[0]);
+
+    if (optind < argc) {
+	in = fopen(argv[optind], "r");
+	if (!in) {
+	    perror(argv[optind]);
+	    return 1;
+	}
+    }
+
+    sh = dict ? shortener_load(dict) : shortener_new();
+    if (!sh) {
+	fprintf(stderr, "%s: Can't load dictionary\n", dict ? dict : "built-in");
+	return 1;
+    }
+
+    /*
+     * Half of the memory for each sort, the last records of the first one
+     * are still in memory while the second one fills up.
+     */
+    memory <<= 20;
+    sorter_init(&by_name, cmp_name, memory / 2);
+    sorter_init(&by_seq, cmp_seq, memory / 2);
+
+    while ((line_len = getline(&line, &line_size, in)) > 0) {
+	if (line[line_len - 1] == '\n')
+	    line_len --;
+	tab = memchr(line, '\t', line_len);
+	if (tab)
+	    sorter_add(&by_name, seq ++, line, tab - line,
+			    tab + 1, line + line_len - tab - 1);
+	else
+	    sorter_add(&by_name, seq ++, "", 0, line, line_len);
+    }
+    if (ferror(in)) {
+	perror(optind < argc ? argv[optind] : "stdin");
+	return 1;
+    }
+    free(line);
+
+    /* Shorten every distinct name once and queue the lines in input order */
+    batch = xrealloc(NULL, sizeof(*batch));
+    batch->data_size = BATCH_SIZE;
+    batch->data = xrealloc(NULL, batch->data_size);
+    batch->n_recs = batch->n_names = batch->data_len = 0;
+    for (i = 0; i < BATCH_NAMES; i ++)
+	batch->langs[i] = langs;
+    jobs = xrealloc(NULL, n_threads * sizeof(*jobs));
+    for (i = 0; i < (size_t) n_threads; i ++) {
+	jobs[i].sh = sh;
+	jobs[i].arena_size = 1 << 16;
+	jobs[i].arena = xrealloc(NULL, jobs[i].arena_size);
+    }
+
+    sorter_finish(&by_name, &m, name_srcs);
+    for (; (r = merger_peek(&m)); merger_pop(&m)) {
+	name = r->data + r->a_len;
+	new_name = !distinct || r->b_len != prev_len ||
+		memcmp(name, prev, prev_len);
+	if (new_name) {
+	    if (r->b_len > prev_size) {
+		prev_size = r->b_len;
+		prev = xrealloc(prev, prev_size);
+	    }
+	    memcpy(prev, name, r->b_len);
+	    prev_len = r->b_len;
+	    distinct ++;
+	}
+	batch_add(batch, jobs, &by_seq, r, new_name);
+    }
+    batch_flush(batch, jobs, &by_seq);
+    merger_free(&m);
+    sorter_free(&by_name, name_srcs);
+
+    sorter_finish(&by_seq, &m, seq_srcs);
+    for (; (r = merger_peek(&m)); merger_pop(&m))
+	fwrite(r->data, 1, r->a_len, stdout);
+    merger_free(&m);
+    sorter_free(&by_seq, seq_srcs);
+
+    fprintf(stderr, "%llu records, %lu distinct names, %lu + %lu runs\n",
+		    (unsigned long long) seq, distinct,
+		    by_name.total_runs, by_seq.total_runs);
+
+    for (i = 0; i < (size_t) n_threads; i ++)
+	free(jobs[i].arena);
+    free(jobs);
+    free(batch->data);
+    free(batch);
+    free(prev);
+    shortener_free(sh);
+    if (in != stdin)
+	fclose(in);
+
+    return fflush(stdout) || ferror(stdout) ? 1 : 0;
+}
@@ -0,0 +1,282 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Memoizing cache in front of a struct shortener.  Map data repeats the
+ * same names over and over so the results are kept in a bounded hash
+ * table keyed on the input bytes and the language list.
+ *
+ * The table is split into shards, each with its own lock, picked by the
+ * top bits of the hash so that threads rarely wait for each other.  Inside
+ * a shard it's open addressing: an entry can be in one of CACHE_WAYS slots
+ * following its home slot, and when they're all taken the least recently
+ * used one is replaced.  Names are shortened outside of the lock.
+ *
+ * In front of a live context every entry remembers the generation of the
+ * context it came from and only matches in the same one, the entries of
+ * older generations are the first to be replaced.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "shortnames.h"
+#include "phash.h"
+
+#define CACHE_SHARDS	64
+#define CACHE_WAYS	8
+
+struct cache_entry {
+    uint64_t hash;
+    unsigned long generation;
+    unsigned long used;		/* Shard's clock at the last hit */
+    char *data;			/* Name, langs, short, shortest */
+    unsigned short name_len, langs_len, short_len, shortest_len;
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry *slots;
+    unsigned long clock, hits, misses;
+};
+
+struct shortener_cache {
+    const struct shortener *sh;
+    struct shortener_live *live;	/* Instead of @sh */
+    unsigned int n_slots;	/* Per shard, a power of two */
+    struct cache_shard shards[CACHE_SHARDS];
+};
+
+static struct shortener_cache *cache_new(const struct shortener *sh,
+		struct shortener_live *live, size_t max_entries)
+{
+    struct shortener_cache *cache = calloc(1, sizeof(*cache));
+    int i;
+
+    if (!cache)
+	return NULL;
+
+    cache->sh = sh;
+    cache->live = live;
+    cache->n_slots = CACHE_WAYS;
+    while (cache->n_slots * CACHE_SHARDS < max_entries)
+	cache->n_slots <<= 1;
+
+    for (i = 0; i < CACHE_SHARDS; i ++) {
+	pthread_mutex_init(&cache->shards[i].lock, NULL);
+	cache->shards[i].slots = calloc(cache->n_slots,
+			sizeof(struct cache_entry));
+	if (!cache->shards[i].slots) {
+	    shortener_cache_free(cache);
+	    return NULL;
+	}
+    }
+
+    return cache;
+}
+
+struct shortener_cache *shortener_cache_new(const struct shortener *sh,
+		size_t max_entries)
+{
+    return cache_new(sh, NULL, max_entries);
+}
+
+struct shortener_cache *shortener_cache_new_live(struct shortener_live *live,
+		size_t max_entries)
+{
+    return cache_new(NULL, live, max_entries);
+}
+
+void shortener_cache_free(struct shortener_cache *cache)
+{
+    int i, j;
+
+    if (!cache)
+	return;
+
+    for (i = 0; i < CACHE_SHARDS; i ++) {
+	if (cache->shards[i].slots)
+	    for (j = 0; j < cache->n_slots; j ++)
+		free(cache->shards[i].slots[j].data);
+	free(cache->shards[i].slots);
+	pthread_mutex_destroy(&cache->shards[i].lock);
+    }
+    free(cache);
+}
+
+static uint64_t cache_hash(const char *name, size_t len, const char *langs)
+{
+    uint64_t h = PHASH_INIT;
+
+    while (len --)
+	h = phash_step(h, (unsigned char) *name ++);
+    h = phash_step(h, 0);
+    while (*langs)
+	h = phash_step(h, (unsigned char) *langs ++);
+
+    return phash_mix(h);
+}
+
+/*
+ * Both forms are capped at 511 bytes like in shortener_shorten_lang(), a
+ * form that is longer is left cut where it stopped fitting.
+ */
+static void shorten(const struct shortener *sh,
+		const char *name, size_t len, const char *langs,
+		char short_name[512], char shortest_name[512])
+{
+    size_t short_len, shortest_len;
+
+    short_name[511] = shortest_name[511] = 0;
+    shortener_shorten_n(sh, name, len, langs, short_name, 511, &short_len,
+		    shortest_name, 511, &shortest_len);
+
+    if (short_len > 511)
+	short_len = strlen(short_name);
+    if (shortest_len > 511)
+	shortest_len = strlen(shortest_name);
+    short_name[short_len] = 0;
+    shortest_name[shortest_len] = 0;
+}
+
+static int cache_entry_match(const struct cache_entry *e, uint64_t hash,
+		unsigned long generation,
+		const char *name, size_t len, const char *langs, size_t langs_len)
+{
+    return e->data && e->hash == hash && e->generation == generation &&
+	e->name_len == len &&
+	e->langs_len == langs_len && !memcmp(e->data, name, len) &&
+	!memcmp(e->data + len, langs, langs_len);
+}
+
+static void cache_shorten(struct shortener_cache *cache,
+		const struct shortener *sh, unsigned long generation,
+		const char *name, size_t len, const char *langs,
+		char short_name[512], char shortest_name[512])
+{
+    uint64_t hash;
+    struct cache_shard *shard;
+    struct cache_entry *e, *victim;
+    size_t langs_len;
+    unsigned int slot, i;
+    char *data;
+
+    /* No languages and "" mean the same */
+    if (!langs)
+	langs = "";
+    langs_len = strlen(langs);
+
+    /* Don't bother with the long ones, they're also the rare ones */
+    if (len >= 0x10000 || langs_len >= 0x10000) {
+	shorten(sh, name, len, langs, short_name, shortest_name);
+	return;
+    }
+
+    hash = cache_hash(name, len, langs);
+    shard = &cache->shards[hash >> 58];
+    slot = hash & (cache->n_slots - 1);
+
+    pthread_mutex_lock(&shard->lock);
+    for (i = 0; i < CACHE_WAYS; i ++) {
+	e = &shard->slots[(slot + i) & (cache->n_slots - 1)];
+	if (!cache_entry_match(e, hash, generation,
+				name, len, langs, langs_len))
+	    continue;
+
+	e->used = ++ shard->clock;
+	shard->hits ++;
+	data = e->data + e->name_len + e->langs_len;
+	memcpy(short_name, data, e->short_len);
+	short_name[e->short_len] = 0;
+	data += e->short_len;
+	memcpy(shortest_name, data, e->shortest_len);
+	shortest_name[e->shortest_len] = 0;
+	pthread_mutex_unlock(&shard->lock);
+	return;
+    }
+    shard->misses ++;
+    pthread_mutex_unlock(&shard->lock);
+
+    shorten(sh, name, len, langs, short_name, shortest_name);
+
+    data = malloc(len + langs_len + strlen(short_name) +
+		    strlen(shortest_name) + 1);
+    if (!data)
+	return;
+
+    pthread_mutex_lock(&shard->lock);
+    victim = NULL;
+    for (i = 0; i < CACHE_WAYS; i ++) {
+	e = &shard->slots[(slot + i) & (cache->n_slots - 1)];
+
+	/* Someone else was quicker */
+	if (cache_entry_match(e, hash, generation,
+				name, len, langs, langs_len)) {
+	    pthread_mutex_unlock(&shard->lock);
+	    free(data);
+	    return;
+	}
+
+	if (!victim || (victim->data && (!e->data ||
+			e->generation < victim->generation ||
+			(e->generation == victim->generation &&
+			 e->used < victim->used))))
+	    victim = e;
+    }
+
+    free(victim->data);
+    victim->data = data;
+    victim->hash = hash;
+    victim->generation = generation;
+    victim->used = ++ shard->clock;
+    victim->name_len = len;
+    victim->langs_len = langs_len;
+    victim->short_len = strlen(short_name);
+    victim->shortest_len = strlen(shortest_name);
+    memcpy(data, name, len);
+    data += len;
+    memcpy(data, langs, langs_len);
+    data += langs_len;
+    memcpy(data, short_name, victim->short_len);
+    data += victim->short_len;
+    memcpy(data, shortest_name, victim->shortest_len);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void shortener_cache_shorten(struct shortener_cache *cache,
+		const char *name, size_t len, const char *langs,
+		char short_name[512], char shortest_name[512])
+{
+    const struct shortener *sh;
+    unsigned long generation;
+    unsigned int ticket;
+
+    if (!cache->live) {
+	cache_shorten(cache, cache->sh, 0, name, len, langs,
+			short_name, shortest_name);
+	return;
+    }
+
+    sh = shortener_live_get(cache->live, &ticket, &generation);
+    cache_shorten(cache, sh, generation, name, len, langs,
+		    short_name, shortest_name);
+    shortener_live_put(cache->live, ticket);
+}
+
+void shortener_cache_stats(struct shortener_cache *cache,
+		unsigned long *hits, unsigned long *misses)
+{
+    int i;
+
+    *hits = *misses = 0;
+    for (i = 0; i < CACHE_SHARDS; i ++) {
+	pthread_mutex_lock(&cache->shards[i].lock);
+	*hits += cache->shards[i].hits;
+	*misses += cache->shards[i].misses;
+	pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+}
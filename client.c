@@ -0,0 +1,240 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Client side of the shrtnmsd protocol described in proto.h.  Every call
+ * sends one request and blocks until its response arrives, so there's
+ * only ever one request in flight on a connection.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "shortnames.h"
+#include "proto.h"
+
+struct shortener_client {
+    int fd;
+    uint32_t id;
+    uint8_t *buf;		/* The request, then the response */
+    size_t size;
+};
+
+struct shortener_client *shortener_client_new(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct shortener_client *client;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+	return NULL;
+    strcpy(addr.sun_path, path);
+
+    client = calloc(1, sizeof(*client));
+    if (!client)
+	return NULL;
+
+    client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->fd < 0 ||
+	    connect(client->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+	shortener_client_free(client);
+	return NULL;
+    }
+
+    return client;
+}
+
+void shortener_client_free(struct shortener_client *client)
+{
+    if (!client)
+	return;
+
+    if (client->fd >= 0)
+	close(client->fd);
+    free(client->buf);
+    free(client);
+}
+
+static int client_reserve(struct shortener_client *client, size_t size)
+{
+    uint8_t *buf;
+
+    if (size <= client->size)
+	return 0;
+
+    buf = realloc(client->buf, size);
+    if (!buf)
+	return -1;
+    client->buf = buf;
+    client->size = size;
+    return 0;
+}
+
+static int read_full(int fd, uint8_t *p, size_t len)
+{
+    ssize_t ret;
+
+    for (; len; p += ret, len -= ret) {
+	ret = read(fd, p, len);
+	if (ret < 0 && errno == EINTR)
+	    ret = 0;
+	else if (ret <= 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Send the request of @len bytes in the buffer and read the response into
+ * the buffer, returns its length or -1.
+ */
+static ssize_t client_request(struct shortener_client *client, size_t len)
+{
+    uint32_t id = client->id ++;
+    uint8_t *p;
+    ssize_t ret;
+
+    proto_put32(client->buf, len - 4);
+    proto_put32(client->buf + 4, id);
+
+    for (p = client->buf; len; p += ret, len -= ret) {
+	ret = send(client->fd, p, len, MSG_NOSIGNAL);
+	if (ret < 0 && errno == EINTR)
+	    ret = 0;
+	else if (ret < 0)
+	    return -1;
+    }
+
+    if (read_full(client->fd, client->buf, 4))
+	return -1;
+    len = proto_get32(client->buf);
+    if (len < PROTO_HEADER_SIZE - 4 || len > PROTO_MAX_FRAME ||
+	    client_reserve(client, 4 + len) ||
+	    read_full(client->fd, client->buf + 4, len) ||
+	    proto_get32(client->buf + 4) != id)
+	return -1;
+
+    return 4 + len;
+}
+
+/* Append a name to the request being built at @len, returns the new length */
+static size_t client_add(struct shortener_client *client, size_t len,
+		const char *name, size_t name_len, const char *langs)
+{
+    size_t langs_len = strlen(langs);
+
+    proto_put16(client->buf + len, name_len);
+    client->buf[len + 2] = langs_len;
+    memcpy(client->buf + len + 3, name, name_len);
+    memcpy(client->buf + len + 3 + name_len, langs, langs_len);
+    return len + 3 + name_len + langs_len;
+}
+
+int shortener_client_shorten(struct shortener_client *client,
+		const char *name, const char *langs,
+		char short_name[512], char shortest_name[512])
+{
+    size_t len = strlen(name), short_len, shortest_len;
+    ssize_t resp_len;
+    const uint8_t *p;
+
+    if (!langs)
+	langs = "";
+    if (len > PROTO_MAX_NAME || strlen(langs) > PROTO_MAX_LANGS ||
+	    client_reserve(client, PROTO_HEADER_SIZE + 3 + len +
+		    PROTO_MAX_LANGS))
+	return -1;
+
+    proto_put32(client->buf + 8, 1);
+    len = client_add(client, PROTO_HEADER_SIZE, name, len, langs);
+
+    resp_len = client_request(client, len);
+    if (resp_len < PROTO_HEADER_SIZE + 4 || proto_get32(client->buf + 8) != 1)
+	return -1;
+
+    p = client->buf + PROTO_HEADER_SIZE;
+    short_len = proto_get16(p);
+    shortest_len = proto_get16(p + 2);
+    if (short_len > 511 || shortest_len > 511 ||
+	    PROTO_HEADER_SIZE + 4 + short_len + shortest_len != resp_len)
+	return -1;
+
+    memcpy(short_name, p + 4, short_len);
+    short_name[short_len] = 0;
+    memcpy(shortest_name, p + 4 + short_len, shortest_len);
+    shortest_name[shortest_len] = 0;
+    return 0;
+}
+
+int shortener_client_shorten_batch(struct shortener_client *client,
+		size_t count, const char *const *names, const size_t *lens,
+		const char *const *langs,
+		char *arena, size_t arena_size,
+		struct shortener_result *results, size_t *done)
+{
+    const uint8_t *p, *end;
+    const char *l;
+    size_t len = PROTO_HEADER_SIZE, i, n, pos = 0, short_len, shortest_len;
+    ssize_t resp_len;
+
+    *done = 0;
+    if (!count)
+	return 0;
+
+    for (n = 0; n < count; n ++) {
+	l = langs && langs[n] ? langs[n] : "";
+	if (lens[n] > PROTO_MAX_NAME || strlen(l) > PROTO_MAX_LANGS)
+	    break;
+	/* Both the request and the longest possible response must fit */
+	if (len + 3 + lens[n] + strlen(l) > 4 + PROTO_MAX_FRAME ||
+		PROTO_HEADER_SIZE + (n + 1) * (4 + 2 * 511) >
+		4 + PROTO_MAX_FRAME)
+	    break;
+	if (client_reserve(client, len + 3 + lens[n] + PROTO_MAX_LANGS))
+	    return -1;
+	len = client_add(client, len, names[n], lens[n], l);
+    }
+    if (!n)
+	return -1;
+
+    proto_put32(client->buf + 8, n);
+    /* The daemon may answer fewer names than were sent */
+    resp_len = client_request(client, len);
+    if (resp_len < 0 || !proto_get32(client->buf + 8) ||
+	    proto_get32(client->buf + 8) > n)
+	return -1;
+    n = proto_get32(client->buf + 8);
+
+    p = client->buf + PROTO_HEADER_SIZE;
+    end = client->buf + resp_len;
+    for (i = 0; i < n; i ++) {
+	if (end - p < 4)
+	    return -1;
+	short_len = proto_get16(p);
+	shortest_len = proto_get16(p + 2);
+	p += 4;
+	if ((size_t) (end - p) < short_len + shortest_len)
+	    return -1;
+
+	if (pos + short_len + shortest_len > arena_size)
+	    break;
+	memcpy(arena + pos, p, short_len + shortest_len);
+	results[i].short_offset = pos;
+	results[i].short_len = short_len;
+	results[i].shortest_offset = pos + short_len;
+	results[i].shortest_len = shortest_len;
+	pos += short_len + shortest_len;
+	p += short_len + shortest_len;
+    }
+
+    *done = i;
+    return 0;
+}
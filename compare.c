@@ -0,0 +1,300 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Runs the reference engine from reference.c and shortener_shorten() side
+ * by side, first checking that they give the same output for every name,
+ * with all languages and with a random list of them, and then timing each
+ * of them alone with all languages.  The names are random UTF-8 made of
+ * the dictionary's own phrases and given names in random case, random
+ * words in various scripts, separators and the odd invalid sequence, and
+ * also the lines of a file if one is given, e.g. a corpus written by
+ * shrtnms-bench -o.  Exits with 1 if there were any differences.
+ *
+ * Usage: shrtnms-compare [-n <names>] [-s <seed>] [<file>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shortnames.h"
+#include "dict.h"
+#include "unicode.h"
+#include "reference.h"
+
+struct name_set {
+    char **names;
+    size_t count, bytes;
+};
+
+static struct shortener *sh;
+static size_t n_phrases, n_given;
+
+static unsigned int rnd_state = 1;
+
+static unsigned int rnd(unsigned int n)
+{
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return (rnd_state >> 16) % n;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Letters, digits, marks and symbols from a few scripts */
+static const wchar_t word_chars[][2] = {
+    { 'a', 'z' }, { 'a', 'z' }, { 'A', 'Z' }, { '0', '9' },
+    { 0xc0, 0xff }, { 0x100, 0x17f }, { 0x391, 0x3c9 }, { 0x400, 0x44f },
+    { 0x5d0, 0x5ea }, { 0x300, 0x36f }, { 0x4e00, 0x4e80 },
+    { 0x1f600, 0x1f64f }, { 0x130, 0x131 }, { 0xdf, 0xdf },
+};
+
+static const char *separators[] = {
+    " ", " ", " ", " ", "  ", "\t", "\xc2\xa0", "-", ". ", ", ", " (", ") ",
+    "'", ".", "\xe2\x80\x94", "",
+};
+
+/* Append @str to @buf at @len, in random case */
+static size_t put_cased(char *buf, size_t len, const char *str)
+{
+    int mode = rnd(4), first = 1, n;
+    wchar_t c;
+
+    for (; (c = utf8_get(str, &n)); str += n, first = 0) {
+	if (mode == 1 || (mode == 2 && first))
+	    c = uc_toupper(c);
+	len += utf8_put(buf + len, c);
+    }
+
+    return len;
+}
+
+static char *gen_name(void)
+{
+    char buf[8192];
+    size_t len = 0;
+    int words = rnd(20) ? 1 + rnd(6) : 1 + rnd(300), i, j, k;
+    const wchar_t *range;
+
+    for (i = 0; i < words && len < sizeof(buf) - 512; i ++) {
+	if (i || !rnd(8))
+	    len += sprintf(buf + len, "%s",
+			    separators[rnd(ARRAY_SIZE(separators))]);
+
+	switch (rnd(10)) {
+	case 0: case 1: case 2: case 3:
+	    len = put_cased(buf, len,
+			    shortener_stats_entry(sh, rnd(n_phrases), NULL));
+	    break;
+	case 4: case 5:
+	    if (n_given) {
+		len = put_cased(buf, len,
+				shortener_stats_name(sh, rnd(n_given)));
+		break;
+	    }
+	    /* Fall through */
+	default:
+	    range = word_chars[rnd(ARRAY_SIZE(word_chars))];
+	    for (j = 1 + rnd(10); j; j --) {
+		if (rnd(5))
+		    k = range[0] + rnd(range[1] - range[0] + 1);
+		else
+		    k = word_chars[0][0] + rnd(26);
+		len += utf8_put(buf + len, k);
+	    }
+	}
+
+	/* A stray continuation byte or a cut off sequence */
+	if (!rnd(200))
+	    buf[len ++] = rnd(2) ? 0x80 + rnd(0x40) : 0xc5;
+    }
+
+    buf[len] = 0;
+    return strdup(buf);
+}
+
+static void set_add(struct name_set *set, char *name)
+{
+    if (!(set->count & (set->count - 1)))
+	set->names = realloc(set->names,
+			(set->count ? set->count * 2 : 1) * sizeof(char *));
+    if (!set->names || !name) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+
+    set->names[set->count ++] = name;
+    set->bytes += strlen(name);
+}
+
+static void read_names(struct name_set *set, const char *path)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+	perror(path);
+	exit(1);
+    }
+
+    while ((len = getline(&line, &size, f)) > 0) {
+	if (line[len - 1] == '\n')
+	    line[len - 1] = 0;
+	set_add(set, strdup(line));
+    }
+
+    free(line);
+    fclose(f);
+}
+
+/* One to three of the dictionary's languages, or the odd unknown one */
+static void random_langs(char *buf)
+{
+    const struct dict_header *hdr = (const void *) dict_builtin;
+    const struct dict_lang *dlangs = (const void *)
+	    (dict_builtin + hdr->langs);
+    int n;
+
+    *buf = 0;
+    for (n = 1 + rnd(3); n && hdr->n_langs; n --) {
+	if (*buf)
+	    strcat(buf, rnd(2) ? ";" : ", ");
+	strcat(buf, rnd(16) ? dlangs[rnd(hdr->n_langs)].code : "xx");
+	if (!rnd(16))
+	    strcat(buf, "-PE");
+    }
+}
+
+static size_t check(const struct name_set *set)
+{
+    char ref_short[512], ref_shortest[512];
+    char short_name[512], shortest_name[512];
+    char langs[64];
+    size_t i, diffs = 0;
+    int j;
+
+    for (i = 0; i < set->count; i ++)
+	for (j = 0; j < 2; j ++) {
+	    if (j)
+		random_langs(langs);
+	    reference_shorten_lang(dict_builtin, set->names[i],
+			    j ? langs : NULL, ref_short, ref_shortest);
+	    shortener_shorten_lang(sh, set->names[i], j ? langs : NULL,
+			    short_name, shortest_name);
+
+	    if (!strcmp(ref_short, short_name) &&
+		    !strcmp(ref_shortest, shortest_name))
+		continue;
+
+	    if (diffs ++ < 10)
+		printf("  %s [%s]\n    reference: %s | %s\n"
+				"    shortener: %s | %s\n",
+				set->names[i], j ? langs : "",
+				ref_short, ref_shortest,
+				short_name, shortest_name);
+	}
+
+    return diffs;
+}
+
+static uint64_t time_engine(const struct name_set *set, int reference)
+{
+    char short_name[512], shortest_name[512];
+    uint64_t start = now_ns();
+    size_t i;
+
+    for (i = 0; i < set->count; i ++)
+	if (reference)
+	    reference_shorten(dict_builtin, set->names[i],
+			    short_name, shortest_name);
+	else
+	    shortener_shorten(sh, set->names[i],
+			    short_name, shortest_name);
+
+    return now_ns() - start;
+}
+
+static size_t compare(const char *label, const struct name_set *set)
+{
+    uint64_t ref_ns, opt_ns;
+    size_t diffs;
+
+    printf("%s: %zu names, %zu bytes\n", label, set->count, set->bytes);
+    diffs = check(set);
+
+    ref_ns = time_engine(set, 1);
+    opt_ns = time_engine(set, 0);
+
+    printf("  reference %10.0f names/s %8.1f MB/s\n",
+		    set->count * 1e9 / ref_ns, set->bytes * 1e3 / ref_ns);
+    printf("  shortener %10.0f names/s %8.1f MB/s, %.1fx\n",
+		    set->count * 1e9 / opt_ns, set->bytes * 1e3 / opt_ns,
+		    (double) ref_ns / opt_ns);
+    printf("  %zu differences\n", diffs);
+
+    return diffs;
+}
+
+int main(int argc, char *argv[])
+{
+    struct name_set random = { 0 }, file = { 0 };
+    size_t count = 100000, i, diffs;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1)
+	switch (opt) {
+	case 'n':
+	    count = atol(optarg);
+	    break;
+	case 's':
+	    rnd_state = atoi(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "Usage: %s [-n <names>] [-s <seed>] [<file>]\n",
+			    argv[0]);
+	    return 1;
+	}
+
+    sh = shortener_new();
+    if (!sh) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+    while (shortener_stats_entry(sh, n_phrases, NULL))
+	n_phrases ++;
+    while (shortener_stats_name(sh, n_given))
+	n_given ++;
+
+    for (i = 0; i < count; i ++)
+	set_add(&random, gen_name());
+    diffs = compare("Random", &random);
+
+    if (optind < argc) {
+	read_names(&file, argv[optind]);
+	diffs += compare(argv[optind], &file);
+    }
+
+    for (i = 0; i < random.count; i ++)
+	free(random.names[i]);
+    for (i = 0; i < file.count; i ++)
+	free(file.names[i]);
+    free(random.names);
+    free(file.names);
+    shortener_free(sh);
+
+    return diffs ? 1 : 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * The binary dictionary image written by mkdict from a .dict source file,
+ * either mmapped by shortener_load() or built into the library.  There are
+ * no pointers in it, everything is referenced by offsets from the start of
+ * the image or by indices into the tables, so it can be used directly
+ * wherever it is mapped.  Integers are in the byte order of the machine
+ * mkdict ran on, which the loader checks through @byte_order.
+ *
+ * The abbreviation phrases are compiled into tries keyed on lower case
+ * characters, one trie for every language plus one for all of them, all
+ * sharing the nodes table.  Each of them is further split by dict_script()
+ * of the phrases' first character so that a word is only looked up among
+ * the phrases starting in its own script, or not at all if there are none.
+ * Children of a node are stored next to each other sorted by character so
+ * they can be binary searched, and each node has the index of the first
+ * entry whose phrase ends there, so that the order of the source file gives
+ * the priority.  The given names are stored in a minimal perfect hash, see
+ * phash.h, and the header has the scripts they start in.
+ *
+ * Languages that write compound words together, like German, also have
+ * a suffix trie of the compound heads ("straße" in "Hauptstraße"), keyed on
+ * the heads' characters from last to first so that the longest head ending
+ * a word is found in one walk backwards from the word's end.  The heads are
+ * entries too but aren't in the phrase tries.
+ */
+
+#include <stdint.h>
+
+#define DICT_MAGIC	"SHRTNMS"
+#define DICT_VERSION	3
+#define DICT_BYTE_ORDER	0x01020304
+#define DICT_MAX_LANGS	32
+#define DICT_NO_TRIE	0xffffffff
+
+/*
+ * Only a rough split, what matters is that a lower case character always
+ * gets the same script as the first character of the phrases it can match.
+ */
+#define DICT_SCRIPT_LATIN	0	/* Also digits and everything below */
+#define DICT_SCRIPT_GREEK	1
+#define DICT_SCRIPT_CYRILLIC	2
+#define DICT_SCRIPT_OTHER	3
+#define DICT_SCRIPTS		4
+
+static inline int dict_script(uint32_t c)
+{
+    if (c < 0x370 || (c >= 0x1e00 && c < 0x1f00))
+	return DICT_SCRIPT_LATIN;
+    if (c < 0x400 || (c >= 0x1f00 && c < 0x2000))
+	return DICT_SCRIPT_GREEK;
+    if (c < 0x530 || (c >= 0x1c80 && c < 0x1c90) ||
+	    (c >= 0x2de0 && c < 0x2e00) || (c >= 0xa640 && c < 0xa6a0))
+	return DICT_SCRIPT_CYRILLIC;
+    return DICT_SCRIPT_OTHER;
+}
+
+struct dict_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t size;		/* Of the whole image */
+
+    uint32_t strings, strings_size;
+    uint32_t entries, n_entries;
+    uint32_t nodes, n_nodes;
+    uint32_t langs, n_langs;
+    uint32_t all_tries[DICT_SCRIPTS];	/* Roots or DICT_NO_TRIE */
+    uint32_t names, n_names;	/* Perfect hash slots */
+    uint32_t name_scripts;	/* Bit mask of the given names' scripts */
+    uint32_t disp, n_buckets;	/* Displacement of every bucket */
+};
+
+struct dict_entry {
+    uint32_t phrase, abbrev;	/* Offsets into the strings */
+    uint32_t abbrev_len;
+    uint32_t flags;
+};
+
+/* Class of the phrase in the entry flags, for the abbreviation ladder */
+#define DICT_CLASS_MASK		3
+#define DICT_CLASS_OTHER	0
+#define DICT_CLASS_TYPE		1
+#define DICT_CLASS_TITLE	2
+
+/* The entry is a compound head, only in the suffix tries */
+#define DICT_COMPOUND		4
+
+struct dict_node {
+    uint32_t c;
+    uint32_t children;		/* Index of the first child */
+    uint32_t n_children;
+    int32_t match;		/* Entry index or -1 */
+};
+
+struct dict_lang {
+    char code[8];
+    uint32_t tries[DICT_SCRIPTS];	/* Roots or DICT_NO_TRIE */
+    uint32_t suffixes;		/* Root of the compound heads or DICT_NO_TRIE */
+};
+
+struct dict_name {
+    uint32_t key;		/* Offset of the lower case name */
+    uint32_t initial;		/* Offset of the abbreviated form, "Cz." */
+    uint32_t len;		/* Of the key in characters */
+    uint32_t index;		/* Order in the source file */
+    uint32_t langs;		/* Bit mask of languages */
+};
+
+/* The image of shortnames.dict generated at build time, dict-builtin.c */
+extern const unsigned char dict_builtin[];
+extern const size_t dict_builtin_size;
@@ -0,0 +1,355 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Fuzzing harness comparing shortener_shorten() against the reference
+ * engine in reference.c, and shortener_shorten_n() against
+ * shortener_shorten(), on arbitrary bytes.  The same is done with a list
+ * of languages picked from a hash of the input, which brings in the
+ * compound words, and the short form with the languages is checked against
+ * the SHORTENER_STEP_GIVEN_NAMES step of shortener_ladder() and against the
+ * name put back together from shortener_spans().  Those two never double
+ * whitespace or leave it at the end, so whitespace runs count as one space
+ * in these two checks.  Any difference aborts.
+ *
+ * Built with -DLIBFUZZER it's a libFuzzer target:
+ *
+ *   make shrtnms-fuzz CC=clang FUZZ_CFLAGS="-fsanitize=fuzzer,address -DLIBFUZZER"
+ *
+ * Otherwise every file given on the command line, or stdin, is one input,
+ * which is what afl-fuzz expects and is useful for replaying crashes:
+ *
+ *   make shrtnms-fuzz CC=afl-clang-fast
+ *   afl-fuzz -i corpus -o findings ./shrtnms-fuzz @@
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "shortnames.h"
+#include "dict.h"
+#include "unicode.h"
+#include "reference.h"
+
+static struct shortener *sh;
+
+static void dump(const char *label, const char *str, size_t len)
+{
+    size_t i;
+
+    fprintf(stderr, "%s: \"", label);
+    for (i = 0; i < len; i ++)
+	if ((unsigned char) str[i] < 0x20 || str[i] == '"' || str[i] == '\\')
+	    fprintf(stderr, "\\x%02x", (unsigned char) str[i]);
+	else
+	    fputc(str[i], stderr);
+    fprintf(stderr, "\"\n");
+}
+
+static void mismatch(const char *what, const char *name,
+		const char *expected, const char *got)
+{
+    fprintf(stderr, "Mismatch in %s\n", what);
+    dump("name", name, strlen(name));
+    dump("expected", expected, strlen(expected));
+    dump("got", got, strlen(got));
+    abort();
+}
+
+/*
+ * A list of up to three of the dictionary's languages for @name, always
+ * the same one for the same name, sometimes with a region subtag or an
+ * unknown code.
+ */
+static void pick_langs(const char *name, char *buf)
+{
+    const struct dict_header *hdr = (const void *) dict_builtin;
+    const struct dict_lang *dlangs = (const void *)
+	    ((const unsigned char *) dict_builtin + hdr->langs);
+    uint32_t h = 2166136261u;
+    int n;
+
+    for (; *name; name ++)
+	h = (h ^ (unsigned char) *name) * 16777619;
+
+    *buf = 0;
+    for (n = 1 + h % 3, h /= 3; n && hdr->n_langs; n --, h /= 64) {
+	if (*buf)
+	    strcat(buf, h & 1 ? ";" : ", ");
+	if (h % 64 < 4)
+	    strcat(buf, "xx");
+	else
+	    strcat(buf, dlangs[(h >> 1) % hdr->n_langs].code);
+	if (h % 64 >= 60)
+	    strcat(buf, "-PE");
+    }
+}
+
+/*
+ * Copy @str to @buf dropping leading and trailing whitespace and all but
+ * the first character of every whitespace run.  @buf is NUL-terminated.
+ */
+static char *squeeze(char *buf, const char *str, size_t len)
+{
+    const char *end = str + len;
+    char *p = buf, *q = buf;
+    wchar_t c;
+    int n;
+
+    for (; str < end; str += n) {
+	c = utf8_get_n(str, end, &n);
+	if (!n)
+	    break;
+	if (uc_isspace(c) && (p == buf || p != q))
+	    continue;
+	memcpy(p, str, n);
+	p += n;
+	if (!uc_isspace(c))
+	    q = p;
+    }
+    *q = 0;
+
+    return buf;
+}
+
+/*
+ * Copy the separators from @str to @end, the way shorten() does up to any
+ * invalid sequence, which ends the name.
+ */
+static char *copy_gap(char *p, const char *str, const char *end)
+{
+    int n;
+
+    while (utf8_get_n(str, end, &n)) {
+	memcpy(p, str, n);
+	p += n;
+	str += n;
+    }
+
+    return p;
+}
+
+/* The name built back from its spans with the short form's replacements */
+static char *rebuild(const char *name, const struct shortener_span *spans,
+		size_t count)
+{
+    const struct shortener_span *sp;
+    size_t i, size = strlen(name) + 1, pos = 0;
+    char *buf, *p;
+    wchar_t c;
+    int n;
+
+    for (i = 0; i < count; i ++)
+	size += spans[i].replacement_len + 4;
+    buf = p = malloc(size);
+    if (!buf)
+	abort();
+
+    for (i = 0, sp = spans; i < count; i ++, sp ++) {
+	p = copy_gap(p, name + pos, name + sp->offset);
+	pos = sp->offset + sp->len;
+
+	if (sp->kind == SHORTENER_SPAN_WORD) {
+	    memcpy(p, name + sp->offset, sp->len);
+	    p += sp->len;
+	} else if (sp->replacement_len &&
+		(sp->flags & SHORTENER_SPAN_CAPITAL)) {
+	    c = utf8_get(sp->replacement, &n);
+	    p += utf8_put(p, uc_toupper(c));
+	    memcpy(p, sp->replacement + n, sp->replacement_len - n);
+	    p += sp->replacement_len - n;
+	} else {
+	    memcpy(p, sp->replacement, sp->replacement_len);
+	    p += sp->replacement_len;
+	}
+    }
+    *copy_gap(p, name + pos, name + strlen(name)) = 0;
+
+    return buf;
+}
+
+/* The reference, the ladder and the spans with the languages from @langs */
+static void check_langs(const char *name, const char *langs)
+{
+    char ref_short[512], ref_shortest[512];
+    char short_name[512], shortest_name[512];
+    char *buf, *full, *squeezed, *other;
+    struct shortener_step steps[SHORTENER_STEPS];
+    struct shortener_span *spans;
+    size_t len = strlen(name), short_len, shortest_len, size, count, i;
+
+    reference_shorten_lang(dict_builtin, name, langs, ref_short, ref_shortest);
+    shortener_shorten_lang(sh, name, langs, short_name, shortest_name);
+
+    if (strcmp(ref_short, short_name))
+	mismatch("short form with languages", name, ref_short, short_name);
+    if (strcmp(ref_shortest, shortest_name))
+	mismatch("shortest form with languages", name,
+			ref_shortest, shortest_name);
+
+    /* The untruncated short form */
+    size = len + 16;
+    buf = malloc(size * 2);
+    while (buf && shortener_shorten_n(sh, name, len, langs,
+			    buf, size, &short_len,
+			    buf + size, size, &shortest_len)) {
+	size = short_len > shortest_len ? short_len : shortest_len;
+	buf = realloc(buf, size * 2);
+    }
+    full = buf ? malloc(short_len + 1) : NULL;
+    squeezed = malloc(short_len + 1);
+    if (!full || !squeezed)
+	abort();
+    memcpy(full, buf, short_len);
+    full[short_len] = 0;
+    squeeze(squeezed, buf, short_len);
+
+    size = (len + 16) * SHORTENER_STEPS;
+    buf = realloc(buf, size);
+    while (buf && shortener_ladder(sh, name, len, langs, buf, size, steps)) {
+	for (i = 0, size = 0; i < SHORTENER_STEPS; i ++)
+	    if (size < steps[i].len)
+		size = steps[i].len;
+	size *= SHORTENER_STEPS;
+	buf = realloc(buf, size);
+    }
+    other = buf ? malloc(size + 1) : NULL;
+    if (!other)
+	abort();
+    squeeze(other, buf + steps[SHORTENER_STEP_GIVEN_NAMES].offset,
+		    steps[SHORTENER_STEP_GIVEN_NAMES].len);
+    if (strcmp(squeezed, other))
+	mismatch("shortener_ladder() given names step", name, full, other);
+    free(buf);
+
+    count = shortener_spans(sh, name, len, langs, NULL, 0);
+    spans = malloc((count + 1) * sizeof(*spans));
+    if (!spans)
+	abort();
+    if (shortener_spans(sh, name, len, langs, spans, count) != count)
+	abort();
+    buf = rebuild(name, spans, count);
+    free(other);
+    other = malloc(strlen(buf) + 1);
+    if (!other)
+	abort();
+    squeeze(other, buf, strlen(buf));
+    if (strcmp(squeezed, other))
+	mismatch("shortener_spans() rebuilt short form", name, full, other);
+    free(buf);
+    free(spans);
+
+    free(full);
+    free(squeezed);
+    free(other);
+}
+
+static void check(const char *name)
+{
+    char ref_short[512], ref_shortest[512];
+    char short_name[512], shortest_name[512];
+    char n_short[511], n_shortest[511];
+    char langs[64];
+    size_t short_len, shortest_len;
+
+    reference_shorten(dict_builtin, name, ref_short, ref_shortest);
+    shortener_shorten(sh, name, short_name, shortest_name);
+
+    if (strcmp(ref_short, short_name))
+	mismatch("short form", name, ref_short, short_name);
+    if (strcmp(ref_shortest, shortest_name))
+	mismatch("shortest form", name, ref_shortest, shortest_name);
+
+    pick_langs(name, langs);
+    check_langs(name, langs);
+
+    if (shortener_shorten_n(sh, name, strlen(name), NULL,
+			    n_short, sizeof(n_short), &short_len,
+			    n_shortest, sizeof(n_shortest), &shortest_len))
+	return;
+
+    if (short_len != strlen(short_name) ||
+	    memcmp(n_short, short_name, short_len)) {
+	n_short[short_len < 510 ? short_len : 510] = 0;
+	mismatch("shortener_shorten_n() short form", name,
+			short_name, n_short);
+    }
+    if (shortest_len != strlen(shortest_name) ||
+	    memcmp(n_shortest, shortest_name, shortest_len)) {
+	n_shortest[shortest_len < 510 ? shortest_len : 510] = 0;
+	mismatch("shortener_shorten_n() shortest form", name,
+			shortest_name, n_shortest);
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    char *name;
+
+    if (!sh) {
+	sh = shortener_new();
+	if (!sh)
+	    abort();
+    }
+
+    name = malloc(size + 1);
+    if (!name)
+	abort();
+    memcpy(name, data, size);
+    name[size] = 0;
+
+    check(name);
+    free(name);
+    return 0;
+}
+
+#ifndef LIBFUZZER
+static void run_file(FILE *f)
+{
+    uint8_t *data = NULL, *tmp;
+    size_t len = 0, size = 0, n;
+
+    while (1) {
+	if (len == size) {
+	    size = size ? size * 2 : 4096;
+	    tmp = realloc(data, size);
+	    if (!tmp)
+		abort();
+	    data = tmp;
+	}
+	n = fread(data + len, 1, size - len, f);
+	if (!n)
+	    break;
+	len += n;
+    }
+
+    LLVMFuzzerTestOneInput(data, len);
+    free(data);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *f;
+    int i;
+
+    if (argc < 2)
+	run_file(stdin);
+
+    for (i = 1; i < argc; i ++) {
+	f = fopen(argv[i], "rb");
+	if (!f) {
+	    perror(argv[i]);
+	    return 1;
+	}
+	run_file(f);
+	fclose(f);
+    }
+
+    return 0;
+}
+#endif
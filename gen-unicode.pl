@@ -0,0 +1,117 @@
+#! /usr/bin/env perl
+#
+# Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+#
+# Code in this file is for now licensed under the 2-clause BSD license.
+#
+# Generates unicode-tables.c from the Unicode Character Database as shipped
+# with Perl (Unicode::UCD), run "make unicode" to regenerate.  The
+# definitions follow those glibc uses for its C.UTF-8 locale so that the
+# results are the same as with iswalnum(), iswspace(), iswupper(),
+# towlower() and towupper():
+#   alnum: Alphabetic or General_Category=Nd
+#   space: White_Space, except the no-break spaces and U+0085
+#   upper: Uppercase or General_Category=Lt
+# and the simple (single character) case mappings.
+
+use strict;
+use warnings;
+use Unicode::UCD qw(prop_invlist prop_invmap);
+
+my $limit = 0x40000;
+my $shift = 7;
+
+sub set_of {
+    my @list = prop_invlist($_[0]);
+    my %set;
+
+    push(@list, 0x110000) if @list % 2;
+    for (my $i = 0; $i < @list; $i += 2) {
+	$set{$_} = 1 for $list[$i] .. $list[$i + 1] - 1;
+    }
+    return \%set;
+}
+
+sub mapping_of {
+    my ($list, $map, $format) = prop_invmap($_[0]);
+    my %mapping;
+
+    die "Unexpected $_[0] format $format" unless $format =~ /^a/;
+    for my $i (0 .. $#$list) {
+	next if ref $map->[$i] || $map->[$i] eq '0';
+	my $end = $i < $#$list ? $list->[$i + 1] : 0x110000;
+	$mapping{$_} = $map->[$i] + $_ - $list->[$i] for $list->[$i] .. $end - 1;
+    }
+    return \%mapping;
+}
+
+my $alpha = set_of('Alphabetic');
+my $digit = set_of('General_Category=Nd');
+my $white = set_of('White_Space');
+my $upper = set_of('Uppercase');
+my $title = set_of('General_Category=Lt');
+my $lower_map = mapping_of('Simple_Lowercase_Mapping');
+my $upper_map = mapping_of('Simple_Uppercase_Mapping');
+
+$white->{$_} = 0 for 0x85, 0xa0, 0x2007, 0x202f;
+
+# Records are (flags, lower case delta, upper case delta), record 0 is the
+# one for code points that have no properties
+my @records = ('0, 0, 0');
+my %record_ids = ($records[0] => 0);
+my @index;
+
+for my $c (0 .. 0x10ffff) {
+    my $flags = 0;
+    $flags |= 1 if $alpha->{$c} || $digit->{$c};
+    $flags |= 2 if $white->{$c};
+    $flags |= 4 if $upper->{$c} || $title->{$c};
+    my $lower = exists $lower_map->{$c} ? $lower_map->{$c} - $c : 0;
+    my $upper = exists $upper_map->{$c} ? $upper_map->{$c} - $c : 0;
+    my $record = "$flags, $lower, $upper";
+
+    if ($c >= $limit) {
+	die sprintf("U+%04X has properties beyond the table limit", $c)
+	    if $record ne $records[0];
+	next;
+    }
+
+    unless (exists $record_ids{$record}) {
+	$record_ids{$record} = @records;
+	push(@records, $record);
+    }
+    push(@index, $record_ids{$record});
+}
+die "Too many records" if @records > 256;
+
+# Split the per code point index into blocks and share identical blocks
+my $block_size = 1 << $shift;
+my (@index1, @index2, %blocks);
+for (my $i = 0; $i < @index; $i += $block_size) {
+    my $block = join(', ', @index[$i .. $i + $block_size - 1]);
+
+    unless (exists $blocks{$block}) {
+	$blocks{$block} = @index2 / $block_size;
+	push(@index2, @index[$i .. $i + $block_size - 1]);
+    }
+    push(@index1, $blocks{$block});
+}
+
+sub print_array {
+    my ($decl, @values) = @_;
+
+    print "$decl = {";
+    for my $i (0 .. $#values) {
+	print $i % 16 ? ' ' : "\n    ", "$values[$i],";
+    }
+    print "\n};\n\n";
+}
+
+print "/* Generated by gen-unicode.pl from Unicode ", Unicode::UCD::UnicodeVersion(),
+    " data, do not edit */\n\n";
+print "#include \"unicode.h\"\n\n";
+print_array("const unsigned short uc_index1[UC_LIMIT >> UC_SHIFT]", @index1);
+print_array("const unsigned char uc_index2[]", @index2);
+print "const struct uc_record uc_records[] = {\n";
+print "    { $_ },\n" for @records;
+print "};\n";
@@ -0,0 +1,563 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Dictionary compiler: reads a .dict source file like shortnames.dict and
+ * writes the binary image described in dict.h, either as a file to be
+ * loaded with shortener_load() or, with -c, as C source for the built-in
+ * dictionary.  The phrase tries and the minimal perfect hash of the given
+ * names are built here so that loading a dictionary is only a matter of
+ * mapping it and checking the offsets.
+ *
+ * The perfect hash uses the "hash and displace" method.  The keys are split
+ * into buckets by their hash, and starting with the largest bucket, a
+ * displacement is searched for which places all of the bucket's keys into
+ * free slots.  The digraphs are resolved here too so that every slot
+ * directly stores the abbreviated form of the name.
+ *
+ * The compound heads get their own tries, built the same way from the
+ * heads' characters in reverse order.  The other tries are split by the
+ * dict_script() of the phrases' first character.
+ *
+ * Usage: mkdict [-c] <input.dict> <output>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shortnames.h"
+#include "dict.h"
+#include "phash.h"
+#include "unicode.h"
+
+struct src_entry {
+    char *phrase, *abbrev;
+    uint32_t langs, flags;
+};
+
+struct src_name {
+    char *name;
+    wchar_t key[64];
+    int len;
+    uint32_t langs;
+    uint64_t hash;
+};
+
+static struct src_entry *entries;
+static struct src_name *names;
+static char **digraphs;
+static int n_entries, n_names, n_digraphs;
+
+static char lang_codes[DICT_MAX_LANGS][8];
+static int n_langs;
+
+static const char *path;
+static int line_num;
+
+static struct dict_node *nodes;
+static int n_nodes;
+
+static char *strings;
+static size_t strings_size;
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    return ptr;
+}
+
+static void error(const char *msg, const char *arg)
+{
+    fprintf(stderr, "%s:%i: %s%s\n", path, line_num, msg, arg);
+    exit(1);
+}
+
+/* Decode a whole UTF-8 string, returns the length or -1 */
+static int utf8_decode(wchar_t *out, const char *str, int size)
+{
+    int len, n;
+
+    for (len = 0; *str; len ++, str += n) {
+	if (len == size - 1 || !(out[len] = utf8_get(str, &n)))
+	    return -1;
+    }
+    out[len] = 0;
+
+    return len;
+}
+
+/* Parse the space separated language codes of a section header */
+static uint32_t parse_langs(char *codes)
+{
+    uint32_t mask = 0;
+    char *code;
+    int i;
+
+    for (code = strtok(codes, " \t"); code; code = strtok(NULL, " \t")) {
+	for (i = 0; i < n_langs; i ++)
+	    if (!strcmp(lang_codes[i], code))
+		break;
+	if (i == n_langs) {
+	    if (n_langs == DICT_MAX_LANGS)
+		error("Too many languages at ", code);
+	    if (strlen(code) >= sizeof(lang_codes[i]))
+		error("Language code too long: ", code);
+	    strcpy(lang_codes[n_langs ++], code);
+	}
+	mask |= 1u << i;
+    }
+
+    if (!mask)
+	error("No language codes in section header", "");
+
+    return mask;
+}
+
+static void parse(FILE *f)
+{
+    enum { NONE, ABBREVS, COMPOUNDS, NAMES, DIGRAPHS } section = NONE;
+    uint32_t langs = 0;
+    char line[1024], *field[3], *p;
+    int n, i;
+
+    for (line_num = 1; fgets(line, sizeof(line), f); line_num ++) {
+	line[strcspn(line, "\r\n")] = 0;
+	if (!line[0] || line[0] == '#')
+	    continue;
+
+	if (line[0] == '[') {
+	    p = strchr(line, ']');
+	    if (!p || p[1])
+		error("Bad section header: ", line);
+	    *p = 0;
+	    p = line + 1;
+	    n = strcspn(p, " ");
+
+	    if (!strncmp(p, "abbrevs", n) && n == 7)
+		section = ABBREVS;
+	    else if (!strncmp(p, "compounds", n) && n == 9)
+		section = COMPOUNDS;
+	    else if (!strncmp(p, "names", n) && n == 5)
+		section = NAMES;
+	    else if (!strcmp(p, "digraphs"))
+		section = DIGRAPHS;
+	    else
+		error("Unknown section: ", p);
+
+	    if (section != DIGRAPHS)
+		langs = parse_langs(p + n);
+	    continue;
+	}
+
+	/* Split into up to three TAB separated fields, ignore the comments */
+	for (p = line, n = 0; p && n < 3 && *p != '#'; n ++) {
+	    field[n] = p;
+	    p = strchr(p, '\t');
+	    if (p)
+		*p ++ = 0;
+	}
+	if (!n || !field[0][0])
+	    error("Empty phrase", "");
+
+	switch (section) {
+	case NONE:
+	    error("Entry outside of a section", "");
+	    break;
+
+	case ABBREVS:
+	case COMPOUNDS:
+	    entries = xrealloc(entries, (n_entries + 1) * sizeof(*entries));
+	    entries[n_entries].phrase = strdup(field[0]);
+	    entries[n_entries].abbrev = strdup(n > 1 ? field[1] : "");
+	    entries[n_entries].flags = DICT_CLASS_OTHER;
+	    if (n > 2 && !strcmp(field[2], "type"))
+		entries[n_entries].flags = DICT_CLASS_TYPE;
+	    else if (n > 2 && !strcmp(field[2], "title"))
+		entries[n_entries].flags = DICT_CLASS_TITLE;
+	    else if (n > 2 && field[2][0])
+		error("Unknown class: ", field[2]);
+	    if (section == COMPOUNDS)
+		entries[n_entries].flags |= DICT_COMPOUND;
+	    entries[n_entries ++].langs = langs;
+	    break;
+
+	case NAMES:
+	    names = xrealloc(names, (n_names + 1) * sizeof(*names));
+	    names[n_names].name = strdup(field[0]);
+	    names[n_names].langs = langs;
+	    n = utf8_decode(names[n_names].key, field[0],
+			    ARRAY_SIZE(names[n_names].key));
+	    if (n < 0)
+		error("Name too long or invalid: ", field[0]);
+	    names[n_names].len = n;
+
+	    names[n_names].hash = PHASH_INIT;
+	    for (i = 0; i < n; i ++) {
+		names[n_names].key[i] = uc_tolower(names[n_names].key[i]);
+		names[n_names].hash = phash_step(names[n_names].hash,
+				names[n_names].key[i]);
+	    }
+
+	    /*
+	     * Two names folding to the same key would never be told apart,
+	     * the earlier one always wins, so only its languages are merged.
+	     */
+	    for (i = 0; i < n_names; i ++)
+		if (!wcscmp(names[i].key, names[n_names].key))
+		    break;
+	    if (i < n_names) {
+		if (names[i].langs & langs)
+		    error("Duplicate name: ", field[0]);
+		names[i].langs |= langs;
+		free(names[n_names].name);
+	    } else
+		n_names ++;
+	    break;
+
+	case DIGRAPHS:
+	    digraphs = xrealloc(digraphs, (n_digraphs + 1) * sizeof(*digraphs));
+	    digraphs[n_digraphs ++] = strdup(field[0]);
+	    break;
+	}
+    }
+}
+
+/* Append @len bytes to the strings and NUL-terminate, returns the offset */
+static uint32_t add_string(const char *str, size_t len)
+{
+    uint32_t offset = strings_size;
+
+    strings = xrealloc(strings, strings_size + len + 1);
+    memcpy(strings + strings_size, str, len);
+    strings[strings_size + len] = 0;
+    strings_size += len + 1;
+
+    return offset;
+}
+
+/*
+ * Build the trie of the phrases in any of the @langs languages starting in
+ * @script, or in any script if negative, and append it to the nodes,
+ * returns the index of the root node or DICT_NO_TRIE if there are no such
+ * phrases.  With @compound set it's the suffix trie of the compound heads
+ * instead.
+ */
+static uint32_t trie_build(uint32_t langs, int compound, int script)
+{
+    struct {
+	wchar_t c;
+	int match, child, sibling;
+    } *tmp;
+    int *order;
+    wchar_t key[1024], c;
+    int i, j, k, n, count, node, base, *link;
+
+    n = 1;
+    for (i = 0; i < n_entries; i ++)
+	n += strlen(entries[i].phrase);
+
+    tmp = xrealloc(NULL, n * sizeof(*tmp));
+    order = xrealloc(NULL, n * sizeof(*order));
+
+    /* Insert the phrases keeping every list of siblings sorted */
+    tmp[0].match = tmp[0].child = tmp[0].sibling = -1;
+    n = 1;
+    for (i = 0; i < n_entries; i ++) {
+	if (!(entries[i].langs & langs) ||
+		!(entries[i].flags & DICT_COMPOUND) != !compound)
+	    continue;
+
+	k = utf8_decode(key, entries[i].phrase, ARRAY_SIZE(key));
+	if (k < 0)
+	    error("Phrase too long or invalid: ", entries[i].phrase);
+	if (script >= 0 && (!k || dict_script(uc_tolower(key[0])) != script))
+	    continue;
+
+	node = 0;
+	for (j = 0; j < k; j ++) {
+	    c = uc_tolower(key[compound ? k - 1 - j : j]);
+	    link = &tmp[node].child;
+	    while (*link >= 0 && tmp[*link].c < c)
+		link = &tmp[*link].sibling;
+	    if (*link < 0 || tmp[*link].c != c) {
+		tmp[n].c = c;
+		tmp[n].match = tmp[n].child = -1;
+		tmp[n].sibling = *link;
+		*link = n ++;
+	    }
+	    node = *link;
+	}
+	if (tmp[node].match < 0)
+	    tmp[node].match = i;
+    }
+
+    if (n == 1) {
+	free(tmp);
+	free(order);
+	return DICT_NO_TRIE;
+    }
+
+    /* Flatten breadth first so that siblings end up next to each other */
+    base = n_nodes;
+    n_nodes += n;
+    nodes = xrealloc(nodes, n_nodes * sizeof(*nodes));
+
+    order[0] = 0;
+    count = 1;
+    for (i = 0; i < count; i ++) {
+	nodes[base + i].c = tmp[order[i]].c;
+	nodes[base + i].match = tmp[order[i]].match;
+	nodes[base + i].children = base + count;
+	for (j = tmp[order[i]].child; j >= 0; j = tmp[j].sibling)
+	    order[count ++] = j;
+	nodes[base + i].n_children = base + count - nodes[base + i].children;
+    }
+
+    free(tmp);
+    free(order);
+    return base;
+}
+
+static int *bucket_size;
+
+static int bucket_cmp(const void *a, const void *b)
+{
+    return bucket_size[*(const int *) b] - bucket_size[*(const int *) a];
+}
+
+/* Place the names in the perfect hash, returns the name in every slot */
+static int *phash_build(uint16_t *disp, int n_buckets)
+{
+    int *slot_key, *bucket_order, *slots;
+    int i, j, k, n, b, slot;
+
+    bucket_size = calloc(n_buckets + 1, sizeof(*bucket_size));
+    bucket_order = xrealloc(NULL, (n_buckets + 1) * sizeof(*bucket_order));
+    slot_key = xrealloc(NULL, (n_names + 1) * sizeof(*slot_key));
+    slots = xrealloc(NULL, (n_names + 1) * sizeof(*slots));
+    if (!bucket_size)
+	error("Out of memory", "");
+
+    for (i = 0; i < n_names; i ++)
+	bucket_size[phash_bucket(names[i].hash, n_buckets)] ++;
+
+    for (i = 0; i < n_buckets; i ++)
+	bucket_order[i] = i;
+    qsort(bucket_order, n_buckets, sizeof(int), bucket_cmp);
+
+    for (i = 0; i < n_names; i ++)
+	slot_key[i] = -1;
+
+    for (i = 0; i < n_buckets && bucket_size[bucket_order[i]]; i ++) {
+	unsigned int d;
+
+	b = bucket_order[i];
+	for (d = 0; d < 0x10000; d ++) {
+	    n = 0;
+	    for (j = 0; j < n_names; j ++) {
+		if (phash_bucket(names[j].hash, n_buckets) != b)
+		    continue;
+
+		slot = phash_slot(names[j].hash, d, n_names);
+		if (slot_key[slot] >= 0)
+		    break;
+		for (k = 0; k < n; k ++)
+		    if (slots[k] == slot)
+			break;
+		if (k < n)
+		    break;
+		slots[n ++] = slot;
+	    }
+	    if (j == n_names)
+		break;
+	}
+	if (d == 0x10000) {
+	    fprintf(stderr, "No displacement found for bucket %i\n", b);
+	    exit(1);
+	}
+	disp[b] = d;
+
+	n = 0;
+	for (j = 0; j < n_names; j ++)
+	    if (phash_bucket(names[j].hash, n_buckets) == b)
+		slot_key[slots[n ++]] = j;
+    }
+
+    free(bucket_size);
+    free(bucket_order);
+    free(slots);
+    return slot_key;
+}
+
+/* Abbreviated form of a given name: the initial, or digraph, and a dot */
+static uint32_t name_initial(const struct src_name *name)
+{
+    wchar_t digraph[8];
+    const char *p;
+    int i, j, n, len = 1, bytes;
+
+    for (j = 0; j < n_digraphs; j ++) {
+	n = utf8_decode(digraph, digraphs[j], ARRAY_SIZE(digraph));
+	for (i = 0; i < n && i < name->len; i ++)
+	    if (uc_tolower(digraph[i]) != name->key[i])
+		break;
+	if (i == n) {
+	    len = n;
+	    break;
+	}
+    }
+
+    for (p = name->name, i = 0; i < len; i ++, p += bytes)
+	utf8_get(p, &bytes);
+
+    i = p - name->name;
+    n = add_string(name->name, i);
+    strings[n + i] = '.';
+    add_string("", 0);
+
+    return n;
+}
+
+static size_t align(size_t size)
+{
+    return (size + 7) & ~7;
+}
+
+int main(int argc, char *argv[])
+{
+    struct dict_header hdr;
+    struct dict_entry *dentries;
+    struct dict_lang dlangs[DICT_MAX_LANGS];
+    struct dict_name *dnames;
+    uint16_t *disp;
+    unsigned char *image;
+    int *slot_key;
+    int c_source = 0, i, j, s, n_buckets;
+    char key[256];
+    FILE *f;
+
+    while ((i = getopt(argc, argv, "c")) != -1)
+	if (i == 'c')
+	    c_source = 1;
+	else
+	    return 1;
+    if (argc - optind != 2) {
+	fprintf(stderr, "Usage: %s [-c] <input.dict> <output>\n", argv[0]);
+	return 1;
+    }
+
+    path = argv[optind];
+    f = fopen(path, "r");
+    if (!f) {
+	perror(path);
+	return 1;
+    }
+    parse(f);
+    fclose(f);
+
+    add_string("", 0);
+
+    dentries = xrealloc(NULL, (n_entries + 1) * sizeof(*dentries));
+    for (i = 0; i < n_entries; i ++) {
+	dentries[i].phrase = add_string(entries[i].phrase,
+			strlen(entries[i].phrase));
+	dentries[i].abbrev_len = strlen(entries[i].abbrev);
+	dentries[i].abbrev = add_string(entries[i].abbrev,
+			dentries[i].abbrev_len);
+	dentries[i].flags = entries[i].flags;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    for (s = 0; s < DICT_SCRIPTS; s ++)
+	hdr.all_tries[s] = trie_build(~0u, 0, s);
+    memset(dlangs, 0, sizeof(dlangs));
+    for (i = 0; i < n_langs; i ++) {
+	strcpy(dlangs[i].code, lang_codes[i]);
+	for (s = 0; s < DICT_SCRIPTS; s ++)
+	    dlangs[i].tries[s] = trie_build(1u << i, 0, s);
+	dlangs[i].suffixes = trie_build(1u << i, 1, -1);
+    }
+
+    n_buckets = (n_names + 1) / 2;
+    disp = calloc(n_buckets + 1, sizeof(*disp));
+    dnames = xrealloc(NULL, (n_names + 1) * sizeof(*dnames));
+    slot_key = phash_build(disp, n_buckets);
+    for (i = 0; i < n_names; i ++) {
+	const struct src_name *name = &names[slot_key[i]];
+	char *k = key;
+
+	for (j = 0; j < name->len; j ++)
+	    k += utf8_put(k, name->key[j]);
+
+	dnames[i].key = add_string(key, k - key);
+	dnames[i].initial = name_initial(name);
+	dnames[i].len = name->len;
+	dnames[i].index = slot_key[i];
+	dnames[i].langs = name->langs;
+	hdr.name_scripts |= 1u << dict_script(name->key[0]);
+    }
+
+    /* Lay out the image */
+    memcpy(hdr.magic, DICT_MAGIC, sizeof(hdr.magic));
+    hdr.version = DICT_VERSION;
+    hdr.byte_order = DICT_BYTE_ORDER;
+    hdr.strings = align(sizeof(hdr));
+    hdr.strings_size = strings_size;
+    hdr.entries = align(hdr.strings + strings_size);
+    hdr.n_entries = n_entries;
+    hdr.nodes = align(hdr.entries + n_entries * sizeof(*dentries));
+    hdr.n_nodes = n_nodes;
+    hdr.langs = align(hdr.nodes + n_nodes * sizeof(*nodes));
+    hdr.n_langs = n_langs;
+    hdr.names = align(hdr.langs + n_langs * sizeof(*dlangs));
+    hdr.n_names = n_names;
+    hdr.disp = align(hdr.names + n_names * sizeof(*dnames));
+    hdr.n_buckets = n_buckets;
+    hdr.size = align(hdr.disp + n_buckets * sizeof(*disp));
+
+    image = calloc(1, hdr.size);
+    if (!image)
+	error("Out of memory", "");
+    memcpy(image, &hdr, sizeof(hdr));
+    memcpy(image + hdr.strings, strings, strings_size);
+    memcpy(image + hdr.entries, dentries, n_entries * sizeof(*dentries));
+    memcpy(image + hdr.nodes, nodes, n_nodes * sizeof(*nodes));
+    memcpy(image + hdr.langs, dlangs, n_langs * sizeof(*dlangs));
+    memcpy(image + hdr.names, dnames, n_names * sizeof(*dnames));
+    memcpy(image + hdr.disp, disp, n_buckets * sizeof(*disp));
+
+    f = fopen(argv[optind + 1], "w");
+    if (!f) {
+	perror(argv[optind + 1]);
+	return 1;
+    }
+
+    if (!c_source)
+	fwrite(image, 1, hdr.size, f);
+    else {
+	fprintf(f, "/* Generated by mkdict from %s, do not edit */\n\n",
+			path);
+	fprintf(f, "#include <stddef.h>\n\n");
+	fprintf(f, "_Alignas(8) const unsigned char dict_builtin[] = {");
+	for (i = 0; i < hdr.size; i ++)
+	    fprintf(f, "%s0x%02x,", i % 12 ? " " : "\n    ", image[i]);
+	fprintf(f, "\n};\n\n");
+	fprintf(f, "const size_t dict_builtin_size = %u;\n", hdr.size);
+    }
+
+    if (fclose(f)) {
+	perror(argv[optind + 1]);
+	return 1;
+    }
+
+    return 0;
+}
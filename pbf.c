@@ -0,0 +1,1338 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Adds short names to an OpenStreetMap .osm.pbf file in one pass: for
+ * every node and way with a name or name:<language> tag, a short_name or
+ * short_name:<language> tag with the short form is added, unless it's
+ * already there or the short form is the same as the name.  The short form
+ * is taken from the abbreviation ladder, which unlike shortener_shorten()
+ * never doubles whitespace.  The language
+ * of a name:<language> tag selects the dictionaries, name uses all.
+ *
+ * The file is a sequence of blobs, each a zlib compressed block of up to
+ * 8000 entities with its own string table.  The main thread only reads
+ * the blobs, a pool of worker threads decompresses, rewrites and
+ * compresses them again, and a writer thread outputs them in the original
+ * order, like in shrtnms.c.  The new strings are appended to the block's
+ * string table so the existing tags don't change, and everything that
+ * isn't a node's or way's tags is copied as it is.  There's no protobuf
+ * library involved, the few messages needed are parsed and written here.
+ *
+ * Also writes test files, with every line of a text file, e.g. a corpus
+ * from shrtnms-bench -o, as the name of a node and a way, and prints the
+ * tags of the entities in a file for checking the results.
+ *
+ * Usage: shrtnms-pbf [-j <threads>] [-z <level>] [-d <dictionary>] <in> <out>
+ *        shrtnms-pbf -t <names> <out>
+ *        shrtnms-pbf -p <in>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "shortnames.h"
+
+#define MAX_HEADER_SIZE	(64 << 10)
+#define MAX_BLOB_SIZE	(32 << 20)
+#define BLOCK_ENTITIES	8000
+
+/*
+ * Protobuf wire format.  A message is read field by field with pb_next(),
+ * which gives the value of varints and the contents of length-delimited
+ * fields as a sub-message, and leaves where the field started in @field
+ * so that it can be copied as it is.
+ */
+enum { PB_VARINT = 0, PB_64BIT = 1, PB_LEN = 2, PB_32BIT = 5 };
+
+struct pb {
+    const uint8_t *p, *end;
+    const uint8_t *field;
+};
+
+static int pb_varint(struct pb *pb, uint64_t *v)
+{
+    int shift;
+
+    for (*v = 0, shift = 0; pb->p < pb->end && shift < 64; shift += 7) {
+	*v |= (uint64_t) (*pb->p & 0x7f) << shift;
+	if (!(*pb->p ++ & 0x80))
+	    return 0;
+    }
+
+    return -1;
+}
+
+/* Returns 1 for a field, 0 at the end and -1 if the message is broken */
+static int pb_next(struct pb *pb, int *num, int *type, uint64_t *v,
+		struct pb *sub)
+{
+    uint64_t key;
+
+    if (pb->p == pb->end)
+	return 0;
+
+    pb->field = pb->p;
+    if (pb_varint(pb, &key))
+	return -1;
+    *num = key >> 3;
+    *type = key & 7;
+
+    switch (*type) {
+    case PB_VARINT:
+	return pb_varint(pb, v) ? -1 : 1;
+    case PB_64BIT:
+	if (pb->end - pb->p < 8)
+	    return -1;
+	pb->p += 8;
+	return 1;
+    case PB_32BIT:
+	if (pb->end - pb->p < 4)
+	    return -1;
+	pb->p += 4;
+	return 1;
+    case PB_LEN:
+	if (pb_varint(pb, v) || *v > (uint64_t) (pb->end - pb->p))
+	    return -1;
+	sub->p = pb->p;
+	sub->end = sub->field = pb->p + *v;
+	pb->p += *v;
+	return 1;
+    }
+
+    return -1;
+}
+
+static int64_t zigzag_decode(uint64_t v)
+{
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static uint64_t zigzag_encode(int64_t v)
+{
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+struct buf {
+    uint8_t *data;
+    size_t len, size;
+};
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    return ptr;
+}
+
+static void buf_put(struct buf *b, const void *data, size_t len)
+{
+    if (b->len + len > b->size) {
+	b->size = (b->len + len) * 2;
+	b->data = xrealloc(b->data, b->size);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void buf_varint(struct buf *b, uint64_t v)
+{
+    uint8_t tmp[10];
+    int n = 0;
+
+    while (v >= 0x80) {
+	tmp[n ++] = v | 0x80;
+	v >>= 7;
+    }
+    tmp[n ++] = v;
+    buf_put(b, tmp, n);
+}
+
+static void buf_key(struct buf *b, int num, int type)
+{
+    buf_varint(b, (uint64_t) num << 3 | type);
+}
+
+static void buf_bytes(struct buf *b, int num, const void *data, size_t len)
+{
+    buf_key(b, num, PB_LEN);
+    buf_varint(b, len);
+    buf_put(b, data, len);
+}
+
+/*
+ * The string table of a block being rewritten.  The original strings
+ * point into the decompressed block, the new ones into @new_strings, by
+ * offset since it moves.  The hash table has index + 1 of every string,
+ * both to find the keys and to reuse strings.
+ */
+struct strtab {
+    const uint8_t **str;
+    uint32_t *len;
+    size_t *new_offset;
+    size_t n, n_orig, size;
+    struct buf new_strings;
+    uint32_t *slots;
+    size_t n_slots;
+};
+
+static uint32_t str_hash(const void *str, size_t len)
+{
+    const uint8_t *s = str;
+    uint32_t h = 2166136261u;
+
+    while (len --)
+	h = (h ^ *s ++) * 16777619;
+    return h;
+}
+
+static const uint8_t *strtab_get(const struct strtab *t, uint32_t i,
+		uint32_t *len)
+{
+    *len = t->len[i];
+    if (i < t->n_orig)
+	return t->str[i];
+    return t->new_strings.data + t->new_offset[i];
+}
+
+static void strtab_insert(struct strtab *t, uint32_t i)
+{
+    const uint8_t *str;
+    uint32_t len;
+    size_t slot;
+
+    str = strtab_get(t, i, &len);
+    slot = str_hash(str, len) & (t->n_slots - 1);
+    while (t->slots[slot])
+	slot = (slot + 1) & (t->n_slots - 1);
+    t->slots[slot] = i + 1;
+}
+
+static void strtab_grow(struct strtab *t)
+{
+    size_t i;
+
+    t->size = t->size ? t->size * 2 : 256;
+    t->str = xrealloc(t->str, t->size * sizeof(*t->str));
+    t->len = xrealloc(t->len, t->size * sizeof(*t->len));
+    t->new_offset = xrealloc(t->new_offset, t->size * sizeof(size_t));
+
+    t->n_slots = t->size * 2;
+    free(t->slots);
+    t->slots = calloc(t->n_slots, sizeof(*t->slots));
+    if (!t->slots) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    for (i = 0; i < t->n; i ++)
+	strtab_insert(t, i);
+}
+
+/* Index of the string, -1 if it's not in the table */
+static int64_t strtab_find(const struct strtab *t, const void *str,
+		size_t len)
+{
+    const uint8_t *s;
+    uint32_t s_len;
+    size_t slot;
+
+    if (!t->n_slots)
+	return -1;
+
+    slot = str_hash(str, len) & (t->n_slots - 1);
+    for (; t->slots[slot]; slot = (slot + 1) & (t->n_slots - 1)) {
+	s = strtab_get(t, t->slots[slot] - 1, &s_len);
+	if (s_len == len && !memcmp(s, str, len))
+	    return t->slots[slot] - 1;
+    }
+
+    return -1;
+}
+
+static uint32_t strtab_add(struct strtab *t, const void *str, size_t len,
+		int orig)
+{
+    int64_t i = orig ? -1 : strtab_find(t, str, len);
+
+    if (i >= 0)
+	return i;
+
+    if (t->n == t->size)
+	strtab_grow(t);
+
+    i = t->n ++;
+    t->len[i] = len;
+    if (orig) {
+	t->str[i] = str;
+	t->n_orig = t->n;
+    } else {
+	t->new_offset[i] = t->new_strings.len;
+	buf_put(&t->new_strings, str, len);
+    }
+    strtab_insert(t, i);
+    return i;
+}
+
+static void strtab_reset(struct strtab *t)
+{
+    t->n = t->n_orig = 0;
+    t->new_strings.len = 0;
+    if (t->n_slots)
+	memset(t->slots, 0, t->n_slots * sizeof(*t->slots));
+}
+
+
+/* Arrays of string table indices */
+struct u32s {
+    uint32_t *v;
+    size_t n, size;
+};
+
+static void u32s_add(struct u32s *a, uint32_t v)
+{
+    if (a->n == a->size) {
+	a->size = a->size ? a->size * 2 : 16;
+	a->v = xrealloc(a->v, a->size * sizeof(uint32_t));
+    }
+    a->v[a->n ++] = v;
+}
+
+/* A packed field, or a single value of one, appended to @a */
+static int read_u32s(struct u32s *a, int type, uint64_t v, struct pb *sub)
+{
+    if (type == PB_VARINT) {
+	u32s_add(a, v);
+	return 0;
+    }
+    if (type != PB_LEN)
+	return -1;
+
+    while (sub->p < sub->end) {
+	if (pb_varint(sub, &v))
+	    return -1;
+	u32s_add(a, v);
+    }
+    return 0;
+}
+
+static void write_u32s(struct buf *b, int num, const uint32_t *v, size_t n,
+		struct buf *tmp)
+{
+    size_t i;
+
+    for (i = 0, tmp->len = 0; i < n; i ++)
+	buf_varint(tmp, v[i]);
+    buf_bytes(b, num, tmp->data, tmp->len);
+}
+
+/* One dense node's tags in keys_vals */
+static void write_kv(struct buf *b, const struct u32s *keys,
+		const struct u32s *vals)
+{
+    size_t i;
+
+    for (i = 0; i < keys->n; i ++) {
+	buf_varint(b, keys->v[i]);
+	buf_varint(b, vals->v[i]);
+    }
+    buf_varint(b, 0);
+}
+
+enum block_state {
+    BLOCK_FREE,
+    BLOCK_READ,		/* Waiting for a worker */
+    BLOCK_DONE,		/* Waiting for the writer */
+};
+
+/* A blob as read from the file and as it is to be written */
+struct block {
+    enum block_state state;
+    struct buf header, blob;
+    int data;			/* OSMData, anything else is copied */
+    struct buf out;
+};
+
+/* Everything a worker needs for rewriting a block */
+struct worker {
+    struct strtab strtab;
+    struct u32s keys, vals, kv;
+    struct buf raw, block, groups, group, entity, tmp;
+    struct buf compressed, header, blob;
+    char *short_name;
+    size_t short_size;
+    unsigned long added;
+};
+
+static struct shortener *sh;
+static int level = Z_DEFAULT_COMPRESSION;
+static struct block *blocks;
+static int n_blocks;
+static int out_fd;
+
+/* Everything below is protected by the lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static unsigned long n_read, n_taken, n_written, n_added;
+static int eof;
+
+static void fail(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
+
+/*
+ * Is @key name or name:<language>?  Languages are two or three lower case
+ * letters optionally followed by subtags, "es-PE", "be-tarask", which
+ * leaves out name:etymology and the like.  The language is stored in
+ * @lang, at most 15 characters.
+ */
+static int name_key(const uint8_t *key, size_t len, char *lang)
+{
+    size_t i, start;
+
+    if (len < 4 || memcmp(key, "name", 4))
+	return 0;
+
+    lang[0] = 0;
+    if (len == 4)
+	return 1;
+    if (key[4] != ':' || len > 4 + 16)
+	return 0;
+
+    for (i = 5; i < len && key[i] >= 'a' && key[i] <= 'z'; i ++);
+    if (i - 5 < 2 || i - 5 > 3)
+	return 0;
+
+    while (i < len) {
+	if (key[i ++] != '-')
+	    return 0;
+	for (start = i; i < len && ((key[i] >= 'a' && key[i] <= 'z') ||
+			(key[i] >= 'A' && key[i] <= 'Z') ||
+			(key[i] >= '0' && key[i] <= '9')); i ++);
+	if (i == start)
+	    return 0;
+    }
+
+    memcpy(lang, key + 5, len - 5);
+    lang[len - 5] = 0;
+    return 1;
+}
+
+/*
+ * Add a short name tag for every name tag in @keys and @vals that doesn't
+ * have one yet.  Returns the number of tags added.
+ */
+static int add_short_names(struct worker *w, struct u32s *keys,
+		struct u32s *vals)
+{
+    struct strtab *t = &w->strtab;
+    const uint8_t *key, *val;
+    uint32_t key_len, val_len;
+    struct shortener_step steps[SHORTENER_STEPS], *step;
+    size_t i, j, n = keys->n, max;
+    char lang[16], short_key[6 + 4 + 16], *short_name;
+    int64_t existing;
+    int added = 0;
+
+    for (i = 0; i < n; i ++) {
+	key = strtab_get(t, keys->v[i], &key_len);
+	if (!name_key(key, key_len, lang))
+	    continue;
+
+	memcpy(short_key, "short_", 6);
+	memcpy(short_key + 6, key, key_len);
+	existing = strtab_find(t, short_key, key_len + 6);
+	for (j = 0; existing >= 0 && j < n && keys->v[j] != existing; j ++);
+	if (existing >= 0 && j < n)
+	    continue;
+
+	/*
+	 * The ladder step with everything abbreviated is the same as the
+	 * short form except that it doesn't double whitespace.
+	 */
+	val = strtab_get(t, vals->v[i], &val_len);
+	while (shortener_ladder(sh, (const char *) val, val_len, lang,
+				w->short_name, w->short_size, steps)) {
+	    for (j = 0, max = 0; j < SHORTENER_STEPS; j ++)
+		if (steps[j].len > max)
+		    max = steps[j].len;
+	    w->short_size = max * SHORTENER_STEPS;
+	    w->short_name = xrealloc(w->short_name, w->short_size);
+	}
+
+	step = &steps[SHORTENER_STEP_GIVEN_NAMES];
+	short_name = w->short_name + step->offset;
+	if (!step->len || (step->len == val_len &&
+				!memcmp(short_name, val, val_len)))
+	    continue;
+
+	u32s_add(keys, strtab_add(t, short_key, key_len + 6, 0));
+	u32s_add(vals, strtab_add(t, short_name, step->len, 0));
+	added ++;
+    }
+
+    return added;
+}
+
+/* Are all of the indices in @a valid for the string table? */
+static int check_u32s(const struct worker *w, const struct u32s *a)
+{
+    size_t i;
+
+    for (i = 0; i < a->n; i ++)
+	if (a->v[i] >= w->strtab.n_orig)
+	    return -1;
+    return 0;
+}
+
+/*
+ * A Node or a Way, both have their tags in keys (2) and vals (3).  Returns
+ * 1 with the new message in w->entity if tags were added, 0 if the
+ * original can be kept and -1 if it's broken.
+ */
+static int rewrite_entity(struct worker *w, struct pb msg)
+{
+    struct pb sub;
+    uint64_t v;
+    int num, type, ret, added;
+
+    w->keys.n = w->vals.n = 0;
+    w->entity.len = 0;
+    while ((ret = pb_next(&msg, &num, &type, &v, &sub)) > 0)
+	if (num == 2) {
+	    if (read_u32s(&w->keys, type, v, &sub))
+		return -1;
+	} else if (num == 3) {
+	    if (read_u32s(&w->vals, type, v, &sub))
+		return -1;
+	} else
+	    buf_put(&w->entity, msg.field, msg.p - msg.field);
+    if (ret < 0 || w->keys.n != w->vals.n ||
+	    check_u32s(w, &w->keys) || check_u32s(w, &w->vals))
+	return -1;
+
+    added = add_short_names(w, &w->keys, &w->vals);
+    if (!added)
+	return 0;
+
+    w->added += added;
+    write_u32s(&w->entity, 2, w->keys.v, w->keys.n, &w->tmp);
+    write_u32s(&w->entity, 3, w->vals.v, w->vals.n, &w->tmp);
+    return 1;
+}
+
+/*
+ * DenseNodes have the tags of all the nodes in keys_vals (10), as key and
+ * value pairs with a 0 after each node's tags.
+ */
+static int rewrite_dense(struct worker *w, struct pb msg)
+{
+    struct pb sub;
+    uint64_t v;
+    size_t i;
+    int num, type, ret, added = 0;
+
+    w->kv.n = 0;
+    w->entity.len = 0;
+    while ((ret = pb_next(&msg, &num, &type, &v, &sub)) > 0)
+	if (num == 10) {
+	    if (read_u32s(&w->kv, type, v, &sub))
+		return -1;
+	} else
+	    buf_put(&w->entity, msg.field, msg.p - msg.field);
+    if (ret < 0 || check_u32s(w, &w->kv))
+	return -1;
+
+    for (i = 0, w->tmp.len = 0; i < w->kv.n; i ++) {
+	w->keys.n = w->vals.n = 0;
+	for (; i < w->kv.n && w->kv.v[i]; i += 2) {
+	    if (i + 1 == w->kv.n)
+		return -1;
+	    u32s_add(&w->keys, w->kv.v[i]);
+	    u32s_add(&w->vals, w->kv.v[i + 1]);
+	}
+
+	added += add_short_names(w, &w->keys, &w->vals);
+	write_kv(&w->tmp, &w->keys, &w->vals);
+    }
+    if (!added)
+	return 0;
+
+    w->added += added;
+    buf_bytes(&w->entity, 10, w->tmp.data, w->tmp.len);
+    return 1;
+}
+
+/* A PrimitiveGroup: nodes (1), dense (2) and ways (3) are rewritten */
+static int rewrite_group(struct worker *w, struct pb msg)
+{
+    struct pb sub;
+    uint64_t v;
+    int num, type, ret, changed;
+
+    w->group.len = 0;
+    while ((ret = pb_next(&msg, &num, &type, &v, &sub)) > 0) {
+	changed = 0;
+	if (type == PB_LEN && (num == 1 || num == 3))
+	    changed = rewrite_entity(w, sub);
+	else if (type == PB_LEN && num == 2)
+	    changed = rewrite_dense(w, sub);
+	if (changed < 0)
+	    return -1;
+
+	if (changed)
+	    buf_bytes(&w->group, num, w->entity.data, w->entity.len);
+	else
+	    buf_put(&w->group, msg.field, msg.p - msg.field);
+    }
+
+    return ret;
+}
+
+/*
+ * A PrimitiveBlock, decompressed in w->raw, into w->block.  The string
+ * table (1) is read first and written last, after the groups (2) which add
+ * to it.  Anything else, like the granularity, is copied.
+ */
+static int rewrite_block(struct worker *w)
+{
+    struct pb msg = { w->raw.data, w->raw.data + w->raw.len }, sub, str;
+    struct buf *tab = &w->tmp;
+    uint64_t v;
+    uint32_t i, len;
+    const uint8_t *s;
+    int num, type, ret;
+
+    strtab_reset(&w->strtab);
+    while ((ret = pb_next(&msg, &num, &type, &v, &sub)) > 0) {
+	if (num != 1 || type != PB_LEN)
+	    continue;
+
+	while ((ret = pb_next(&sub, &num, &type, &v, &str)) > 0)
+	    if (num == 1 && type == PB_LEN)
+		strtab_add(&w->strtab, str.p, str.end - str.p, 1);
+	if (ret < 0)
+	    return -1;
+    }
+    if (ret < 0)
+	return -1;
+
+    /* Index 0 can't be used for tags, it ends a node's tags in dense */
+    if (!w->strtab.n)
+	strtab_add(&w->strtab, "", 0, 1);
+
+    msg.p = w->raw.data;
+    w->groups.len = 0;
+    w->block.len = 0;
+    while ((ret = pb_next(&msg, &num, &type, &v, &sub)) > 0)
+	if (num == 2 && type == PB_LEN) {
+	    if (rewrite_group(w, sub) < 0)
+		return -1;
+	    buf_bytes(&w->groups, 2, w->group.data, w->group.len);
+	} else if (num != 1)
+	    buf_put(&w->block, msg.field, msg.p - msg.field);
+
+    for (i = 0, tab->len = 0; i < w->strtab.n; i ++) {
+	s = strtab_get(&w->strtab, i, &len);
+	buf_bytes(tab, 1, s, len);
+    }
+
+    /* Reassemble as string table, groups, the rest */
+    buf_put(&w->groups, w->block.data, w->block.len);
+    w->block.len = 0;
+    buf_bytes(&w->block, 1, tab->data, tab->len);
+    buf_put(&w->block, w->groups.data, w->groups.len);
+    return 0;
+}
+
+/* Decompress a Blob into w->raw, only raw (1) and zlib_data (3) are known */
+static int blob_decode(struct worker *w, const struct buf *blob)
+{
+    struct pb msg = { blob->data, blob->data + blob->len }, sub;
+    struct pb zdata = { NULL, NULL };
+    uint64_t v, raw_size = 0;
+    uLongf len;
+    int num, type, ret;
+
+    while ((ret = pb_next(&msg, &num, &type, &v, &sub)) > 0)
+	if (num == 1 && type == PB_LEN) {
+	    w->raw.len = 0;
+	    buf_put(&w->raw, sub.p, sub.end - sub.p);
+	    return 0;
+	} else if (num == 2 && type == PB_VARINT)
+	    raw_size = v;
+	else if (num == 3 && type == PB_LEN)
+	    zdata = sub;
+	else if (num >= 4 && num <= 7)
+	    fail("Only zlib compressed blobs are supported");
+    if (ret < 0 || !zdata.p || raw_size > MAX_BLOB_SIZE)
+	return -1;
+
+    if (w->raw.size < raw_size) {
+	w->raw.size = raw_size;
+	w->raw.data = xrealloc(w->raw.data, raw_size);
+    }
+    len = raw_size;
+    if (uncompress(w->raw.data, &len, zdata.p, zdata.end - zdata.p) != Z_OK ||
+	    len != raw_size)
+	return -1;
+    w->raw.len = len;
+    return 0;
+}
+
+/*
+ * Compress @raw and write the whole blob to @out: the length of the
+ * BlobHeader, the BlobHeader, the Blob.  The header's fields are copied
+ * from @header except for the size, or it gets just the @type.
+ */
+static void blob_encode(struct worker *w, const struct buf *header,
+		const char *type, const struct buf *raw, struct buf *out)
+{
+    struct pb msg, sub;
+    struct buf *hdr = &w->header, *blob = &w->blob;
+    uLongf len = compressBound(raw->len);
+    uint64_t v;
+    int num, t;
+    uint8_t size[4];
+
+    if (w->compressed.size < len) {
+	w->compressed.size = len;
+	w->compressed.data = xrealloc(w->compressed.data, len);
+    }
+    if (compress2(w->compressed.data, &len, raw->data, raw->len,
+			    level) != Z_OK)
+	fail("Compression failed");
+
+    blob->len = 0;
+    buf_key(blob, 2, PB_VARINT);
+    buf_varint(blob, raw->len);
+    buf_bytes(blob, 3, w->compressed.data, len);
+
+    hdr->len = 0;
+    if (header) {
+	msg = (struct pb) { header->data, header->data + header->len };
+	while (pb_next(&msg, &num, &t, &v, &sub) > 0)
+	    if (num != 3)
+		buf_put(hdr, msg.field, msg.p - msg.field);
+    } else
+	buf_bytes(hdr, 1, type, strlen(type));
+    buf_key(hdr, 3, PB_VARINT);
+    buf_varint(hdr, blob->len);
+
+    size[0] = hdr->len >> 24;
+    size[1] = hdr->len >> 16;
+    size[2] = hdr->len >> 8;
+    size[3] = hdr->len;
+    out->len = 0;
+    buf_put(out, size, 4);
+    buf_put(out, hdr->data, hdr->len);
+    buf_put(out, blob->data, blob->len);
+}
+
+static void process_block(struct worker *w, struct block *b)
+{
+    uint8_t size[4] = {
+	b->header.len >> 24, b->header.len >> 16, b->header.len >> 8,
+	b->header.len,
+    };
+
+    if (b->data) {
+	if (blob_decode(w, &b->blob) || rewrite_block(w))
+	    fail("Broken data block");
+	blob_encode(w, &b->header, NULL, &w->block, &b->out);
+	return;
+    }
+
+    b->out.len = 0;
+    buf_put(&b->out, size, 4);
+    buf_put(&b->out, b->header.data, b->header.len);
+    buf_put(&b->out, b->blob.data, b->blob.len);
+}
+
+static void worker_free(struct worker *w)
+{
+    free(w->strtab.str);
+    free(w->strtab.len);
+    free(w->strtab.new_offset);
+    free(w->strtab.new_strings.data);
+    free(w->strtab.slots);
+    free(w->keys.v);
+    free(w->vals.v);
+    free(w->kv.v);
+    free(w->raw.data);
+    free(w->block.data);
+    free(w->groups.data);
+    free(w->group.data);
+    free(w->entity.data);
+    free(w->tmp.data);
+    free(w->compressed.data);
+    free(w->header.data);
+    free(w->blob.data);
+    free(w->short_name);
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker w = { 0 };
+    struct block *b;
+
+    while (1) {
+	pthread_mutex_lock(&lock);
+	while (n_taken == n_read && !eof)
+	    pthread_cond_wait(&cond, &lock);
+	if (n_taken == n_read) {
+	    pthread_mutex_unlock(&lock);
+	    break;
+	}
+	b = &blocks[n_taken ++ % n_blocks];
+	pthread_mutex_unlock(&lock);
+
+	process_block(&w, b);
+
+	pthread_mutex_lock(&lock);
+	b->state = BLOCK_DONE;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+    }
+
+    pthread_mutex_lock(&lock);
+    n_added += w.added;
+    pthread_mutex_unlock(&lock);
+
+    worker_free(&w);
+    return NULL;
+}
+
+static void write_full(int fd, const uint8_t *data, size_t len)
+{
+    ssize_t ret;
+
+    for (; len; data += ret, len -= ret) {
+	ret = write(fd, data, len);
+	if (ret < 0 && errno == EINTR)
+	    ret = 0;
+	else if (ret < 0) {
+	    perror("write");
+	    exit(1);
+	}
+    }
+}
+
+static void *writer_thread(void *arg)
+{
+    struct block *b;
+
+    while (1) {
+	b = &blocks[n_written % n_blocks];
+
+	pthread_mutex_lock(&lock);
+	while (!(n_written == n_read && eof) && b->state != BLOCK_DONE)
+	    pthread_cond_wait(&cond, &lock);
+	if (b->state != BLOCK_DONE) {
+	    pthread_mutex_unlock(&lock);
+	    break;
+	}
+	pthread_mutex_unlock(&lock);
+
+	write_full(out_fd, b->out.data, b->out.len);
+
+	pthread_mutex_lock(&lock);
+	b->state = BLOCK_FREE;
+	n_written ++;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+/* Read exactly @len bytes into @b, returns 0 at the end of the file */
+static int read_buf(FILE *f, struct buf *b, size_t len)
+{
+    if (b->size < len) {
+	b->size = len;
+	b->data = xrealloc(b->data, len);
+    }
+    b->len = fread(b->data, 1, len, f);
+    if (b->len && b->len < len)
+	fail("Truncated file");
+    return b->len > 0 || !len;
+}
+
+/*
+ * Read the next blob into @b.  The BlobHeader has the @type of the blob
+ * and the size of the Blob that follows.
+ */
+static int read_blob(FILE *f, struct block *b)
+{
+    struct pb msg, sub;
+    uint8_t size[4];
+    uint64_t v, blob_size = 0;
+    int num, type, ret;
+    size_t len;
+
+    len = fread(size, 1, 4, f);
+    if (!len)
+	return 0;
+    len = (size_t) size[0] << 24 | size[1] << 16 | size[2] << 8 | size[3];
+    if (len > MAX_HEADER_SIZE || !read_buf(f, &b->header, len))
+	fail("Broken blob header");
+
+    b->data = 0;
+    msg = (struct pb) { b->header.data, b->header.data + b->header.len };
+    while ((ret = pb_next(&msg, &num, &type, &v, &sub)) > 0)
+	if (num == 1 && type == PB_LEN)
+	    b->data = sub.end - sub.p == 7 && !memcmp(sub.p, "OSMData", 7);
+	else if (num == 3 && type == PB_VARINT)
+	    blob_size = v;
+    if (ret < 0 || blob_size > MAX_BLOB_SIZE ||
+	    !read_buf(f, &b->blob, blob_size))
+	fail("Broken blob header");
+
+    return 1;
+}
+
+static int enrich(FILE *in, int n_workers)
+{
+    pthread_t *workers, writer;
+    struct block *b;
+    int i;
+
+    n_blocks = n_workers * 4;
+    blocks = calloc(n_blocks, sizeof(*blocks));
+    workers = calloc(n_workers, sizeof(*workers));
+    if (!blocks || !workers)
+	fail("Out of memory");
+
+    for (i = 0; i < n_workers; i ++)
+	pthread_create(&workers[i], NULL, worker_thread, NULL);
+    pthread_create(&writer, NULL, writer_thread, NULL);
+
+    while (1) {
+	b = &blocks[n_read % n_blocks];
+
+	pthread_mutex_lock(&lock);
+	while (b->state != BLOCK_FREE)
+	    pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+
+	if (!read_blob(in, b))
+	    break;
+
+	pthread_mutex_lock(&lock);
+	b->state = BLOCK_READ;
+	n_read ++;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+    }
+
+    pthread_mutex_lock(&lock);
+    eof = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < n_workers; i ++)
+	pthread_join(workers[i], NULL);
+    pthread_join(writer, NULL);
+
+    for (i = 0; i < n_blocks; i ++) {
+	free(blocks[i].header.data);
+	free(blocks[i].blob.data);
+	free(blocks[i].out.data);
+    }
+    free(blocks);
+    free(workers);
+
+    fprintf(stderr, "%lu blocks, %lu short names added\n", n_read, n_added);
+    return 0;
+}
+
+/* Tags of the test entities, besides the names */
+static uint32_t gen_string(struct worker *w, const char *str)
+{
+    return strtab_add(&w->strtab, str, strlen(str), 0);
+}
+
+static void gen_tags(struct worker *w, uint32_t name, uint64_t k, int way)
+{
+    w->keys.n = w->vals.n = 0;
+    u32s_add(&w->keys, gen_string(w, "name"));
+    u32s_add(&w->vals, name);
+
+    if (way) {
+	u32s_add(&w->keys, gen_string(w, "highway"));
+	u32s_add(&w->vals, gen_string(w, "residential"));
+	if (k % 5 == 0) {
+	    u32s_add(&w->keys, gen_string(w, "name:pl"));
+	    u32s_add(&w->vals, name);
+	}
+	if (k % 11 == 0) {
+	    u32s_add(&w->keys, gen_string(w, "name:etymology:wikidata"));
+	    u32s_add(&w->vals, gen_string(w, "Q42"));
+	}
+    } else if (k % 7 == 0) {
+	u32s_add(&w->keys, gen_string(w, "short_name"));
+	u32s_add(&w->vals, gen_string(w, "Existing"));
+    }
+}
+
+static void gen_sint64s(struct buf *b, int num, const int64_t *v, size_t n,
+		struct buf *tmp)
+{
+    size_t i;
+
+    for (i = 0, tmp->len = 0; i < n; i ++)
+	buf_varint(tmp, zigzag_encode(v[i] - (i ? v[i - 1] : 0)));
+    buf_bytes(b, num, tmp->data, tmp->len);
+}
+
+/*
+ * A block with a dense node and a way for each of @n names, and a plain
+ * node for every tenth.
+ */
+static void gen_block(struct worker *w, char **names, size_t n, uint64_t id)
+{
+    int64_t ids[BLOCK_ENTITIES / 2], lats[BLOCK_ENTITIES / 2];
+    int64_t lons[BLOCK_ENTITIES / 2], refs[2];
+    const uint8_t *s;
+    uint32_t name, len;
+    size_t i;
+
+    strtab_reset(&w->strtab);
+    gen_string(w, "");
+    w->groups.len = 0;
+
+    /* Dense nodes */
+    w->group.len = 0;
+    w->entity.len = 0;
+    for (i = 0; i < n; i ++) {
+	ids[i] = id + i;
+	lats[i] = 520000000 + (id + i) * 37 % 100000;
+	lons[i] = 210000000 + (id + i) * 53 % 100000;
+	name = gen_string(w, names[i]);
+	gen_tags(w, name, id + i, 0);
+	write_kv(&w->entity, &w->keys, &w->vals);
+    }
+    w->block.len = 0;
+    gen_sint64s(&w->block, 1, ids, n, &w->tmp);
+    gen_sint64s(&w->block, 8, lats, n, &w->tmp);
+    gen_sint64s(&w->block, 9, lons, n, &w->tmp);
+    buf_bytes(&w->block, 10, w->entity.data, w->entity.len);
+    buf_bytes(&w->group, 2, w->block.data, w->block.len);
+    buf_bytes(&w->groups, 2, w->group.data, w->group.len);
+
+    /* Ways */
+    w->group.len = 0;
+    for (i = 0; i < n; i ++) {
+	gen_tags(w, gen_string(w, names[i]), id + i, 1);
+	refs[0] = id + i;
+	refs[1] = id + (i + 1) % n;
+	w->entity.len = 0;
+	buf_key(&w->entity, 1, PB_VARINT);
+	buf_varint(&w->entity, id + i);
+	write_u32s(&w->entity, 2, w->keys.v, w->keys.n, &w->tmp);
+	write_u32s(&w->entity, 3, w->vals.v, w->vals.n, &w->tmp);
+	gen_sint64s(&w->entity, 8, refs, 2, &w->tmp);
+	buf_bytes(&w->group, 3, w->entity.data, w->entity.len);
+    }
+    buf_bytes(&w->groups, 2, w->group.data, w->group.len);
+
+    /* Plain nodes */
+    w->group.len = 0;
+    for (i = 0; i < n; i += 10) {
+	gen_tags(w, gen_string(w, names[i]), id + i, 0);
+	w->entity.len = 0;
+	buf_key(&w->entity, 1, PB_VARINT);
+	buf_varint(&w->entity, zigzag_encode(1000000000 + id + i));
+	write_u32s(&w->entity, 2, w->keys.v, w->keys.n, &w->tmp);
+	write_u32s(&w->entity, 3, w->vals.v, w->vals.n, &w->tmp);
+	buf_key(&w->entity, 8, PB_VARINT);
+	buf_varint(&w->entity, zigzag_encode(lats[i]));
+	buf_key(&w->entity, 9, PB_VARINT);
+	buf_varint(&w->entity, zigzag_encode(lons[i]));
+	buf_bytes(&w->group, 1, w->entity.data, w->entity.len);
+    }
+    buf_bytes(&w->groups, 2, w->group.data, w->group.len);
+
+    w->raw.len = 0;
+    for (i = 0, w->tmp.len = 0; i < w->strtab.n; i ++) {
+	s = strtab_get(&w->strtab, i, &len);
+	buf_bytes(&w->tmp, 1, s, len);
+    }
+    buf_bytes(&w->raw, 1, w->tmp.data, w->tmp.len);
+    buf_put(&w->raw, w->groups.data, w->groups.len);
+}
+
+static int generate(const char *path, int fd)
+{
+    struct worker w = { 0 };
+    struct buf out = { 0 };
+    char **names = NULL, *line = NULL;
+    size_t n = 0, size = 0, line_size = 0, i;
+    uint64_t id = 1;
+    ssize_t len;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+	perror(path);
+	return 1;
+    }
+
+    w.raw.len = 0;
+    buf_bytes(&w.raw, 4, "OsmSchema-V0.6", 14);
+    buf_bytes(&w.raw, 4, "DenseNodes", 10);
+    buf_bytes(&w.raw, 16, "shrtnms-pbf", 11);
+    blob_encode(&w, NULL, "OSMHeader", &w.raw, &out);
+    write_full(fd, out.data, out.len);
+
+    while (1) {
+	len = getline(&line, &line_size, f);
+	if (len > 0 && line[len - 1] == '\n')
+	    line[-- len] = 0;
+	if (len > 0) {
+	    if (n == size) {
+		size = size ? size * 2 : 1024;
+		names = xrealloc(names, size * sizeof(*names));
+	    }
+	    names[n ++] = strdup(line);
+	}
+	if (n && (len < 0 || n == BLOCK_ENTITIES / 2)) {
+	    gen_block(&w, names, n, id);
+	    blob_encode(&w, NULL, "OSMData", &w.raw, &out);
+	    write_full(fd, out.data, out.len);
+	    id += n;
+	    for (i = 0; i < n; i ++)
+		free(names[i]);
+	    n = 0;
+	}
+	if (len < 0)
+	    break;
+    }
+
+    fclose(f);
+    free(line);
+    free(names);
+    free(out.data);
+    worker_free(&w);
+    return 0;
+}
+
+static void print_tags(struct worker *w, const char *type, int64_t id)
+{
+    const uint8_t *k, *v;
+    uint32_t k_len, v_len;
+    size_t i;
+
+    if (!w->keys.n)
+	return;
+
+    printf("%s %lld", type, (long long) id);
+    for (i = 0; i < w->keys.n; i ++) {
+	k = strtab_get(&w->strtab, w->keys.v[i], &k_len);
+	v = strtab_get(&w->strtab, w->vals.v[i], &v_len);
+	printf("\t%.*s=%.*s", (int) k_len, k, (int) v_len, v);
+    }
+    printf("\n");
+}
+
+/* Print the tags of a Node or Way */
+static int print_entity(struct worker *w, struct pb msg, const char *type)
+{
+    struct pb sub;
+    uint64_t v;
+    int64_t id = 0;
+    int num, t, ret;
+
+    w->keys.n = w->vals.n = 0;
+    while ((ret = pb_next(&msg, &num, &t, &v, &sub)) > 0)
+	if (num == 1 && t == PB_VARINT)
+	    id = *type == 'n' ? zigzag_decode(v) : (int64_t) v;
+	else if (num == 2 && read_u32s(&w->keys, t, v, &sub))
+	    return -1;
+	else if (num == 3 && read_u32s(&w->vals, t, v, &sub))
+	    return -1;
+    if (ret < 0 || w->keys.n != w->vals.n ||
+	    check_u32s(w, &w->keys) || check_u32s(w, &w->vals))
+	return -1;
+
+    print_tags(w, type, id);
+    return 0;
+}
+
+static int print_dense(struct worker *w, struct pb msg)
+{
+    struct pb sub, ids = { NULL, NULL };
+    uint64_t v;
+    int64_t id = 0;
+    size_t i;
+    int num, type, ret;
+
+    w->kv.n = 0;
+    while ((ret = pb_next(&msg, &num, &type, &v, &sub)) > 0)
+	if (num == 1 && type == PB_LEN)
+	    ids = sub;
+	else if (num == 10 && read_u32s(&w->kv, type, v, &sub))
+	    return -1;
+    if (ret < 0 || check_u32s(w, &w->kv))
+	return -1;
+
+    for (i = 0; i < w->kv.n && ids.p < ids.end; i ++) {
+	if (pb_varint(&ids, &v))
+	    return -1;
+	id += zigzag_decode(v);
+
+	w->keys.n = w->vals.n = 0;
+	for (; i + 1 < w->kv.n && w->kv.v[i]; i += 2) {
+	    u32s_add(&w->keys, w->kv.v[i]);
+	    u32s_add(&w->vals, w->kv.v[i + 1]);
+	}
+	print_tags(w, "node", id);
+    }
+
+    return 0;
+}
+
+static int print_group(struct worker *w, struct pb group)
+{
+    struct pb sub;
+    uint64_t v;
+    int num, type, ret;
+
+    while ((ret = pb_next(&group, &num, &type, &v, &sub)) > 0)
+	if (type != PB_LEN)
+	    continue;
+	else if (num == 1 && print_entity(w, sub, "node"))
+	    return -1;
+	else if (num == 2 && print_dense(w, sub))
+	    return -1;
+	else if (num == 3 && print_entity(w, sub, "way"))
+	    return -1;
+
+    return ret;
+}
+
+static int print_file(FILE *in)
+{
+    struct worker w = { 0 };
+    struct block b = { 0 };
+    struct pb msg, sub, str;
+    uint64_t v;
+    int num, type;
+
+    while (read_blob(in, &b)) {
+	if (!b.data)
+	    continue;
+	if (blob_decode(&w, &b.blob))
+	    fail("Broken data block");
+
+	strtab_reset(&w.strtab);
+	msg = (struct pb) { w.raw.data, w.raw.data + w.raw.len };
+	while (pb_next(&msg, &num, &type, &v, &sub) > 0)
+	    if (num == 1 && type == PB_LEN)
+		while (pb_next(&sub, &num, &type, &v, &str) > 0)
+		    if (num == 1 && type == PB_LEN)
+			strtab_add(&w.strtab, str.p, str.end - str.p, 1);
+
+	msg.p = w.raw.data;
+	while (pb_next(&msg, &num, &type, &v, &sub) > 0)
+	    if (num == 2 && type == PB_LEN && print_group(&w, sub))
+		fail("Broken data block");
+    }
+
+    free(b.header.data);
+    free(b.blob.data);
+    worker_free(&w);
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-j <threads>] [-z <level>] "
+		    "[-d <dictionary>] <in.osm.pbf> <out.osm.pbf>\n"
+		    "       %s -t <names> <out.osm.pbf>\n"
+		    "       %s -p <in.osm.pbf>\n", argv0, argv0, argv0);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dict = NULL, *names = NULL;
+    int n_workers, opt, print = 0, ret;
+    FILE *in = NULL;
+
+    n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_workers < 1)
+	n_workers = 1;
+
+    while ((opt = getopt(argc, argv, "j:z:d:t:p")) != -1)
+	switch (opt) {
+	case 'j':
+	    n_workers = atoi(optarg);
+	    break;
+	case 'z':
+	    level = atoi(optarg);
+	    break;
+	case 'd':
+	    dict = optarg;
+	    break;
+	case 't':
+	    names = optarg;
+	    break;
+	case 'p':
+	    print = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    if (n_workers < 1 || optind + (names || print ? 1 : 2) != argc)
+	usage(argv[0]);
+
+    if (!names) {
+	in = fopen(argv[optind], "rb");
+	if (!in) {
+	    perror(argv[optind]);
+	    return 1;
+	}
+	if (print)
+	    return print_file(in);
+	optind ++;
+    }
+
+    out_fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd < 0) {
+	perror(argv[optind]);
+	return 1;
+    }
+    if (names)
+	return generate(names, out_fd);
+
+    sh = dict ? shortener_load(dict) : shortener_new();
+    if (!sh) {
+	fprintf(stderr, "Can't load the dictionary\n");
+	return 1;
+    }
+
+    ret = enrich(in, n_workers);
+
+    fclose(in);
+    if (close(out_fd) < 0) {
+	perror(argv[optind]);
+	ret = 1;
+    }
+    shortener_free(sh);
+    return ret;
+}
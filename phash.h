@@ -0,0 +1,44 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Hash functions shared by mkdict, which builds the minimal perfect hash
+ * of given names, and by the lookup in shorten.c.  The key is hashed one
+ * lower case character at a time so that the hash of every prefix of a
+ * word is available during a single walk over it.  The first hash picks a
+ * bucket, and the bucket's displacement value picks the final slot.
+ */
+
+#include <stdint.h>
+#include <wchar.h>
+
+#define PHASH_INIT	0xcbf29ce484222325ULL
+
+static inline uint64_t phash_step(uint64_t h, wchar_t c)
+{
+    return (h ^ (uint32_t) c) * 0x100000001b3ULL;
+}
+
+static inline uint64_t phash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline unsigned int phash_bucket(uint64_t h, unsigned int n_buckets)
+{
+    return phash_mix(h) % n_buckets;
+}
+
+static inline unsigned int phash_slot(uint64_t h, unsigned int disp,
+		unsigned int n_slots)
+{
+    return phash_mix(h ^ (disp * 0x9e3779b97f4a7c15ULL)) % n_slots;
+}
@@ -0,0 +1,56 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Protocol spoken over the Unix socket between shrtnmsd and the client in
+ * client.c.  Both directions are a stream of frames, each starting with
+ * the length of the rest of the frame, the id of the request, chosen by
+ * the client and copied to the response, and the number of names.  All
+ * integers are little endian.
+ *
+ *   Request:  u32 length, u32 id, u32 count, then for every name:
+ *             u16 name length, u8 languages length, name, languages
+ *   Response: u32 length, u32 id, u32 count, then for every name:
+ *             u16 short length, u16 shortest length, short, shortest
+ *
+ * The languages are as in shortener_shorten_lang(), empty for all.  Both
+ * forms are cut at 511 bytes like in shortener_shorten().  If the forms of
+ * all the names wouldn't fit in a frame, the response only has those of
+ * the first count names that do, always at least one.  Responses to
+ * the requests on one connection can come in any order.  The daemon
+ * closes the connection on a malformed request.
+ */
+
+#include <stdint.h>
+
+#define PROTO_HEADER_SIZE	12
+#define PROTO_MAX_FRAME		(1 << 20)
+#define PROTO_MAX_NAME		0xffff
+#define PROTO_MAX_LANGS		0xff
+
+static inline void proto_put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void proto_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint16_t proto_get16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static inline uint32_t proto_get32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
@@ -0,0 +1,389 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * CPython extension module "shortnames" over the built-in dictionary:
+ *
+ *   shorten(name, langs=None) -> (short, shortest)
+ *
+ * works on a str, or bytes in UTF-8 giving bytes back, and
+ *
+ *   shorten_batch(names, offsets=None, langs=None)
+ *       -> (short_data, short_offsets, shortest_data, shortest_offsets)
+ *
+ * shortens many names in one call, with the GIL released so that several
+ * threads can run it at the same time.  @names is a list or tuple of str
+ * or bytes, a NumPy array of fixed width byte strings (dtype "S"), or the
+ * data buffer of an Arrow string array with its int32 or int64 @offsets
+ * buffer.  The buffers are read in place.  The results come back in the
+ * Arrow large_string layout, each form as one bytes object with all the
+ * strings in UTF-8 and a bytes object with the n + 1 native int64
+ * offsets, so no Python object is created per name, e.g.:
+ *
+ *   pyarrow.Array.from_buffers(pyarrow.large_string(), n,
+ *           [None, pyarrow.py_buffer(offsets), pyarrow.py_buffer(data)])
+ *
+ * Unlike shortener_shorten() nothing is cut at 511 bytes.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdint.h>
+
+#include "shortnames.h"
+
+static struct shortener *sh;
+
+/* Growing output buffers, only touched without the GIL */
+struct out_buf {
+    char *data;
+    size_t len, size;
+    int64_t *offsets;
+};
+
+/* The names to shorten, however they were passed */
+struct batch {
+    Py_ssize_t count;
+    const char **names;		/* From a list */
+    size_t *lens;
+    const char *data;		/* From a buffer */
+    const void *offsets;
+    int offsets64;
+    size_t width;		/* Fixed width items when no offsets */
+    size_t data_len;
+};
+
+static int out_init(struct out_buf *o, Py_ssize_t count)
+{
+    o->len = 0;
+    o->size = 64 * (count + 1);
+    o->data = malloc(o->size);
+    o->offsets = malloc((count + 1) * sizeof(*o->offsets));
+    return o->data && o->offsets ? 0 : -1;
+}
+
+static int out_grow(struct out_buf *o, size_t need)
+{
+    char *data;
+
+    if (o->len + need <= o->size)
+	return 0;
+
+    while (o->len + need > o->size)
+	o->size *= 2;
+    data = realloc(o->data, o->size);
+    if (!data)
+	return -1;
+    o->data = data;
+    return 0;
+}
+
+static void out_free(struct out_buf *o)
+{
+    free(o->data);
+    free(o->offsets);
+}
+
+/* Name number @i, or NULL if the offsets are out of bounds */
+static const char *batch_name(const struct batch *b, Py_ssize_t i,
+		size_t *len)
+{
+    int64_t start, end;
+
+    if (b->names) {
+	*len = b->lens[i];
+	return b->names[i];
+    }
+
+    if (!b->offsets) {
+	*len = strnlen(b->data + i * b->width, b->width);
+	return b->data + i * b->width;
+    }
+
+    if (b->offsets64) {
+	start = ((const int64_t *) b->offsets)[i];
+	end = ((const int64_t *) b->offsets)[i + 1];
+    } else {
+	start = ((const int32_t *) b->offsets)[i];
+	end = ((const int32_t *) b->offsets)[i + 1];
+    }
+    if (start < 0 || end < start || (uint64_t) end > b->data_len)
+	return NULL;
+
+    *len = end - start;
+    return b->data + start;
+}
+
+/*
+ * Shorten all the names into @s and @ss, runs without the GIL.  Returns
+ * 0, -1 when out of memory or -2 on bad offsets.
+ */
+static int batch_run(const struct batch *b, const char *langs,
+		struct out_buf *s, struct out_buf *ss)
+{
+    const char *name;
+    size_t len, short_len, shortest_len;
+    Py_ssize_t i;
+
+    s->offsets[0] = ss->offsets[0] = 0;
+    for (i = 0; i < b->count; i ++) {
+	name = batch_name(b, i, &len);
+	if (!name)
+	    return -2;
+
+	while (shortener_shorten_n(sh, name, len, langs,
+				s->data + s->len, s->size - s->len,
+				&short_len,
+				ss->data + ss->len, ss->size - ss->len,
+				&shortest_len))
+	    if (out_grow(s, short_len) || out_grow(ss, shortest_len))
+		return -1;
+
+	s->len += short_len;
+	ss->len += shortest_len;
+	s->offsets[i + 1] = s->len;
+	ss->offsets[i + 1] = ss->len;
+    }
+
+    return 0;
+}
+
+/*
+ * Take the UTF-8 of every str or bytes item of the tuple @seq, which must
+ * be kept until the names are no longer used.
+ */
+static int batch_from_seq(struct batch *b, PyObject *seq)
+{
+    PyObject *item;
+    Py_ssize_t i, len;
+
+    b->count = PyTuple_GET_SIZE(seq);
+    b->names = PyMem_Malloc((b->count + 1) * sizeof(*b->names));
+    b->lens = PyMem_Malloc((b->count + 1) * sizeof(*b->lens));
+    if (!b->names || !b->lens) {
+	PyErr_NoMemory();
+	return -1;
+    }
+
+    for (i = 0; i < b->count; i ++) {
+	item = PyTuple_GET_ITEM(seq, i);
+	if (PyUnicode_Check(item))
+	    b->names[i] = PyUnicode_AsUTF8AndSize(item, &len);
+	else if (PyBytes_Check(item)) {
+	    b->names[i] = PyBytes_AS_STRING(item);
+	    len = PyBytes_GET_SIZE(item);
+	} else {
+	    PyErr_Format(PyExc_TypeError, "names[%zd] is not str or bytes", i);
+	    return -1;
+	}
+	if (!b->names[i])
+	    return -1;
+	b->lens[i] = len;
+    }
+
+    return 0;
+}
+
+/* An Arrow data buffer with its offsets, or a NumPy "S" array */
+static int batch_from_buffers(struct batch *b, const Py_buffer *data,
+		const Py_buffer *offsets)
+{
+    const char *format;
+    char *end;
+
+    b->data = data->buf;
+    b->data_len = data->len;
+
+    if (offsets) {
+	format = offsets->format ? offsets->format : "B";
+	if (*format == '<' || *format == '=' || *format == '@')
+	    format ++;
+	if (offsets->itemsize == 8 && strchr("qlQL", *format) && !format[1])
+	    b->offsets64 = 1;
+	else if (offsets->itemsize != 4 || !strchr("iIlL", *format) ||
+		format[1]) {
+	    PyErr_SetString(PyExc_TypeError,
+			    "offsets must be int32 or int64");
+	    return -1;
+	}
+
+	b->offsets = offsets->buf;
+	b->count = offsets->len / offsets->itemsize - 1;
+	if (b->count < 0) {
+	    PyErr_SetString(PyExc_ValueError, "offsets is empty");
+	    return -1;
+	}
+	return 0;
+    }
+
+    /* Fixed width items like NumPy's "S10" */
+    format = data->format ? data->format : "B";
+    b->width = strtoul(format, &end, 10);
+    if (data->ndim != 1 || strcmp(end, "s") ||
+	    b->width != (size_t) data->itemsize || !b->width) {
+	PyErr_SetString(PyExc_TypeError, "names must be a list of str or "
+			"bytes, an array of fixed width byte strings or a "
+			"string buffer with offsets");
+	return -1;
+    }
+
+    b->count = data->shape[0];
+    return 0;
+}
+
+static PyObject *py_shorten_batch(PyObject *self, PyObject *args,
+		PyObject *kwargs)
+{
+    static char *kwlist[] = { "names", "offsets", "langs", NULL };
+    PyObject *names, *offsets_obj = NULL, *seq = NULL, *ret = NULL;
+    Py_buffer data = { 0 }, offsets = { 0 };
+    struct batch b = { 0 };
+    struct out_buf s = { 0 }, ss = { 0 };
+    const char *langs = NULL;
+    int err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Oz", kwlist,
+			    &names, &offsets_obj, &langs))
+	return NULL;
+
+    if (!offsets_obj && (PyList_Check(names) || PyTuple_Check(names))) {
+	/*
+	 * A list can be changed by other threads while the GIL is released,
+	 * a copy of it as a tuple holds the items until we're done.
+	 */
+	seq = PySequence_Tuple(names);
+	if (!seq || batch_from_seq(&b, seq))
+	    goto out;
+    } else {
+	if (PyObject_GetBuffer(names, &data,
+				PyBUF_C_CONTIGUOUS | PyBUF_FORMAT))
+	    goto out;
+	if (offsets_obj && PyObject_GetBuffer(offsets_obj, &offsets,
+				PyBUF_C_CONTIGUOUS | PyBUF_FORMAT))
+	    goto out;
+	if (batch_from_buffers(&b, &data, offsets_obj ? &offsets : NULL))
+	    goto out;
+    }
+
+    if (out_init(&s, b.count) || out_init(&ss, b.count)) {
+	PyErr_NoMemory();
+	goto out;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    err = batch_run(&b, langs, &s, &ss);
+    Py_END_ALLOW_THREADS
+
+    if (err == -1)
+	PyErr_NoMemory();
+    else if (err == -2)
+	PyErr_SetString(PyExc_ValueError, "offsets out of bounds");
+    else
+	ret = Py_BuildValue("(y#y#y#y#)",
+			s.data, (Py_ssize_t) s.len,
+			(const char *) s.offsets,
+			(Py_ssize_t) ((b.count + 1) * sizeof(int64_t)),
+			ss.data, (Py_ssize_t) ss.len,
+			(const char *) ss.offsets,
+			(Py_ssize_t) ((b.count + 1) * sizeof(int64_t)));
+
+out:
+    out_free(&s);
+    out_free(&ss);
+    PyMem_Free(b.names);
+    PyMem_Free(b.lens);
+    Py_XDECREF(seq);
+    if (data.obj)
+	PyBuffer_Release(&data);
+    if (offsets.obj)
+	PyBuffer_Release(&offsets);
+    return ret;
+}
+
+static PyObject *py_shorten(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = { "name", "langs", NULL };
+    PyObject *name, *ret = NULL;
+    const char *str, *langs = NULL;
+    char buf[2][512], *short_name = buf[0], *shortest_name = buf[1];
+    size_t short_size = 512, shortest_size = 512, short_len, shortest_len;
+    Py_ssize_t len;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|z", kwlist,
+			    &name, &langs))
+	return NULL;
+
+    if (PyUnicode_Check(name))
+	str = PyUnicode_AsUTF8AndSize(name, &len);
+    else if (PyBytes_Check(name)) {
+	str = PyBytes_AS_STRING(name);
+	len = PyBytes_GET_SIZE(name);
+    } else {
+	PyErr_SetString(PyExc_TypeError, "name must be str or bytes");
+	return NULL;
+    }
+    if (!str)
+	return NULL;
+
+    /* Only very long names need more than the buffers on the stack */
+    while (shortener_shorten_n(sh, str, len, langs,
+			    short_name, short_size, &short_len,
+			    shortest_name, shortest_size, &shortest_len)) {
+	if (short_name != buf[0])
+	    PyMem_Free(short_name);
+	if (shortest_name != buf[1])
+	    PyMem_Free(shortest_name);
+	short_size = short_len;
+	shortest_size = shortest_len;
+	short_name = PyMem_Malloc(short_size + 1);
+	shortest_name = PyMem_Malloc(shortest_size + 1);
+	if (!short_name || !shortest_name) {
+	    PyErr_NoMemory();
+	    goto out;
+	}
+    }
+
+    ret = Py_BuildValue(PyUnicode_Check(name) ? "(s#s#)" : "(y#y#)",
+		    short_name, (Py_ssize_t) short_len,
+		    shortest_name, (Py_ssize_t) shortest_len);
+
+out:
+    if (short_name != buf[0])
+	PyMem_Free(short_name);
+    if (shortest_name != buf[1])
+	PyMem_Free(shortest_name);
+    return ret;
+}
+
+static PyMethodDef methods[] = {
+    { "shorten", (PyCFunction) py_shorten, METH_VARARGS | METH_KEYWORDS,
+	"shorten(name, langs=None) -> (short, shortest)" },
+    { "shorten_batch", (PyCFunction) py_shorten_batch,
+	METH_VARARGS | METH_KEYWORDS,
+	"shorten_batch(names, offsets=None, langs=None) -> "
+	"(short_data, short_offsets, shortest_data, shortest_offsets)" },
+    { NULL }
+};
+
+static struct PyModuleDef module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "shortnames",
+    .m_doc = "Map name abbreviation, see pyshortnames.c",
+    .m_size = -1,
+    .m_methods = methods,
+};
+
+PyMODINIT_FUNC PyInit_shortnames(void)
+{
+    if (!sh) {
+	sh = shortener_new();
+	if (!sh)
+	    return PyErr_NoMemory();
+    }
+
+    return PyModule_Create(&module);
+}
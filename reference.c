@@ -0,0 +1,340 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * The original shorten_name() algorithm, kept as a reference for testing
+ * the real one in shorten.c against, see fuzz.c and compare.c.  The name
+ * is decoded to wchar_t, and at every word all the abbreviations and then
+ * all the given names are tried from top to bottom with a case-insensitive
+ * compare, exactly like the first version did with its arrays.  Only the
+ * data comes from the dictionary image, and the wchar_t buffers grow as
+ * needed instead of overflowing.
+ *
+ * Languages and compound words came later and are done the same slow way:
+ * the entries of every language are found by walking the language's tries
+ * once per call, and the compound heads are compared with the end of every
+ * word in turn.
+ *
+ * Everything the original did is kept on purpose, including whitespace
+ * being written to the short form a second time when the shortest one is
+ * not empty.  Don't optimise or fix anything in here, change shorten.c
+ * and see if the two still agree instead.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "dict.h"
+#include "unicode.h"
+#include "reference.h"
+
+struct wbuf {
+    wchar_t *str;
+    size_t len, size;
+};
+
+static void wbuf_put(struct wbuf *b, wchar_t c)
+{
+    if (b->len == b->size) {
+	b->size = b->size ? b->size * 2 : 64;
+	b->str = realloc(b->str, b->size * sizeof(wchar_t));
+	if (!b->str)
+	    abort();
+    }
+    b->str[b->len ++] = c;
+}
+
+static wchar_t wbuf_last(const struct wbuf *b)
+{
+    return b->len ? b->str[b->len - 1] : 0;
+}
+
+/* Same as wcsncasecmp(@phrase, @word, wcslen(@phrase)) == 0 */
+static int ref_prefix(const wchar_t *word, const char *phrase, int *len)
+{
+    wchar_t c;
+    int i, n;
+
+    for (i = 0; *phrase; i ++, phrase += n) {
+	c = utf8_get(phrase, &n);
+	if (uc_tolower(word[i]) != uc_tolower(c))
+	    return 0;
+    }
+
+    *len = i;
+    return 1;
+}
+
+/* Same as ref_prefix() but for a suffix of the word from @word to @wend */
+static int ref_suffix(const wchar_t *word, const wchar_t *wend,
+		const char *phrase, int *len)
+{
+    const char *p;
+    wchar_t c;
+    int i, n;
+
+    for (i = 0, p = phrase; utf8_get(p, &n); p += n)
+	i ++;
+    if (i >= wend - word)
+	return 0;
+
+    for (word = wend - i; *phrase; word ++, phrase += n) {
+	c = utf8_get(phrase, &n);
+	if (uc_tolower(*word) != uc_tolower(c))
+	    return 0;
+    }
+
+    *len = i;
+    return 1;
+}
+
+/* Add language bit @lang to every entry matched anywhere in the trie */
+static void ref_trie_langs(const struct dict_node *nodes, uint32_t root,
+		int lang, uint32_t *entry_langs)
+{
+    uint32_t i;
+
+    if (root == DICT_NO_TRIE)
+	return;
+    if (nodes[root].match >= 0)
+	entry_langs[nodes[root].match] |= 1u << lang;
+    for (i = 0; i < nodes[root].n_children; i ++)
+	ref_trie_langs(nodes, nodes[root].children + i, lang, entry_langs);
+}
+
+/*
+ * The mask of the languages listed in @langs like in shortener_shorten_lang(),
+ * or all of them if none.
+ */
+static uint32_t ref_langs(const struct dict_header *hdr,
+		const struct dict_lang *dlangs, const char *langs)
+{
+    uint32_t mask = 0;
+    size_t len, code_len;
+    int i;
+
+    if (!langs || !*langs)
+	return ~0u;
+
+    for (; *langs; langs += len) {
+	langs += strspn(langs, ";, ");
+	len = strcspn(langs, ";, ");
+	code_len = strcspn(langs, "-_;, ");
+
+	for (i = 0; i < hdr->n_langs; i ++)
+	    if (!strncasecmp(dlangs[i].code, langs, code_len) &&
+		    !dlangs[i].code[code_len])
+		mask |= 1u << i;
+    }
+
+    return mask;
+}
+
+/* The same truncation as in shortener_shorten(), at 511 bytes */
+static void ref_encode(char *out, const struct wbuf *b)
+{
+    char buf[4];
+    size_t i, len = 0;
+    int n;
+
+    for (i = 0; i < b->len; i ++) {
+	n = utf8_put(buf, b->str[i]);
+	if (len + n > 511)
+	    break;
+	memcpy(out + len, buf, n);
+	len += n;
+    }
+    out[len] = 0;
+}
+
+void reference_shorten(const void *image, const char *name,
+		char short_name[512], char shortest_name[512])
+{
+    reference_shorten_lang(image, name, NULL, short_name, shortest_name);
+}
+
+void reference_shorten_lang(const void *image, const char *name,
+		const char *langs,
+		char short_name[512], char shortest_name[512])
+{
+    const struct dict_header *hdr = image;
+    const unsigned char *base = image;
+    const char *strings = (const char *) base + hdr->strings;
+    const struct dict_entry *entries = (const void *) (base + hdr->entries);
+    const struct dict_node *nodes = (const void *) (base + hdr->nodes);
+    const struct dict_lang *dlangs = (const void *) (base + hdr->langs);
+    const struct dict_name *names = (const void *) (base + hdr->names);
+    struct wbuf w_name = { 0 }, w_short = { 0 }, w_shortest = { 0 };
+    const wchar_t *cur_word, *wend;
+    const char *abbrev;
+    uint32_t mask, *entry_langs;
+    wchar_t c;
+    int unabbrev = 0;
+    int i, j, n, len, best, best_len = 0, capital;
+
+    if (!name)
+	return;
+
+    /*
+     * Without languages every entry but the compound heads is used, like
+     * in the original, otherwise those in the tries of the languages.
+     */
+    mask = ref_langs(hdr, dlangs, langs);
+    entry_langs = calloc(hdr->n_entries + 1, sizeof(*entry_langs));
+    if (!entry_langs)
+	abort();
+    for (i = 0; i < hdr->n_entries; i ++)
+	if (!(entries[i].flags & DICT_COMPOUND) && mask == ~0u)
+	    entry_langs[i] = ~0u;
+    for (i = 0; i < hdr->n_langs && mask != ~0u; i ++) {
+	for (j = 0; j < DICT_SCRIPTS; j ++)
+	    ref_trie_langs(nodes, dlangs[i].tries[j], i, entry_langs);
+	ref_trie_langs(nodes, dlangs[i].suffixes, i, entry_langs);
+    }
+
+    while ((c = utf8_get(name, &n))) {
+	wbuf_put(&w_name, c);
+	name += n;
+    }
+    wbuf_put(&w_name, 0);
+
+    cur_word = w_name.str;
+    while (1) {
+	while (*cur_word && !uc_isalnum(*cur_word))
+	    if (uc_isspace(*cur_word)) {
+		/*
+		 * Avoid leading or consecutive whitespace when something gets
+		 * replaced with "".
+		 */
+		if (w_short.len && !uc_isspace(wbuf_last(&w_short)))
+		    wbuf_put(&w_short, *cur_word);
+		if (w_shortest.len && !uc_isspace(wbuf_last(&w_shortest)))
+		    wbuf_put(&w_short, *cur_word);
+		cur_word ++;
+	    } else {
+		wbuf_put(&w_short, *cur_word);
+		wbuf_put(&w_shortest, *cur_word ++);
+	    }
+
+	if (!*cur_word)
+	    break;
+
+	/* Go through possible abbreviations from top to bottom */
+	for (i = 0; i < hdr->n_entries; i ++) {
+	    if (!(entry_langs[i] & mask) || (entries[i].flags & DICT_COMPOUND))
+		continue;
+	    if (!ref_prefix(cur_word, strings + entries[i].phrase, &len))
+		continue;
+
+	    /* Check that we matched a full word */
+	    if (uc_isalnum(cur_word[len]))
+		continue;
+
+	    capital = uc_isupper(*cur_word);
+	    cur_word += len;
+
+	    /*
+	     * If original was capitalised then capitalise the abbreviation
+	     * as well, if it was lower case.
+	     */
+	    for (abbrev = strings + entries[i].abbrev, len = 0;
+		    (c = utf8_get(abbrev, &n)); abbrev += n, len ++)
+		wbuf_put(&w_short, capital && !len ? uc_toupper(c) : c);
+
+	    /* Make sure shortest_word doesn't end up being empty */
+	    if (!*cur_word && !unabbrev)
+		for (n = w_short.len - len; n < w_short.len; n ++)
+		    wbuf_put(&w_shortest, w_short.str[n]);
+
+	    break;
+	}
+	if (i < hdr->n_entries)
+	    continue;
+
+	/*
+	 * Go through possible given names from top to bottom.  They're
+	 * stored in hash order so the topmost is the one with the lowest
+	 * index.
+	 */
+	for (i = 0, best = -1; i < hdr->n_names; i ++) {
+	    if (!(names[i].langs & mask))
+		continue;
+	    if (!ref_prefix(cur_word, strings + names[i].key, &len))
+		continue;
+
+	    /* Check that we matched a full word */
+	    if (uc_isalnum(cur_word[len]))
+		continue;
+
+	    /*
+	     * If this is the final part of the name, and it matches a
+	     * given name then that's most likely somebody's surname which
+	     * happens to also be a possibble given name.  In that case
+	     * do not abbreviate or omit it.
+	     */
+	    if (!cur_word[len])
+		continue;
+
+	    if (best < 0 || names[i].index < names[best].index) {
+		best = i;
+		best_len = len;
+	    }
+	}
+	if (best >= 0) {
+	    cur_word += best_len;
+	    for (abbrev = strings + names[best].initial;
+		    (c = utf8_get(abbrev, &n)); abbrev += n)
+		wbuf_put(&w_short, c);
+	    continue;
+	}
+
+	/*
+	 * Go through the compound heads ending the word, the longest and
+	 * then the topmost wins, and abbreviate it keeping the rest.
+	 */
+	for (wend = cur_word; uc_isalnum(*wend); wend ++);
+	for (i = 0, best = -1, best_len = 0; i < hdr->n_entries; i ++) {
+	    if (!(entry_langs[i] & mask) || !(entries[i].flags & DICT_COMPOUND))
+		continue;
+	    if (ref_suffix(cur_word, wend, strings + entries[i].phrase, &len) &&
+		    len > best_len) {
+		best = i;
+		best_len = len;
+	    }
+	}
+	if (best >= 0) {
+	    while (cur_word < wend - best_len) {
+		wbuf_put(&w_short, *cur_word);
+		wbuf_put(&w_shortest, *cur_word ++);
+	    }
+
+	    capital = uc_isupper(*cur_word);
+	    for (abbrev = strings + entries[best].abbrev, len = 0;
+		    (c = utf8_get(abbrev, &n)); abbrev += n, len ++)
+		wbuf_put(&w_short, capital && !len ? uc_toupper(c) : c);
+
+	    cur_word = wend;
+	    unabbrev += 1;
+	    continue;
+	}
+
+	/* Nothing matched, copy the current word as-is */
+	while (uc_isalnum(*cur_word)) {
+	    wbuf_put(&w_short, *cur_word);
+	    wbuf_put(&w_shortest, *cur_word ++);
+	}
+	unabbrev += 1;
+    }
+
+    ref_encode(short_name, &w_short);
+    ref_encode(shortest_name, &w_shortest);
+
+    free(entry_langs);
+    free(w_name.str);
+    free(w_short.str);
+    free(w_shortest.str);
+}
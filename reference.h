@@ -0,0 +1,17 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * The original algorithm, slow but obviously correct, for testing only.
+ * Works like shortener_shorten() with all languages, or like
+ * shortener_shorten_lang() with @langs, using the dictionary @image
+ * directly, e.g. dict_builtin.  The image must be valid.
+ */
+void reference_shorten(const void *image, const char *name,
+		char short_name[512], char shortest_name[512]);
+void reference_shorten_lang(const void *image, const char *name,
+		const char *langs,
+		char short_name[512], char shortest_name[512]);
@@ -7,928 +7,1709 @@
 /*
  * Functions like strcasecmp and strcasecmp_l seem to ignore the locale
  * and non-ascii characters on Linux (glibc?), but not on darwin (bsd stuff?).
- * However they work fine with wide char (wchar_t) in both forms:
- * wcscasecmp and wcscasecmp_l.  So to support Linux we end up using the
- * wide char versions and converting all strings back and forth. (for now)
- *
- * Unfortunately it seems functions like mbrlen don't even have a _l
- * counterpart and can only work with the per-thread locales.  And they're
- * not fixed at UTF-8, mbrlen() only returns -1 when locale is unset.  We
- * avoid them for now.
- *
- * If anyone knows the proper way to do UTF-8 in C, please fix this.  But,
- * it didn't seem like either ICU or Glib bring any substantial improvement
- * in API complexity.
+ * And the per-thread locale needed by the wide char functions on Linux gets
+ * in the way of using this from a library.  So the input is decoded from
+ * UTF-8 one character at a time and classified using our own tables from
+ * unicode.h, generated from the Unicode data in the same way glibc does it
+ * for C.UTF-8, while the input, the dictionaries and the output all stay
+ * in UTF-8.
  */
 
+#include <stdlib.h>
 #include <string.h>
-#include <wchar.h>
-#include <locale.h>
-#include <xlocale.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef SHORTENER_STATS
+#include <time.h>
+#endif
+
+#include "shortnames.h"
+#include "dict.h"
+#include "phash.h"
+#include "unicode.h"
 
 /*
- * Can't find wcsrtombs_l or mbsrtowcs_l on my Linux install :(  Works on
- * Darwin again.
+ * Hooks for bench.c, which includes this file, to time the dictionary
+ * lookups on their own.  They compile to nothing otherwise.
  */
-#ifdef linux
-# define mbsrtowcs_l(a, b, c, d, l) mbsrtowcs(a, b, c, d)
-# define wcsrtombs_l(a, b, c, d, l) wcsrtombs(a, b, c, d)
+#ifndef PHASE_BEGIN
+#define PHASE_BEGIN()
+#define PHASE_END(phase)
 #endif
 
-#include "shortnames.h"
+/*
+ * One of the output strings.  @len counts everything that was written
+ * even if it didn't fit in @size bytes, while @written is what's actually
+ * in @buf.  Once something doesn't fit nothing more is written, so the
+ * output is always cut at a character boundary, like wcsrtombs() does.
+ * @size doesn't include space for a terminating NUL.
+ */
+struct out {
+    char *buf;
+    size_t size, len, written;
+    wchar_t last;
+};
+
+static void out_bytes(struct out *o, const char *str, size_t len)
+{
+    size_t n = len;
+
+    if (o->written == o->len) {
+	/* Whatever characters of a longer string still fit */
+	if (o->written + n > o->size)
+	    for (n = o->size - o->written; n && (str[n] & 0xc0) == 0x80; n --);
 
+	memcpy(o->buf + o->written, str, n);
+	o->written += n;
+    }
+    o->len += len;
+}
+
+static void out_char(struct out *o, wchar_t c)
+{
+    char buf[4];
+
+    out_bytes(o, buf, utf8_put(buf, c));
+    o->last = c;
+}
+
+static void out_str(struct out *o, const char *str, size_t len)
+{
+    const char *p = str + len;
+    int n;
+
+    if (!len)
+	return;
+
+    out_bytes(o, str, len);
+
+    while (p > str && (*-- p & 0xc0) == 0x80);
+    o->last = utf8_get(p, &n);
+}
+
+#ifdef SHORTENER_STATS
 /*
- * Words or phrases together with their abbreviations.  It is assumed that
- * these phrases are common and in extreme cases can be omitted altogether
- * from the map display.  Given a full name of something we'll produce two
- * new strings: the abbreviated name, and the "stem" which skips all the
- * more common words and phrases.
- *
- * Note that the input is always assumed to be unabbreviated.  If there are
- * already abbreviations in the input, the "stem" output will include them,
- * while the idea is that it shouldn't.
- *
- * TODO: The arrays below mix languages together, we really really should
- * take the language code as a call argument and only apply processing
- * specific to that language.
+ * Statistics, only built with -DSHORTENER_STATS.  Every thread gets one of
+ * the STATS_SLOTS sets of counters, in the order they first shorten a name,
+ * so as long as there are no more threads than slots the counters are never
+ * shared and the atomic increments stay in the thread's own cache lines.
+ * The slots are summed up by shortener_stats().
  */
-static const wchar_t *abbrevs[] = {
-    /* Polish */
-    L"plac", L"pl.",
-    L"ulica", L"ul.",
-    L"aleja", L"al.",
-    L"generała", L"gen.",
-    L"księdza", L"ks.",
-    L"księży", L"ks.",
-    L"księcia", L"ks.",
-    L"księżnej", L"",
-    L"książąt", L"ks.",
-    L"króla", L"",
-    L"królowej", L"",
-    L"biskupa", L"bp",
-    L"arcybiskupa", L"abp",
-    L"kardynała", L"kard.",
-    L"doktora", L"dr",
-    L"inżyniera", L"inż.",
-    L"profesora", L"prof.",
-    L"marszałka", L"marsz.",
-    L"kapitana", L"kpt.",
-    L"porucznika", L"por.",
-    L"podporucznika", L"ppor.",
-    L"pułkownika", L"płk.", /* No period according to the dictionaries */
-    L"podpułkownika", L"ppłk.",
-    L"majora", L"maj.", /* No period according to the dictionaries */
-    L"hetmana", L"hetm.",
-    L"kanclerza", L"kanc.",
-    L"admirała", L"adm.",
-    L"kontradmirała", L"kadm.",
-    L"wiceadmirała", L"wadm.",
-    L"komandora", L"kmdr.", /* No period according to the dictionaries */
-    L"rotmistrza", L"rtm.",
-    L"sierżanta", L"sierż.",
-    L"kapelana", L"kpl.",
-    L"kanonika", L"",
-    L"ojca", L"",
-    L"prymasa", L""
-    L"prałata", L""
-    L"pilota", L"",
-    L"plutonowego", L"plut.",
-    L"imienia", L"im.",
-    L"numer", L"nr",
-    L"kościół", L"kościół",
-    L"szkoła podstawowa", L"SP",
-    L"liceum ogólnokształcące", L"LO",
-    L"liceum", L"LO",
-    L"zespół szkół zawodowych", L"ZSZ",
-    L"zespół szkół", L"ZS",
-    L"pasaż", L"pasaż",
-    L"skwer", L"skwer",
-    L"ścieżka", L"ścieżka",
-    L"trasa", L"trasa",
-    L"pod wezwaniem", L"pw.",
-    L"matki boskiej", L"MB",
-    L"najświętszej maryi panny", L"NMP",
-    L"najświętszej marii panny", L"NMP",
-    L"hrabiego", L"",
-    L"hrabiny", L"",
-    L"pułku piechoty", L"PP",
-    L"pułku lotnictwa myśliwskiego", L"PLM",
-    L"kanał", L"kan.",
-    L"góra", L"g.",
-    L"dworzec", L"dworzec",
-    L"stacja", L"stacja",
-    /* TODO: when skipping "nad" (or German "am") skip until end of string */
-    L"nad", L"n.",
-    L"główny", L"gł.",
-    L"główna", L"gł.", /* TODO: don't touch if the only word */
-    L"główne", L"gł.",
-    L"wschodni", L"wsch.",
-    L"wschodnia", L"wsch.", /* TODO: don't touch if the only word */
-    L"wschodnie", L"wsch.",
-    L"zachodni", L"zach.",
-    L"zachodnia", L"zach.", /* TODO: don't touch if the only word */
-    L"zachodnie", L"zach.",
-    L"pierwszy", L"I",
-    L"pierwsza", L"I",
-    L"pierwsze", L"I",
-    L"drugi", L"II",
-    L"druga", L"II",
-    L"drugie", L"II",
-    L"trzeci", L"III",
-    L"trzecia", L"III",
-    L"trzecie", L"III",
-    L"mazowiecki", L"maz.",
-    L"mazowiecka", L"maz.", /* TODO: don't touch if the only word */
-    L"mazowieckie", L"maz.",
-    L"wielkopolski", L"wlkp.",
-    L"wielkopolska", L"wlkp.", /* TODO: don't touch if the only word */
-    L"wielkopolskie", L"wlkp.",
-    L"śląski", L"śl.",
-    L"śląska", L"śl.",
-    L"śląskie", L"śl.",
-    L"pomorski", L"pom.",
-    L"pomorska", L"pom.", /* TODO: don't touch if the only word */
-    L"pomorskie", L"pom.",
-    L"górny", L"g.",
-    L"górna", L"g.", /* TODO: don't touch if the only word */
-    L"górne", L"g.",
-    L"dolny", L"d.",
-    L"dolna", L"d.", /* TODO: don't touch if the only word */
-    L"dolne", L"d.",
-    L"kolonia", L"kol.",
-    L"miasto stołeczne", L"m.st.",
-    L"miasta stołecznego", L"m.st.",
-    L"braci", L"braci",
-    L"sióstr", L"sióstr",
-    L"rodziny", L"",
-    L"pracownicze ogródki działkowe", L"POD",
-    L"robotnicze ogródki działkowe", L"ROD",
-    L"narodowy fundusz zdrowia", L"NFZ",
-    L"spółdzielnia mieszkaniowa", L"SM",
-    L"osiedle", L"os.",
-    L"i", L"i",
-    L"van", L"van", /* Beethovena */
-    /* TODO: phrases below this line can not be omitted from the shortest
-     * form, we need to account for this eventually.  Fortunately they usually
-     * come at the end of a name.  */
-    L"komisji edukacji narodowej", L"KEN",
-    L"polskiego czerwonego krzyża", L"PCK",
-    L"armii krajowej", L"AK",
-    L"armii ludowej", L"AL",
-    L"podziemnej organizacji wojskowej", L"POW",
-    L"tysiąclecia", L"1000-lecia",
-    L"trzydziestolecia", L"XXX-lecia",
-    L"dziesięciolecia", L"X-lecia",
-    L"zakład ubezpieczeń społecznych", L"ZUS",
-    L"urząd gminy", L"UG",
-    L"urząd miasta", L"UM",
-    L"gminny ośrodek sportu i rekreacji", L"GOSiR",
-    L"miejski ośrodek sportu i rekreacji", L"MOSiR",
-    L"ośrodek sportu i rekreacji", L"OSiR",
-    L"wojsk ochrony pogranicza", L"WOP",
-    L"jana iii sobieskiego", L"Sobieskiego",
-    L"jana pawła", L"JP",
-    L"urząd pocztowy", L"UP",
-    L"poczta", L"UP",
-    L"świętego", L"św.",
-    L"świętej", L"św.",
-    L"świętych", L"św.",
-    L"błogosławionego", L"bł.",
-    L"błogosławionej", L"bł.",
-    L"błogosławionych", L"bł.",
-    L"batalionu", L"baonu",
-    L"matki teresy z kalkuty", L"Matki Teresy",
-
-    /* English */
-    L"north", L"n",
-    L"east", L"e",
-    L"west", L"w",
-    L"south", L"s",
-    L"northeast", L"ne",
-    L"northwest", L"nw",
-    L"southeast", L"se",
-    L"southwest", L"sw",
-    L"street", L"st",
-    L"saint", L"st",
-    L"state route", L"SR",
-    L"state", L"st",
-    L"avenue", L"ave",
-    L"boulevard", L"blvd",
-    L"court", L"ct",
-    L"road", L"rd",
-    L"alley", L"aly",
-    L"crescent", L"cres",
-    L"creek", L"cr",
-    L"crest", L"crst",
-    L"drive", L"dr",
-    L"doctor", L"dr.",
-    L"junior", L"jr.",
-    L"'s", L"",
-    L"highway", L"hwy",
-    L"route", L"rt",
-    L"circle", L"cir",
-    L"expressway", L"expy",
-    L"loop", L"lp",
-    L"parkway", L"pkwy",
-    L"peak", L"peak",
-    L"pike", L"pike",
-    L"national forest service", L"NFS",
-    L"bureau of indian affairs", L"BIA",
-    L"bureau of land management", L"BLM",
-    L"national", L"nat",
-    L"railroad", L"RR",
-    L"right of way", L"RR",
-    L"building", L"bldg",
-    L"county", L"co",
-    L"trail", L"trail",
-    /* TODO: Some of these are tricky and probably should only be
-     * abbreviated when in post position, for example "Bridge Of The Gods"
-     * should really stay intact and just disappear when there's not enough
-     * space to render the full name.  So let's have a flag that tells us
-     * whether something is post-position only.  But post-position doesn't
-     * always mean at the end of the string (e.g. the Street in name=Fulton
-     * Street North is in post position but not at the end).  Perhaps like
-     * in expand.py, treating all the words from the left until a first
-     * non-abbrviatable substring is found, as pre-position, and from the
-     * right, as in post-position, would be good enough?  Or we could just
-     * blacklist "bridge of" as a phrase that only abbreviates to itself
-     * and is not discardable.  */
-    L"bridge", L"brdg",
-    L"crossing", L"xing",
-    L"pedestrian", L"ped",
-    /* TODO: phrases below this line can not be omitted from the shortest
-     * form, we need to account for this eventually.  */
-    L"martin luther king", L"MLK",
-    L"internal revenue service", L"IRS",
-    L"department", L"dept",
-    L"district of columbia", L"DC",
-    L"first", L"1st",
-    L"second", L"2nd",
-    L"third", L"3rd",
-    L"fourth", L"4th",
-    L"fifth", L"5th",
-    L"sixth", L"6th",
-    L"seventh", L"7th",
-    L"eighth", L"8th",
-    L"ninth", L"9th",
-    L"tenth", L"10th",
-
-    /* Spanish - Spain */
-    L"calle", L"c.", /* Or "c/", also "Ca" and "Cll" in Peru */
-    L"avenida", L"avda.", /* "Av." in Mexico, Peru */
-    L"plaza", L"pza.", /* Or "Pl." */
-    L"placita", L"placita",
-    L"cuesta", L"cuesta",
-    L"paseo", L"pº", /* Or "p.º" */
-    L"ronda", L"rda.",
-    L"autovía", L"autovía",
-    L"autopista", L"autopista",
-    L"víal", L"víal",
-    L"glorieta", L"gta.",
-    L"puerta", L"pta.",
-    L"carretera", L"ctra.", /* "Carr." in Mexico */
-    L"playa", L"playa",
-    L"polideportivo", L"polideportivo",
-    L"polígono industrial", L"pol. ind.",
-    L"urbanización", L"urbanización",
-    L"barrio", L"barrio", /* Sometimes "B."? */
-    L"parque", L"parque", /* Sometimes "P." or "Pque."? */
-    L"ciudad", L"ciudad", /* Sometimes "Cdad."? */
-    L"colonia", L"colonia", /* Sometimes "Col."? */
-    L"del", L"",
-    L"de", L"",
-    L"el", L"",
-    L"la", L"",
-    L"los", L"",
-    L"doctor", L"dr",
-    L"doctora", L"dra",
-    L"poeta", L"poeta",
-    L"cura", L"cura",
-    L"obispo", L"obispo",
-    L"licenciado", L"ldo.",
-    /* General - Gral. in Spain, Gen. in Peru */
-    /* TODO: phrases below this line can not be omitted from the shortest
-     * form, we need to account for this eventually.  */
-    L"instituto de educación secundaria", L"IES",
-    L"instituto educación secundaria", L"IES",
-    L"colegio de educación infantil y primaria", L"CEIP",
-    L"colegio educación infantil y primaria", L"CEIP",
-    L"colegio público de educación infantil y primaria", L"CEIP",
-    L"colegio público educación infantil y primaria", L"CEIP",
-    L"colegio público de educación primaria e infantil", L"CEIP",
-    L"colegio público educación primaria e infantil", L"CEIP",
-    L"buen retiro", L"retiro", /* May be a case for a tag in the data */
-    L"facultad", L"facd.",
-    L"departamento", L"dpto.",
-    L"santa", L"sta.",
-    L"santo", L"sto.",
-
-    /* Spanish - Peru - in addition to things that are above */
-    L"pasaje", L"pj.", /* Sometimes "Psje." */
-    L"jirón", L"jr.",
-    L"instituto de educación", L"IE",
-    L"instituto educación", L"IE",
-
-    /* German */
-    /* TODO: German needs special treatment because the sub-words, in
-     * a word formed by concatenation, can be abbreviated individually.  */
-    L"straße", L"str.",
-    L"strasse", L"str.",
-    L"weg", L"weg",
-    L"hauptbahnhof", L"hbf",
-
-    /* Russian & Ukrainian */
-    L"проспе́кт", L"пр.",
-    L"проспект", L"пр.",
-    L"проезд", L"пр-д",
-    L"улица", L"ул.",
-    L"вулиця", L"вул.",
-    L"бульвар", L"бул.",
-    L"майдан", L"майдан",
-    L"площа", L"пл.",
-    L"площадь", L"пл.",
-
-    /* Turkish */
-    L"cadde", L"cad.",
-    L"caddesi", L"cad.",
-    L"sokak", L"sok.",
-    L"sokağı", L"sok.",
-    L"bulvar", L"bul.",
-    L"bulvarı", L"bul.",
-    L"mahalle", L"mh.",
-    L"mahallesi", L"mh.",
+#define STATS_SLOTS	64
+
+struct stats_slot {
+    unsigned long calls, bytes, copied;
+    unsigned long latency[SHORTENER_LATENCY_BUCKETS];
+    unsigned long *entry_hits, *name_hits;	/* In the same allocation */
 };
+#endif
 
 /*
- * Given names in genitive (in many languages this is same as nominative)
- * which should be shortened or omitted from streets named after people.
+ * Everything needed to shorten names: the dictionary image described in
+ * dict.h, either the one built into the library or a file mapped by
+ * shortener_load(), and pointers to its tables.  Nothing in here is
+ * modified after the context is created, so one context can be used from
+ * any number of threads at the same time.  The per-call state lives on the
+ * stack and the output is written directly to the caller's buffers.
  */
-static const wchar_t *given_names[] = {
-    /* Polish */
-    L"Abrahama",
-    L"Achacego",
-    L"Adama",
-    L"Adelajdy",
-    L"Adolfa",
-    L"Adriana",
-    L"Ady",
-    L"Agaty",
-    L"Agnieszki",
-    L"Ahmeda",
-    L"Alberta",
-    L"Albina",
-    L"Aleksandra",
-    L"Aleksandry",
-    L"Alfreda",
-    L"Alfonsa",
-    L"Alicji",
-    L"Alojzego",
-    L"Amadeusza",
-    L"Ambrożego",
-    L"Anastazego",
-    L"Anatola",
-    L"Andrzeja",
-    L"Anety",
-    L"Angeli",
-    L"Anieli",
-    L"Anity",
-    L"Anny",
-    L"Antonia",
-    L"Antoniego",
-    L"Antoniny",
-    L"Apoloniusza",
-    L"Arkadiusza",
-    L"Arkadego",
-    L"Arona",
-    L"Artura",
-    L"Azalii",
-    L"Augusta",
-    L"Aureliusza",
-    L"Balbiny",
-    L"Baltazara",
-    L"Barbary",
-    L"Barnaby",
-    L"Bartłomieja",
-    L"Bartosza",
-    L"Bazylego",
-    L"Beaty",
-    L"Benedykta",
-    L"Beniamina",
-    L"Blaise'a",
-    L"Błażeja",
-    L"Bogdana",
-    L"Bogny",
-    L"Bogumiła",
-    L"Bogumiły",
-    L"Bolesława",
-    L"Bonifacego",
-    L"Borysława",
-    L"Bożeny",
-    L"Bronisława",
-    L"Bruno",
-    L"Brunona",
-    L"Brygidy",
-    L"Cecylii",
-    L"Celiny",
-    L"Cezarego",
-    L"Christiana",
-    L"Cypriana",
-    L"Cyryla",
-    L"Czesława",
-    L"Czesławy",
-    L"Dagmary",
-    L"Damiana",
-    L"Daniela",
-    L"Danuty",
-    L"Darii",
-    L"Dariusza",
-    L"Dawida",
-    L"Dezyderego",
-    L"Dionizego",
-    L"Dominika",
-    L"Dominiki",
-    L"Donalda",
-    L"Doroty",
-    L"Dymitra",
-    L"Edmunda",
-    L"Edwarda",
-    L"Edwina",
-    L"Edyty",
-    L"Elizy",
-    L"Elżbiety",
-    L"Emila",
-    L"Emiliana",
-    L"Emiliusza",
-    L"Emilii",
-    L"Eryka",
-    L"Eugeniusza",
-    L"Eustachego",
-    L"Euzebii",
-    L"Eweliny",
-    L"Ewy",
-    L"Fabiana",
-    L"Faustyna",
-    L"Feliksa",
-    L"Felicjana",
-    L"Ferdinanda",
-    L"Ferdynanda",
-    L"Ferreriusza",
-    L"Filipa",
-    L"Fiodora",
-    L"Floriana",
-    L"Francisa",
-    L"Franciszka",
-    L"Fryderyka",
-    L"Gabriela",
-    L"Gabrieli",
-    L"Gawła",
-    L"Genowefy",
-    L"Geralda",
-    L"Gerwazego",
-    L"Giuseppe",
-    L"Grażyny",
-    L"Grety",
-    L"Grzegorza",
-    L"Guglielmo",
-    L"Gustawa",
-    L"Haliny",
-    L"Hanki",
-    L"Hanny",
-    L"Hansa",
-    L"Hektora",
-    L"Heleny",
-    L"Helmuta",
-    L"Henryka",
-    L"Herakliusza",
-    L"Herberta",
-    L"Hermenegildy",
-    L"Hieronima",
-    L"Hilarego",
-    L"Hipolita",
-    L"Honorata",
-    L"Honoraty",
-    L"Huberta",
-    L"Hugo",
-    L"Hugona",
-    L"Icchaka",
-    L"Ignacego",
-    L"Igora",
-    L"Ildefonsa",
-    L"Indiry",
-    L"Ireneusza",
-    L"Ireny",
-    L"Iwo",
-    L"Iwony",
-    L"Izabeli",
-    L"Izydora",
-    L"Jacka",
-    L"Jadwigi",
-    L"Jagny",
-    L"Jagody",
-    L"Jakuba",
-    L"Jana",
-    L"Janiny",
-    L"Janka",
-    L"Janusza",
-    L"Jarosława",
-    L"Jaśminy",
-    L"Jawaharlala",
-    L"Jeremiasza",
-    L"Jeremiego",
-    L"Jerzego",
-    L"Jędrzeja",
-    L"Joachima",
-    L"Johana",
-    L"Johannesa",
-    L"Johna",
-    L"Jonasza",
-    L"Jolanty",
-    L"Józefa",
-    L"Józefata",
-    L"Józefiny",
-    L"Juliana",
-    L"Julii",
-    L"Juliusza",
-    L"Juranda",
-    L"Jurija",
-    L"Justyny",
-    L"Kacpra",
-    L"Kajetana",
-    L"Kaji",
-    L"Kamila",
-    L"Kalasantego",
-    L"Karola",
-    L"Karoliny",
-    L"Katarzyny",
-    L"Kazimiery",
-    L"Kazimierza",
-    L"Kingi",
-    L"Klaudii",
-    L"Klaudiusza",
-    L"Klemensa",
-    L"Klementyny",
-    L"Kleofasa",
-    L"Kolumby",
-    L"Konrada",
-    L"Konstantego",
-    L"Kornela",
-    L"Krystiana",
-    L"Krystyny",
-    L"Krzysztofa",
-    L"Ksawerego",
-    L"Lajosa",
-    L"Lecha",
-    L"Lejba",
-    L"Leny",
-    L"Leokadii",
-    L"Leona",
-    L"Leonida",
-    L"Leopolda",
-    L"Leszka",
-    L"Lidii",
-    L"Longina",
-    L"Louisa",
-    L"Lucjana",
-    L"Lucyny",
-    L"Ludwika",
-    L"Ludwiki",
-    L"Ludomiły",
-    L"Ludomiła",
-    L"Ludomira",
-    L"Łazarza",
-    L"Łucji",
-    L"Łukasza",
-    L"Macieja",
-    L"Magdaleny",
-    L"Mahatmy",
-    L"Maji",
-    L"Maksymiliana",
-    L"Malwiny",
-    L"Małgorzaty",
-    L"Mamerta",
-    L"Marcelego",
-    L"Marceliny",
-    L"Marcina",
-    L"Marii",
-    L"Mariana",
-    L"Marianny",
-    L"Marioli",
-    L"Mariusza",
-    L"Marleny",
-    L"Marka",
-    L"Marty",
-    L"Martyny",
-    L"Maryli",
-    L"Marzeny",
-    L"Mateusza",
-    L"Matyldy",
-    L"Maurycego",
-    L"Melanii",
-    L"Melchiora",
-    L"Michaiła",
-    L"Michała",
-    L"Michaliny",
-    L"Mieczysława",
-    L"Mieczysławy",
-    L"Mikołaja",
-    L"Mileny",
-    L"Miłosza",
-    L"Mirona",
-    L"Mirosława",
-    L"Mirosławy",
-    L"Moniki",
-    L"Mordechaja",
-    L"Natalii",
-    L"Nepomucena",
-    L"Niccolo",
-    L"Nikodema",
-    L"Niny",
-    L"Norberta",
-    L"Ofelii",
-    L"Olafa",
-    L"Oleńki",
-    L"Olgi",
-    L"Olgierda",
-    L"Oliwii",
-    L"Onufrego",
-    L"Oskara",
-    L"Otylii",
-    L"Paavo",
-    L"Pabla",
-    L"Pablo",
-    L"Pafnucego",
-    L"Pankracego",
-    L"Paschalisa",
-    L"Patrycji",
-    L"Patryka",
-    L"Pauliny",
-    L"Pawła",
-    L"Piotra",
-    L"Piusa",
-    L"Poli",
-    L"Porfirego",
-    L"Prota",
-    L"Protazego",
-    L"Przemysława",
-    L"Rabindrannatha",
-    L"Radosława",
-    L"Rafała",
-    L"Rajmunda",
-    L"Remigiusza",
-    L"Renaty",
-    L"Roberta",
-    L"Rocha",
-    L"Rolanda",
-    L"Romana",
-    L"Romualda",
-    L"Rosy", /* TODO: set a flag */
-    L"Rudolfa",
-    L"Ryszarda",
-    L"Sabiny",
-    L"Salvadora",
-    L"Samuela",
-    L"Sandora",
-    L"Sandry",
-    L"Sary",
-    L"Saszy",
-    L"Saturnina",
-    L"Sebastiana",
-    L"Sergiusza",
-    L"Seweryna",
-    L"Siergieja",
-    L"Sławoja",
-    L"Sławomira",
-    L"Sławomiry",
-    L"Sobiesława",
-    L"Stanisława",
-    L"Stefana",
-    L"Stefanii",
-    L"Sue",
-    L"Sylwestra",
-    L"Sylwii",
-    L"Szczepana",
-    L"Szymona",
-    L"Tadeusza",
-    L"Tamary",
-    L"Teodora",
-    L"Teofila",
-    L"Teresy",
-    L"Thomasa",
-    L"Tobiasza",
-    L"Tomasza",
-    L"Tomcia",
-    L"Tymona",
-    L"Tymoteusza",
-    L"Tytusa",
-    L"Urszuli",
-    L"Vincenta",
-    L"Wacława",
-    L"Waldemara",
-    L"Walentego",
-    L"Walentyny",
-    L"Walerego",
-    L"Waleriana",
-    L"Walerii",
-    L"Wandy",
-    L"Wawrzyńca",
-    L"Wenantego",
-    L"Weroniki",
-    L"Wespazjana",
-    L"Wiesława",
-    L"Wiesławy",
-    L"Wiktora",
-    L"Wiktorii",
-    L"Wilhelma",
-    L"Wincentego",
-    L"Wincentyny",
-    L"Wioletty",
-    L"Wisławy",
-    L"Wita",
-    L"Witolda",
-    L"Wlastimila",
-    L"Władysława",
-    L"Włodzimierza",
-    L"Wojciecha",
-    L"Wolfganga",
-    L"Woodrowa",
-    L"Xawerego",
-    L"Zachariasza",
-    L"Zbigniewa",
-    L"Zbyszka",
-    L"Zdzisława",
-    L"Zdzisławy",
-    L"Zenobii",
-    L"Zenobiusza",
-    L"Zenona",
-    L"Zofii",
-    L"Zuzanny",
-    L"Zygfryda",
-    L"Zygfrydy",
-    L"Zygmunta",
-    L"Żanety",
+struct shortener {
+    const char *strings;
+    const struct dict_entry *entries;
+    const struct dict_node *nodes;
+    const struct dict_lang *langs;
+    const struct dict_name *names;
+    const uint16_t *disp;
+    const struct dict_node *all_tries[DICT_SCRIPTS];	/* Or NULL */
+    int n_entries, n_langs, n_names, n_buckets;
+    uint32_t name_scripts;
+
+    void *map;			/* Set when loaded from a file */
+    size_t map_size;
+    unsigned long generation;	/* Set by shortener_live_swap() */
+
+#ifdef SHORTENER_STATS
+    struct stats_slot *stats[STATS_SLOTS];
+#endif
 };
 
-static const wchar_t *digraphs[] = {
-    /* Polish - only those that are in use in given_names */
-    L"Ch",
-    L"Cz",
-    L"Sz",
+#ifdef SHORTENER_STATS
+static int stats_next_slot;
+static _Thread_local int stats_slot_id = -1;
+
+static inline struct stats_slot *stats_slot(const struct shortener *sh)
+{
+    if (stats_slot_id < 0)
+	stats_slot_id = __atomic_fetch_add(&stats_next_slot, 1,
+			__ATOMIC_RELAXED) % STATS_SLOTS;
+
+    return sh->stats[stats_slot_id];
+}
+
+#define STAT_ADD(sh, counter, n) \
+	__atomic_fetch_add(&stats_slot(sh)->counter, n, __ATOMIC_RELAXED)
+
+static inline uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* One call of @len bytes that started at @start, in the log2 bucket */
+static void stats_call(const struct shortener *sh, uint64_t start, size_t len)
+{
+    uint64_t ns = stats_now() - start;
+    int bucket = 63 - __builtin_clzll(ns | 1);
+
+    if (bucket >= SHORTENER_LATENCY_BUCKETS)
+	bucket = SHORTENER_LATENCY_BUCKETS - 1;
+
+    STAT_ADD(sh, calls, 1);
+    STAT_ADD(sh, bytes, len);
+    STAT_ADD(sh, latency[bucket], 1);
+}
+
+#define STATS_BEGIN()		uint64_t stats_start = stats_now()
+#define STATS_END(sh, len)	stats_call(sh, stats_start, len)
+#else
+#define STAT_ADD(sh, counter, n)	do {} while (0)
+#define STATS_BEGIN()
+#define STATS_END(sh, len)
+#endif
+
+/*
+ * The dictionaries to search for a single name, the tries by the script
+ * of the words they can match.
+ */
+struct dict_sel {
+    const struct shortener *sh;
+    const struct dict_node *tries[DICT_SCRIPTS][DICT_MAX_LANGS];
+    const struct dict_node *suffixes[DICT_MAX_LANGS];
+    int n_tries[DICT_SCRIPTS], n_suffixes;
+    uint32_t langs;		/* Mask of the selected languages */
 };
 
-static locale_t l;
+/* Find the child of @node for character @c, or NULL */
+static inline const struct dict_node *trie_child(
+		const struct dict_node *nodes, const struct dict_node *node,
+		wchar_t c)
+{
+    int lo = node->children, hi = lo + node->n_children, mid;
 
-void utf_init(void)
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (nodes[mid].c < c)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo == node->children + node->n_children || nodes[lo].c != c)
+	return NULL;
+
+    return nodes + lo;
+}
+
+/*
+ * Find the phrase matching full words at the start of @word, which ends
+ * at @end, in the trie starting at @root.  Returns the index of the entry
+ * and the phrase's length in bytes in @len, or @best if nothing with a
+ * lower index than @best matched.
+ */
+static int trie_lookup(const struct dict_node *nodes,
+		const struct dict_node *root,
+		const char *word, const char *end, int *len, int best)
+{
+    const struct dict_node *node = root;
+    const char *p;
+    wchar_t c;
+    int n;
+
+    for (p = word; ; p += n) {
+	c = utf8_get_n(p, end, &n);
+
+	/* Check that we matched a full word */
+	if (node->match >= 0 && (best < 0 || node->match < best) &&
+		!uc_isalnum(c)) {
+	    best = node->match;
+	    *len = p - word;
+	}
+
+	if (!c)
+	    break;
+
+	node = trie_child(nodes, node, uc_tolower(c));
+	if (!node)
+	    break;
+    }
+
+    return best;
+}
+
+/*
+ * Same as above but in all of the selected languages, or -1.  @script is
+ * the dict_script() of the word's first character.
+ */
+static int abbrev_lookup(const struct dict_sel *sel, int script,
+		const char *word, const char *end, int *len)
+{
+    int i, best = -1;
+
+    for (i = 0; i < sel->n_tries[script]; i ++)
+	best = trie_lookup(sel->sh->nodes, sel->tries[script][i],
+			word, end, len, best);
+
+    return best;
+}
+
+/*
+ * Find the longest compound head ending the word from @word to @wend in
+ * the suffix trie starting at @root, walking backwards from the end.  At
+ * least one character of the word must be left before the head.  Returns
+ * the index of the entry and the head's length in bytes in @len, or @best
+ * if nothing longer than @len, or as long with a lower index, matched.
+ */
+static int suffix_lookup(const struct dict_node *nodes,
+		const struct dict_node *root,
+		const char *word, const char *wend, int *len, int best)
+{
+    const struct dict_node *node = root;
+    const char *p, *q;
+    wchar_t c;
+    int n;
+
+    for (p = wend; p > word; p = q) {
+	for (q = p - 1; q > word && (*q & 0xc0) == 0x80; q --);
+
+	/* Give up on anything that doesn't decode back to the same bytes */
+	c = utf8_get_n(q, wend, &n);
+	if (q == word || q + n != p)
+	    break;
+
+	node = trie_child(nodes, node, uc_tolower(c));
+	if (!node)
+	    break;
+
+	if (node->match >= 0 && (wend - q > *len ||
+			(wend - q == *len && node->match < best))) {
+	    best = node->match;
+	    *len = wend - q;
+	}
+    }
+
+    return best;
+}
+
+/* Same as above but in all of the selected languages, or -1 */
+static int compound_lookup(const struct dict_sel *sel,
+		const char *word, const char *wend, int *len)
+{
+    int i, best = -1;
+
+    *len = 0;
+    for (i = 0; i < sel->n_suffixes; i ++)
+	best = suffix_lookup(sel->sh->nodes, sel->suffixes[i],
+			word, wend, len, best);
+
+    return best;
+}
+
+/*
+ * Find the given name in one of the selected languages matching a full
+ * word at the start of @word, which ends at @end, in the perfect hash
+ * built by mkdict.  Given names may contain characters like apostrophes so
+ * every point in the word after which a given name could end is tried, and
+ * the hash of each prefix is updated along the way.  Returns the slot and
+ * the name's length in bytes in @len, or -1 if nothing matched.
+ */
+static int given_name_lookup(const struct dict_sel *sel,
+		const char *word, const char *end, int *len)
 {
-    l = newlocale(LC_ALL_MASK, "C.UTF-8", NULL);
-#ifdef linux
-    uselocale(l);
+    const struct shortener *sh = sel->sh;
+    const struct dict_name *name;
+    const char *p, *q;
+    uint64_t h = PHASH_INIT;
+    wchar_t c;
+    const char *k;
+    int best = -1, count = 0, slot, n, m, i;
+
+    if (!sh->n_names)
+	return -1;
+
+    for (p = word; (c = utf8_get_n(p, end, &n)) && !uc_isspace(c) &&
+	    count < 64; ) {
+	h = phash_step(h, uc_tolower(c));
+	p += n;
+	count ++;
+
+	/* Check that we matched a full word */
+	c = utf8_get_n(p, end, &n);
+	if (uc_isalnum(c))
+	    continue;
+
+	/*
+	 * If this is the final part of the name, and it matches a
+	 * given name then that's most likely somebody's surname which
+	 * happens to also be a possibble given name.  In that case
+	 * do not abbreviate or omit it.
+	 */
+	if (!c)
+	    break;
+
+	slot = phash_slot(h, sh->disp[phash_bucket(h, sh->n_buckets)],
+			sh->n_names);
+	name = &sh->names[slot];
+	if (name->len != count || !(name->langs & sel->langs) ||
+			(best >= 0 && name->index >= sh->names[best].index))
+	    continue;
+
+	for (q = word, k = sh->strings + name->key, i = 0;
+			i < name->len; i ++) {
+	    c = utf8_get(k, &m);
+	    if (uc_tolower(utf8_get(q, &n)) != c)
+		break;
+	    q += n;
+	    k += m;
+	}
+	if (i == name->len) {
+	    best = slot;
+	    *len = p - word;
+	}
+    }
+
+    return best;
+}
+
+/*
+ * Most names in the Latin-script languages are pure ASCII.  For those the
+ * lower case form and which bytes are alphanumeric or whitespace are found
+ * for the whole name up front, 16 bytes at a time with SSE2 where
+ * available, and the scan and the lookups then read these instead of
+ * decoding and classifying every character.  The ASCII classes are the
+ * same as in the Unicode tables so the results are exactly the same.
+ * Longer names and anything with a NUL byte take the general path.
+ */
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
+
+#define ASCII_MAX	256
+
+struct ascii_map {
+    const char *start;
+    size_t len;
+    char lower[ASCII_MAX + 16];
+    uint16_t alnum[ASCII_MAX / 16 + 1];	/* Bit maps */
+    uint16_t space[ASCII_MAX / 16 + 1];
+};
+
+static inline int ascii_bit(const uint16_t *map, size_t i)
+{
+    return (map[i >> 4] >> (i & 15)) & 1;
+}
+
+/* Fill in @am for @name if it's ASCII, returns 0 if not */
+static int ascii_scan(const char *name, size_t len, struct ascii_map *am)
+{
+    size_t i;
+
+    if (len > ASCII_MAX)
+	return 0;
+
+    am->start = name;
+    am->len = len;
+
+#ifdef __SSE2__
+    for (i = 0; i < len; i += 16) {
+	__m128i x, up, lower, alpha, digit, space;
+	unsigned int valid = 0xffff;
+	char tail[16];
+
+	if (len - i >= 16)
+	    x = _mm_loadu_si128((const __m128i *) (name + i));
+	else {
+	    /* Don't read past the end */
+	    memset(tail, 0, sizeof(tail));
+	    memcpy(tail, name + i, len - i);
+	    x = _mm_loadu_si128((const __m128i *) tail);
+	    valid = (1 << (len - i)) - 1;
+	}
+
+	/* High bit set or NUL */
+	if ((_mm_movemask_epi8(x) |
+		_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128()))) &
+		valid)
+	    return 0;
+
+	up = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+			_mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+	lower = _mm_or_si128(x, _mm_and_si128(up, _mm_set1_epi8(0x20)));
+	_mm_storeu_si128((__m128i *) (am->lower + i), lower);
+
+	alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+			_mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+	digit = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)),
+			_mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+	space = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+			_mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('\t' - 1)),
+				_mm_cmplt_epi8(x, _mm_set1_epi8('\r' + 1))));
+	am->alnum[i >> 4] = _mm_movemask_epi8(_mm_or_si128(alpha, digit)) &
+		valid;
+	am->space[i >> 4] = _mm_movemask_epi8(space) & valid;
+    }
+#else
+    for (i = 0; i < len; i ++) {
+	unsigned char c = name[i];
+
+	if (!(i & 15))
+	    am->alnum[i >> 4] = am->space[i >> 4] = 0;
+
+	if (!c || c >= 0x80)
+	    return 0;
+
+	am->lower[i] = c >= 'A' && c <= 'Z' ? c + 0x20 : c;
+	if ((c >= '0' && c <= '9') || (am->lower[i] >= 'a' &&
+				am->lower[i] <= 'z'))
+	    am->alnum[i >> 4] |= 1 << (i & 15);
+	if (c == ' ' || (c >= '\t' && c <= '\r'))
+	    am->space[i >> 4] |= 1 << (i & 15);
+    }
+    i = (len + 15) & ~15;
+#endif
+
+    /* Nothing is set at the end */
+    am->alnum[i >> 4] = am->space[i >> 4] = 0;
+
+    return 1;
+}
+
+/* Same as trie_lookup() for the word at byte @pos of an ASCII name */
+static int trie_lookup_ascii(const struct dict_node *nodes,
+		const struct dict_node *root, const struct ascii_map *am,
+		size_t pos, int *len, int best)
+{
+    const struct dict_node *node = root;
+    size_t i;
+
+    for (i = pos; ; i ++) {
+	/* Check that we matched a full word */
+	if (node->match >= 0 && (best < 0 || node->match < best) &&
+		!ascii_bit(am->alnum, i)) {
+	    best = node->match;
+	    *len = i - pos;
+	}
+
+	if (i == am->len)
+	    break;
+
+	node = trie_child(nodes, node, (unsigned char) am->lower[i]);
+	if (!node)
+	    break;
+    }
+
+    return best;
+}
+
+static int abbrev_lookup_ascii(const struct dict_sel *sel,
+		const struct ascii_map *am, size_t pos, int *len)
+{
+    int i, best = -1;
+
+    for (i = 0; i < sel->n_tries[DICT_SCRIPT_LATIN]; i ++)
+	best = trie_lookup_ascii(sel->sh->nodes,
+			sel->tries[DICT_SCRIPT_LATIN][i], am, pos, len, best);
+
+    return best;
+}
+
+/* Same as given_name_lookup() for the word at byte @pos of an ASCII name */
+static int given_name_lookup_ascii(const struct dict_sel *sel,
+		const struct ascii_map *am, size_t pos, int *len)
+{
+    const struct shortener *sh = sel->sh;
+    const struct dict_name *name;
+    uint64_t h = PHASH_INIT;
+    int best = -1, count = 0, slot;
+    size_t i;
+
+    if (!sh->n_names)
+	return -1;
+
+    for (i = pos; i < am->len && !ascii_bit(am->space, i) && count < 64; ) {
+	h = phash_step(h, (unsigned char) am->lower[i]);
+	i ++;
+	count ++;
+
+	/* Full words only, and not the final part of the name */
+	if (ascii_bit(am->alnum, i))
+	    continue;
+	if (i == am->len)
+	    break;
+
+	slot = phash_slot(h, sh->disp[phash_bucket(h, sh->n_buckets)],
+			sh->n_names);
+	name = &sh->names[slot];
+	if (name->len != count || !(name->langs & sel->langs) ||
+			(best >= 0 && name->index >= sh->names[best].index))
+	    continue;
+
+	/* An ASCII key of this many characters has as many bytes */
+	if (!strncmp(sh->strings + name->key, am->lower + pos, count)) {
+	    best = slot;
+	    *len = count;
+	}
+    }
+
+    return best;
+}
+
+/* Same as suffix_lookup() for the word from @pos to @wend of an ASCII name */
+static int suffix_lookup_ascii(const struct dict_node *nodes,
+		const struct dict_node *root, const struct ascii_map *am,
+		size_t pos, size_t wend, int *len, int best)
+{
+    const struct dict_node *node = root;
+    size_t i;
+
+    for (i = wend; i > pos + 1; ) {
+	node = trie_child(nodes, node, (unsigned char) am->lower[-- i]);
+	if (!node)
+	    break;
+
+	if (node->match >= 0 && ((int) (wend - i) > *len ||
+			((int) (wend - i) == *len && node->match < best))) {
+	    best = node->match;
+	    *len = wend - i;
+	}
+    }
+
+    return best;
+}
+
+static int compound_lookup_ascii(const struct dict_sel *sel,
+		const struct ascii_map *am, size_t pos, size_t wend, int *len)
+{
+    int i, best = -1;
+
+    *len = 0;
+    for (i = 0; i < sel->n_suffixes; i ++)
+	best = suffix_lookup_ascii(sel->sh->nodes, sel->suffixes[i],
+			am, pos, wend, len, best);
+
+    return best;
+}
+
+#define TABLE_OK(offset, n, type) \
+    ((offset) % 4 == 0 && (offset) <= size && \
+     (n) <= (size - (offset)) / sizeof(type))
+#define TRIE_OK(hdr, root) \
+    ((root) == DICT_NO_TRIE || (root) < (hdr)->n_nodes)
+
+/*
+ * Check that the image at @image, @size bytes long, is a dictionary built
+ * by a compatible mkdict and that every offset and index in it is within
+ * bounds, so that the lookups never need to check them.  The image may
+ * come from any file so nothing can be assumed.
+ */
+static int dict_check(const void *image, size_t size)
+{
+    const struct dict_header *hdr = image;
+    const unsigned char *base = image;
+    const struct dict_entry *entry;
+    const struct dict_node *node;
+    const struct dict_lang *lang;
+    const struct dict_name *name;
+    uint32_t i, j;
+
+    if ((uintptr_t) image % 8 || size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, DICT_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != DICT_VERSION ||
+	    hdr->byte_order != DICT_BYTE_ORDER || hdr->size > size)
+	return -1;
+    size = hdr->size;
+
+    if (!TABLE_OK(hdr->strings, hdr->strings_size, char) ||
+	    !TABLE_OK(hdr->entries, hdr->n_entries, *entry) ||
+	    !TABLE_OK(hdr->nodes, hdr->n_nodes, *node) ||
+	    !TABLE_OK(hdr->langs, hdr->n_langs, *lang) ||
+	    !TABLE_OK(hdr->names, hdr->n_names, *name) ||
+	    !TABLE_OK(hdr->disp, hdr->n_buckets, uint16_t))
+	return -1;
+
+    /* The last string must be terminated for the others to be */
+    if (!hdr->strings_size || base[hdr->strings + hdr->strings_size - 1])
+	return -1;
+
+    entry = (const void *) (base + hdr->entries);
+    for (i = 0; i < hdr->n_entries; i ++, entry ++)
+	if (entry->phrase >= hdr->strings_size ||
+		entry->abbrev >= hdr->strings_size ||
+		entry->abbrev_len >= hdr->strings_size - entry->abbrev)
+	    return -1;
+
+    node = (const void *) (base + hdr->nodes);
+    for (i = 0; i < hdr->n_nodes; i ++, node ++)
+	if (node->children > hdr->n_nodes ||
+		node->n_children > hdr->n_nodes - node->children ||
+		node->match < -1 || (node->match >= 0 &&
+			(uint32_t) node->match >= hdr->n_entries))
+	    return -1;
+
+    if (hdr->n_langs > DICT_MAX_LANGS)
+	return -1;
+    for (j = 0; j < DICT_SCRIPTS; j ++)
+	if (!TRIE_OK(hdr, hdr->all_tries[j]))
+	    return -1;
+
+    lang = (const void *) (base + hdr->langs);
+    for (i = 0; i < hdr->n_langs; i ++, lang ++) {
+	if (lang->code[sizeof(lang->code) - 1] ||
+		!TRIE_OK(hdr, lang->suffixes))
+	    return -1;
+	for (j = 0; j < DICT_SCRIPTS; j ++)
+	    if (!TRIE_OK(hdr, lang->tries[j]))
+		return -1;
+    }
+
+    if (!hdr->n_names != !hdr->n_buckets)
+	return -1;
+
+    name = (const void *) (base + hdr->names);
+    for (i = 0; i < hdr->n_names; i ++, name ++)
+	if (name->key >= hdr->strings_size ||
+		name->initial >= hdr->strings_size)
+	    return -1;
+
+    return 0;
+}
+
+#ifdef SHORTENER_STATS
+/*
+ * Each slot is allocated on its own cache lines, together with its per
+ * entry and per given name hit counters.
+ */
+static int stats_new(struct shortener *sh)
+{
+    size_t size = sizeof(struct stats_slot) +
+	    (sh->n_entries + sh->n_names) * sizeof(unsigned long);
+    int i;
+
+    size = (size + 63) & ~(size_t) 63;
+    for (i = 0; i < STATS_SLOTS; i ++) {
+	sh->stats[i] = aligned_alloc(64, size);
+	if (!sh->stats[i])
+	    return -1;
+
+	memset(sh->stats[i], 0, size);
+	sh->stats[i]->entry_hits = (unsigned long *) (sh->stats[i] + 1);
+	sh->stats[i]->name_hits = sh->stats[i]->entry_hits + sh->n_entries;
+    }
+
+    return 0;
+}
+#endif
+
+struct shortener *shortener_new_image(const void *image, size_t size)
+{
+    const struct dict_header *hdr = image;
+    const unsigned char *base = image;
+    struct shortener *sh;
+    int i;
+
+    if (dict_check(image, size))
+	return NULL;
+
+    sh = calloc(1, sizeof(*sh));
+    if (!sh)
+	return NULL;
+
+    sh->strings = (const char *) base + hdr->strings;
+    sh->entries = (const void *) (base + hdr->entries);
+    sh->nodes = (const void *) (base + hdr->nodes);
+    sh->langs = (const void *) (base + hdr->langs);
+    sh->names = (const void *) (base + hdr->names);
+    sh->disp = (const void *) (base + hdr->disp);
+    for (i = 0; i < DICT_SCRIPTS; i ++)
+	if (hdr->all_tries[i] != DICT_NO_TRIE)
+	    sh->all_tries[i] = sh->nodes + hdr->all_tries[i];
+    sh->name_scripts = hdr->name_scripts;
+    sh->n_entries = hdr->n_entries;
+    sh->n_langs = hdr->n_langs;
+    sh->n_names = hdr->n_names;
+    sh->n_buckets = hdr->n_buckets;
+
+#ifdef SHORTENER_STATS
+    if (stats_new(sh)) {
+	shortener_free(sh);
+	return NULL;
+    }
+#endif
+
+    return sh;
+}
+
+struct shortener *shortener_new(void)
+{
+    return shortener_new_image(dict_builtin, dict_builtin_size);
+}
+
+/*
+ * The file is mapped shared and read-only so that every process using the
+ * same dictionary shares the pages.  It must not be modified in place
+ * while in use, a new version should be renamed over it instead.
+ */
+struct shortener *shortener_load(const char *path)
+{
+    struct shortener *sh;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return NULL;
+
+    if (fstat(fd, &st) < 0 || !st.st_size) {
+	close(fd);
+	return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return NULL;
+
+    sh = shortener_new_image(map, st.st_size);
+    if (!sh) {
+	munmap(map, st.st_size);
+	return NULL;
+    }
+
+    sh->map = map;
+    sh->map_size = st.st_size;
+    return sh;
+}
+
+void shortener_free(struct shortener *sh)
+{
+#ifdef SHORTENER_STATS
+    int i;
+#endif
+
+    if (!sh)
+	return;
+
+    if (sh->map)
+	munmap(sh->map, sh->map_size);
+#ifdef SHORTENER_STATS
+    for (i = 0; i < STATS_SLOTS; i ++)
+	free(sh->stats[i]);
+#endif
+    free(sh);
+}
+
+/*
+ * Parse a list of language codes as found in OSM tags, e.g. "pl" or
+ * "ru;uk", into the set of dictionaries to use.  Region subtags ("es-PE")
+ * are ignored.  No list at all means all the dictionaries but none of the
+ * compound heads, which only make sense in their own languages.
+ */
+static void dict_select(const struct shortener *sh, const char *langs,
+		struct dict_sel *sel)
+{
+    int i, j, len, code_len;
+
+    sel->sh = sh;
+    sel->n_suffixes = 0;
+    sel->langs = 0;
+
+    if (!langs || !*langs) {
+	for (j = 0; j < DICT_SCRIPTS; j ++) {
+	    sel->tries[j][0] = sh->all_tries[j];
+	    sel->n_tries[j] = !!sh->all_tries[j];
+	}
+	sel->langs = ~0u;
+	return;
+    }
+
+    for (j = 0; j < DICT_SCRIPTS; j ++)
+	sel->n_tries[j] = 0;
+
+    for (; *langs; langs += len) {
+	langs += strspn(langs, ";, ");
+	len = strcspn(langs, ";, ");
+	code_len = strcspn(langs, "-_;, ");
+
+	for (i = 0; i < sh->n_langs; i ++)
+	    if (!strncasecmp(sh->langs[i].code, langs, code_len) &&
+		    !sh->langs[i].code[code_len])
+		break;
+
+	/* Skip unknown languages and duplicates */
+	if (i == sh->n_langs || (sel->langs & (1u << i)))
+	    continue;
+
+	sel->langs |= 1u << i;
+	for (j = 0; j < DICT_SCRIPTS; j ++)
+	    if (sh->langs[i].tries[j] != DICT_NO_TRIE)
+		sel->tries[j][sel->n_tries[j] ++] =
+			sh->nodes + sh->langs[i].tries[j];
+	if (sh->langs[i].suffixes != DICT_NO_TRIE)
+	    sel->suffixes[sel->n_suffixes ++] =
+		    sh->nodes + sh->langs[i].suffixes;
+    }
+}
+
+/*
+ * Contexts replaceable while in use.  A reader counts itself in one of the
+ * two counters of its slot, the one of the current phase, before loading
+ * @current, and uncounts itself when done, so readers never wait.  Threads
+ * are spread over the slots like for the statistics so that they rarely
+ * share a cache line, though sharing one is still correct.  A swap
+ * publishes the new context, then waits for the counters of the other
+ * phase and, after flipping the phase, of the old one, to be seen at zero.
+ * A reader counted after that loaded @current after the swap, so by then
+ * nobody can be using the old context any more.  Swaps only wait for the
+ * calls already in flight since new ones go to the other counter.
+ */
+#define LIVE_SLOTS	64
+
+struct live_slot {
+    unsigned long readers[2];
+    char pad[64 - 2 * sizeof(unsigned long)];
+};
+
+struct shortener_live {
+    struct shortener *current;
+    unsigned int phase;
+    int swapping;
+    struct live_slot *slots;
+};
+
+static int live_next_slot;
+static _Thread_local int live_slot_id = -1;
+
+struct shortener_live *shortener_live_new(struct shortener *sh)
+{
+    struct shortener_live *live;
+
+    if (!sh)
+	return NULL;
+
+    live = calloc(1, sizeof(*live));
+    if (live)
+	live->slots = aligned_alloc(64, LIVE_SLOTS * sizeof(*live->slots));
+    if (!live || !live->slots) {
+	free(live);
+	shortener_free(sh);
+	return NULL;
+    }
+
+    memset(live->slots, 0, LIVE_SLOTS * sizeof(*live->slots));
+    live->current = sh;
+    return live;
+}
+
+void shortener_live_free(struct shortener_live *live)
+{
+    if (!live)
+	return;
+
+    shortener_free(live->current);
+    free(live->slots);
+    free(live);
+}
+
+const struct shortener *shortener_live_get(struct shortener_live *live,
+		unsigned int *ticket, unsigned long *generation)
+{
+    struct shortener *sh;
+    unsigned int phase;
+
+    if (live_slot_id < 0)
+	live_slot_id = __atomic_fetch_add(&live_next_slot, 1,
+			__ATOMIC_RELAXED) % LIVE_SLOTS;
+
+    phase = __atomic_load_n(&live->phase, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&live->slots[live_slot_id].readers[phase], 1,
+		    __ATOMIC_SEQ_CST);
+    *ticket = live_slot_id * 2 + phase;
+
+    sh = __atomic_load_n(&live->current, __ATOMIC_SEQ_CST);
+    if (generation)
+	*generation = sh->generation;
+    return sh;
+}
+
+void shortener_live_put(struct shortener_live *live, unsigned int ticket)
+{
+    __atomic_fetch_sub(&live->slots[ticket / 2].readers[ticket & 1], 1,
+		    __ATOMIC_RELEASE);
+}
+
+static void live_wait(struct shortener_live *live, unsigned int phase)
+{
+    int i;
+
+    for (i = 0; i < LIVE_SLOTS; i ++)
+	while (__atomic_load_n(&live->slots[i].readers[phase],
+				__ATOMIC_SEQ_CST))
+	    sched_yield();
+}
+
+int shortener_live_swap(struct shortener_live *live, struct shortener *sh)
+{
+    struct shortener *old;
+    unsigned int phase;
+
+    if (!sh)
+	return -1;
+
+    /* One swap at a time */
+    while (__atomic_exchange_n(&live->swapping, 1, __ATOMIC_ACQUIRE))
+	sched_yield();
+
+    sh->generation = live->current->generation + 1;
+    old = __atomic_exchange_n(&live->current, sh, __ATOMIC_SEQ_CST);
+
+    phase = live->phase;
+    live_wait(live, (phase + 1) & 1);
+    __atomic_store_n(&live->phase, phase + 1, __ATOMIC_SEQ_CST);
+    live_wait(live, phase & 1);
+
+    __atomic_store_n(&live->swapping, 0, __ATOMIC_RELEASE);
+    shortener_free(old);
+    return 0;
+}
+
+/* Context used by the original API below */
+static struct shortener_live *default_live;
+
+void utf_init(void)
+{
+    default_live = shortener_live_new(shortener_new());
 }
 
 void utf_done(void)
 {
-    freelocale(l);
-    l = NULL;
+    shortener_live_free(default_live);
+    default_live = NULL;
 }
 
-void shorten_name(const char *name,
-		char short_name[512], char shortest_name[512])
+int utf_reload(const char *path)
 {
-    wchar_t w_name[512];
-    wchar_t w_short_name[512];
-    wchar_t w_shortest_name[512];
+    if (!default_live)
+	return -1;
 
-    const wchar_t *cur_word, *wchar_ptr;
-    wchar_t *cur_short_word, *cur_shortest_word;
+    return shortener_live_swap(default_live, shortener_load(path));
+}
 
-    int unabbrev = 0;
-    int i, j, len, new_len, capital;
+/* The next input character, read from the ASCII map if there is one */
+static inline wchar_t in_get(const struct ascii_map *am,
+		const char *p, const char *end, int *n)
+{
+    if (am) {
+	*n = 1;
+	return p < end ? *p : 0;
+    }
 
-    if (!name)
-        return;
+    return utf8_get_n(p, end, n);
+}
+
+static inline int in_isalnum(const struct ascii_map *am,
+		const char *p, wchar_t c)
+{
+    if (am)
+	return ascii_bit(am->alnum, p - am->start);
+
+    return uc_isalnum(c);
+}
+
+/*
+ * The script of the word starting with @c, only ever Latin in ASCII names
+ * so these don't need the case mapping.
+ */
+static inline int in_script(const struct ascii_map *am, wchar_t c)
+{
+    if (am)
+	return DICT_SCRIPT_LATIN;
+
+    return dict_script(uc_tolower(c));
+}
+
+/* The topmost abbreviation matching at @word, see abbrev_lookup() */
+static inline int match_abbrev(const struct dict_sel *sel,
+		const struct ascii_map *am, int script,
+		const char *word, const char *end, int *len)
+{
+    int i;
+
+    if (!sel->n_tries[script])
+	return -1;
+
+    PHASE_BEGIN();
+    if (am)
+	i = abbrev_lookup_ascii(sel, am, word - am->start, len);
+    else
+	i = abbrev_lookup(sel, script, word, end, len);
+    PHASE_END(PHASE_ABBREVS);
+
+    if (i >= 0)
+	STAT_ADD(sel->sh, entry_hits[i], 1);
+
+    return i;
+}
+
+/*
+ * The given name matching at @word, see given_name_lookup().  Words in
+ * scripts no given name starts in aren't even hashed.
+ */
+static inline int match_given_name(const struct dict_sel *sel,
+		const struct ascii_map *am, int script,
+		const char *word, const char *end, int *len)
+{
+    int i;
+
+    if (!(sel->sh->name_scripts & (1u << script)))
+	return -1;
+
+    PHASE_BEGIN();
+    if (am)
+	i = given_name_lookup_ascii(sel, am, word - am->start, len);
+    else
+	i = given_name_lookup(sel, word, end, len);
+    PHASE_END(PHASE_GIVEN_NAMES);
+
+    if (i >= 0)
+	STAT_ADD(sel->sh, name_hits[i], 1);
+
+    return i;
+}
+
+/* End of the word starting at @word */
+static inline const char *word_end(const struct ascii_map *am,
+		const char *word, const char *end)
+{
+    wchar_t c;
+    int n;
+
+    while ((c = in_get(am, word, end, &n)) && in_isalnum(am, word, c))
+	word += n;
+
+    return word;
+}
+
+/*
+ * The compound head ending the word from @word to @wend, see
+ * compound_lookup().  Only called when there are any compound heads
+ * selected, so other names don't pay for finding the end of every word.
+ */
+static inline int match_compound(const struct dict_sel *sel,
+		const struct ascii_map *am,
+		const char *word, const char *wend, int *len)
+{
+    int i;
+
+    PHASE_BEGIN();
+    if (am)
+	i = compound_lookup_ascii(sel, am, word - am->start,
+			wend - am->start, len);
+    else
+	i = compound_lookup(sel, word, wend, len);
+    PHASE_END(PHASE_ABBREVS);
+
+    if (i >= 0)
+	STAT_ADD(sel->sh, entry_hits[i], 1);
+
+    return i;
+}
+
+/*
+ * If original was capitalised then capitalise the abbreviation as well,
+ * if it was lower case.
+ */
+static void out_abbrev(struct out *o, const char *abbrev, int len, int upper)
+{
+    int n;
+
+    if (len && upper) {
+	out_char(o, uc_toupper(utf8_get(abbrev, &n)));
+	out_str(o, abbrev + n, len - n);
+    } else
+	out_str(o, abbrev, len);
+}
 
-    mbsrtowcs_l(w_name, &name, ARRAY_SIZE(w_name), NULL, l);
+/*
+ * The actual algorithm, shared by all the entry points.  Processes the
+ * name from @name to @end and appends to the @s and @ss outputs.
+ */
+static void shorten(const struct dict_sel *sel, const char *name,
+		const char *end, struct out *s, struct out *ss)
+{
+    const struct shortener *sh = sel->sh;
+    const char *cur_word = name, *abbrev, *wend;
+    struct ascii_map ascii, *am = NULL;
+    wchar_t c;
+    int unabbrev = 0;
+    int i, n, len = 0, new_len, script;
 
     /* TODO: also skip anything in parenthesis from the short names */
 
-    /* TODO: instead of calling wcscasecmp_l all the time it'd be more
-     * effective to lower case w_name once and use plain wcscmp or mem
-     * compare since the phrases we search for are all lower case already.
-     * Might also want to take "collation" into account (wcsxfrm_l the
-     * string once and use memcmp instead of wcscoll_l).
-     */
+    if (ascii_scan(name, end - name, &ascii))
+	am = &ascii;
 
-    cur_word = w_name;
-    cur_short_word = w_short_name;
-    cur_shortest_word = w_shortest_name;
     while (1) {
-	while (*cur_word && !iswalnum_l(*cur_word, l))
-	    if (iswspace_l(*cur_word, l)) {
+	while ((c = in_get(am, cur_word, end, &n)) &&
+		!in_isalnum(am, cur_word, c)) {
+	    if (uc_isspace(c)) {
 		/*
 		 * Avoid leading or consecutive whitespace when something gets
 		 * replaced with "".
 		 */
-		if (cur_short_word > w_short_name &&
-			!iswspace_l(cur_short_word[-1], l))
-		    *cur_short_word ++ = *cur_word;
-		if (cur_shortest_word > w_shortest_name &&
-			!iswspace_l(cur_shortest_word[-1], l))
-		    *cur_short_word ++ = *cur_word;
-	        *cur_word ++;
-	    } else
-	        *cur_short_word ++ = *cur_shortest_word ++ = *cur_word ++;
-
-	if (!*cur_word)
+		if (s->len && !uc_isspace(s->last))
+		    out_char(s, c);
+		if (ss->len && !uc_isspace(ss->last))
+		    out_char(s, c);
+	    } else {
+		out_bytes(s, cur_word, n);
+		out_bytes(ss, cur_word, n);
+		s->last = ss->last = c;
+	    }
+	    cur_word += n;
+	}
+
+	if (!c)
 	    break;
+	script = in_script(am, c);
 
-        /* TODO: use a hash of some kind instead of iterating over arrays */
+        /* Find the topmost abbreviation matching here */
+        i = match_abbrev(sel, am, script, cur_word, end, &len);
+        if (i >= 0) {
+	    abbrev = sh->strings + sh->entries[i].abbrev;
+	    new_len = sh->entries[i].abbrev_len;
+	    out_abbrev(s, abbrev, new_len, uc_isupper(c));
 
-        /* Go through possible abbreviations from top to bottom */
-        for (i = 0; i < ARRAY_SIZE(abbrevs); i += 2)
-	    if (!wcsncasecmp_l(abbrevs[i], cur_word, wcslen(abbrevs[i]), l)) {
-                len = wcslen(abbrevs[i]);
+	    cur_word += len;
 
-	        /* Check that we matched a full word */
-                if (iswalnum_l(cur_word[len], l))
-		    continue;
+	    /* Make sure shortest_word doesn't end up being empty */
+	    if (!in_get(am, cur_word, end, &n) && !unabbrev && new_len)
+		out_abbrev(ss, abbrev, new_len, uc_isupper(c));
 
-		capital = iswupper_l(*cur_word, l);
-		cur_word += len;
+	    /*if (new_len != len)*/
+	    continue;
+	}
 
-		new_len = wcslen(abbrevs[i + 1]);
-		memcpy(cur_short_word, abbrevs[i + 1],
-		        new_len * sizeof(wchar_t));
-		/*
-		 * If original was capitalised then capitalise the abbreviation
-		 * as well, if it was lower case.
-		 */
-		if (capital)
-		    *cur_short_word = towupper_l(*cur_short_word, l);
-
-		/* Make sure shortest_word doesn't end up being empty */
-		if (!*cur_word && !unabbrev) {
-		    memcpy(cur_shortest_word, cur_short_word,
-		            new_len * sizeof(wchar_t));
-		    cur_shortest_word += new_len;
+        /* Look the word up among the given names */
+        i = match_given_name(sel, am, script, cur_word, end, &len);
+        if (i >= 0) {
+	    abbrev = sh->strings + sh->names[i].initial;
+	    cur_word += len;
+	    out_str(s, abbrev, strlen(abbrev));
+	    continue;
+	}
+
+	/* Abbreviate the head of a compound word, keep the rest */
+	if (sel->n_suffixes) {
+	    wend = word_end(am, cur_word, end);
+	    i = match_compound(sel, am, cur_word, wend, &len);
+	    if (i >= 0) {
+		abbrev = sh->strings + sh->entries[i].abbrev;
+		new_len = sh->entries[i].abbrev_len;
+		out_str(s, cur_word, wend - len - cur_word);
+		out_str(ss, cur_word, wend - len - cur_word);
+		c = in_get(am, wend - len, end, &n);
+		out_abbrev(s, abbrev, new_len, uc_isupper(c));
+		cur_word = wend;
+		unabbrev += 1;
+		continue;
+	    }
+	}
+
+        /* Nothing matched, copy the current word as-is */
+	STAT_ADD(sh, copied, 1);
+        while ((c = in_get(am, cur_word, end, &n)) &&
+		in_isalnum(am, cur_word, c)) {
+	    out_bytes(s, cur_word, n);
+	    out_bytes(ss, cur_word, n);
+	    cur_word += n;
+	    s->last = ss->last = c;
+	}
+	unabbrev += 1;
+    }
+}
+
+/* Drop the whitespace at the end, left when the last word was dropped */
+static void out_rtrim(struct out *o)
+{
+    const char *p;
+    int n;
+
+    while (o->written && o->written == o->len) {
+	p = o->buf + o->written;
+	while (p > o->buf && (*-- p & 0xc0) == 0x80);
+	if (!uc_isspace(utf8_get(p, &n)))
+	    break;
+	o->written = o->len = p - o->buf;
+    }
+}
+
+/*
+ * Same matching as in shorten() but producing the abbreviation ladder,
+ * every step into its own output.  Street types are abbreviated from the
+ * first step on, titles and the other phrases from the second, given names
+ * only in the third, and the last step drops all of them like the shortest
+ * form.  Unlike in shorten(), whitespace is simply never doubled and
+ * trailing whitespace is dropped.
+ */
+static void ladder(const struct dict_sel *sel, const char *name,
+		const char *end, struct out o[SHORTENER_STEPS])
+{
+    const struct shortener *sh = sel->sh;
+    const char *cur_word = name, *abbrev, *wend;
+    struct ascii_map ascii, *am = NULL;
+    wchar_t c;
+    int unabbrev = 0;
+    int i, j, n, len = 0, new_len, first, script;
+
+    if (ascii_scan(name, end - name, &ascii))
+	am = &ascii;
+
+    while (1) {
+	while ((c = in_get(am, cur_word, end, &n)) &&
+		!in_isalnum(am, cur_word, c)) {
+	    for (j = 0; j < SHORTENER_STEPS; j ++) {
+		if (!uc_isspace(c)) {
+		    out_bytes(&o[j], cur_word, n);
+		    o[j].last = c;
+		} else if (o[j].len && !uc_isspace(o[j].last))
+		    out_char(&o[j], c);
+	    }
+	    cur_word += n;
+	}
+
+	if (!c)
+	    break;
+	script = in_script(am, c);
+
+	i = match_abbrev(sel, am, script, cur_word, end, &len);
+	if (i >= 0) {
+	    abbrev = sh->strings + sh->entries[i].abbrev;
+	    new_len = sh->entries[i].abbrev_len;
+	    first = (sh->entries[i].flags & DICT_CLASS_MASK) ==
+		    DICT_CLASS_TYPE ? SHORTENER_STEP_TYPES :
+		    SHORTENER_STEP_TITLES;
+
+	    for (j = 0; j < SHORTENER_STEP_STEM; j ++)
+		if (j < first)
+		    out_str(&o[j], cur_word, len);
+		else
+		    out_abbrev(&o[j], abbrev, new_len, uc_isupper(c));
+
+	    cur_word += len;
+
+	    if (!in_get(am, cur_word, end, &n) && !unabbrev)
+		out_abbrev(&o[SHORTENER_STEP_STEM], abbrev, new_len,
+				uc_isupper(c));
+	    continue;
+	}
+
+	i = match_given_name(sel, am, script, cur_word, end, &len);
+	if (i >= 0) {
+	    abbrev = sh->strings + sh->names[i].initial;
+	    for (j = 0; j < SHORTENER_STEP_GIVEN_NAMES; j ++)
+		out_str(&o[j], cur_word, len);
+	    out_str(&o[SHORTENER_STEP_GIVEN_NAMES], abbrev, strlen(abbrev));
+	    cur_word += len;
+	    continue;
+	}
+
+	if (sel->n_suffixes) {
+	    wend = word_end(am, cur_word, end);
+	    i = match_compound(sel, am, cur_word, wend, &len);
+	    if (i >= 0) {
+		abbrev = sh->strings + sh->entries[i].abbrev;
+		new_len = sh->entries[i].abbrev_len;
+		first = (sh->entries[i].flags & DICT_CLASS_MASK) ==
+			DICT_CLASS_TYPE ? SHORTENER_STEP_TYPES :
+			SHORTENER_STEP_TITLES;
+		c = in_get(am, wend - len, end, &n);
+
+		for (j = 0; j < SHORTENER_STEPS; j ++) {
+		    out_str(&o[j], cur_word, wend - len - cur_word);
+		    if (j < first)
+			out_str(&o[j], wend - len, len);
+		    else if (j < SHORTENER_STEP_STEM)
+			out_abbrev(&o[j], abbrev, new_len, uc_isupper(c));
 		}
 
-		cur_short_word += new_len;
+		cur_word = wend;
+		unabbrev += 1;
+		continue;
+	    }
+	}
 
-                /*if (new_len != len)*/
-		break;
+	STAT_ADD(sh, copied, 1);
+	while ((c = in_get(am, cur_word, end, &n)) &&
+		in_isalnum(am, cur_word, c)) {
+	    for (j = 0; j < SHORTENER_STEPS; j ++) {
+		out_bytes(&o[j], cur_word, n);
+		o[j].last = c;
 	    }
-        if (i < ARRAY_SIZE(abbrevs))
+	    cur_word += n;
+	}
+	unabbrev += 1;
+    }
+
+    for (j = 0; j < SHORTENER_STEPS; j ++)
+	out_rtrim(&o[j]);
+}
+
+/* Record a span if there's still room for it */
+static void span_add(struct shortener_span *spans, size_t max, size_t n,
+		int kind, const char *name, const char *start, size_t len,
+		const char *replacement, size_t replacement_len, int flags)
+{
+    if (n >= max)
+	return;
+
+    spans[n].replacement = replacement;
+    spans[n].offset = start - name;
+    spans[n].len = len;
+    spans[n].replacement_len = replacement_len;
+    spans[n].kind = kind;
+    spans[n].flags = flags;
+}
+
+/* Flags of the phrase in entry @i when matched at character @c */
+static int span_flags(const struct shortener *sh, int i, wchar_t c)
+{
+    int flags = SHORTENER_SPAN_DISCARDABLE;
+
+    if (uc_isupper(c))
+	flags |= SHORTENER_SPAN_CAPITAL;
+    if ((sh->entries[i].flags & DICT_CLASS_MASK) == DICT_CLASS_TYPE)
+	flags |= SHORTENER_SPAN_TYPE;
+    else if ((sh->entries[i].flags & DICT_CLASS_MASK) == DICT_CLASS_TITLE)
+	flags |= SHORTENER_SPAN_TITLE;
+
+    return flags;
+}
+
+/*
+ * Same matching as in shorten() again, only recording what matched where.
+ * Returns the number of spans, of which the first @max are in @buf.
+ */
+static size_t list_spans(const struct dict_sel *sel, const char *name,
+		const char *end, struct shortener_span *buf, size_t max)
+{
+    const struct shortener *sh = sel->sh;
+    const char *cur_word = name, *abbrev, *wend;
+    struct ascii_map ascii, *am = NULL;
+    wchar_t c;
+    size_t count = 0;
+    int i, n, len = 0, script;
+
+    if (ascii_scan(name, end - name, &ascii))
+	am = &ascii;
+
+    while (1) {
+	while ((c = in_get(am, cur_word, end, &n)) &&
+		!in_isalnum(am, cur_word, c))
+	    cur_word += n;
+
+	if (!c)
+	    break;
+	script = in_script(am, c);
+
+	i = match_abbrev(sel, am, script, cur_word, end, &len);
+	if (i >= 0) {
+	    span_add(buf, max, count ++, SHORTENER_SPAN_PHRASE,
+			    name, cur_word, len,
+			    sh->strings + sh->entries[i].abbrev,
+			    sh->entries[i].abbrev_len, span_flags(sh, i, c));
+	    cur_word += len;
 	    continue;
+	}
 
-        /* Go through possible given names from top to bottom */
-        for (i = 0; i < ARRAY_SIZE(given_names); i ++)
-	    if (!wcsncasecmp_l(given_names[i], cur_word,
-	            wcslen(given_names[i]), l)) {
-                len = wcslen(given_names[i]);
+	i = match_given_name(sel, am, script, cur_word, end, &len);
+	if (i >= 0) {
+	    abbrev = sh->strings + sh->names[i].initial;
+	    span_add(buf, max, count ++, SHORTENER_SPAN_GIVEN_NAME,
+			    name, cur_word, len, abbrev, strlen(abbrev),
+			    SHORTENER_SPAN_DISCARDABLE);
+	    cur_word += len;
+	    continue;
+	}
 
-	        /* Check that we matched a full word */
-                if (iswalnum_l(cur_word[len], l))
-		    continue;
+	wend = word_end(am, cur_word, end);
+	i = -1;
+	if (sel->n_suffixes)
+	    i = match_compound(sel, am, cur_word, wend, &len);
+	if (i >= 0) {
+	    span_add(buf, max, count ++, SHORTENER_SPAN_WORD,
+			    name, cur_word, wend - len - cur_word, NULL, 0, 0);
+	    c = in_get(am, wend - len, end, &n);
+	    span_add(buf, max, count ++, SHORTENER_SPAN_PHRASE,
+			    name, wend - len, len,
+			    sh->strings + sh->entries[i].abbrev,
+			    sh->entries[i].abbrev_len, span_flags(sh, i, c));
+	} else {
+	    STAT_ADD(sh, copied, 1);
+	    span_add(buf, max, count ++, SHORTENER_SPAN_WORD,
+			    name, cur_word, wend - cur_word, NULL, 0, 0);
+	}
+	cur_word = wend;
+    }
 
-		/*
-		 * If this is the final part of the name, and it matches a
-		 * given name then that's most likely somebody's surname which
-		 * happens to also be a possibble given name.  In that case
-		 * do not abbreviate or omit it.
-		 */
-		if (!cur_word[len])
-		    continue;
+    return count;
+}
 
-		new_len = 1;
-		for (j = 0; j < ARRAY_SIZE(digraphs); j ++)
-		    if (!wcsncasecmp_l(digraphs[j], cur_word,
-			    wcslen(digraphs[j]), l)) {
-			new_len = wcslen(digraphs[j]);
-			break;
-		    }
+void shorten_name(const char *name,
+		char short_name[512], char shortest_name[512])
+{
+    unsigned int ticket;
 
-		cur_word += len;
+    if (default_live) {
+	shortener_shorten(shortener_live_get(default_live, &ticket, NULL),
+			name, short_name, shortest_name);
+	shortener_live_put(default_live, ticket);
+    }
+}
 
-		for (j = 0; j < new_len; j ++)
-		    *cur_short_word++ = given_names[i][j];
-		*cur_short_word++ = L'.';
+void shortener_shorten(const struct shortener *sh, const char *name,
+		char short_name[512], char shortest_name[512])
+{
+    shortener_shorten_lang(sh, name, NULL, short_name, shortest_name);
+}
 
-		break;
+void shortener_shorten_lang(const struct shortener *sh, const char *name,
+		const char *langs,
+		char short_name[512], char shortest_name[512])
+{
+    struct out s = { short_name, 511 }, ss = { shortest_name, 511 };
+    struct dict_sel sel;
+    size_t len;
+
+    if (!name)
+        return;
+
+    STATS_BEGIN();
+    len = strlen(name);
+    dict_select(sh, langs, &sel);
+    shorten(&sel, name, name + len, &s, &ss);
+    STATS_END(sh, len);
+
+    short_name[s.written] = 0;
+    shortest_name[ss.written] = 0;
+}
+
+int shortener_shorten_n(const struct shortener *sh,
+		const char *name, size_t len, const char *langs,
+		char *short_name, size_t short_size, size_t *short_len,
+		char *shortest_name, size_t shortest_size, size_t *shortest_len)
+{
+    struct out s = { short_name, short_size };
+    struct out ss = { shortest_name, shortest_size };
+    struct dict_sel sel;
+
+    STATS_BEGIN();
+    dict_select(sh, langs, &sel);
+    shorten(&sel, name, name + len, &s, &ss);
+    STATS_END(sh, len);
+
+    /* Mark where a form that didn't fit was cut */
+    if (s.len > s.written && s.written < s.size)
+	short_name[s.written] = 0;
+    if (ss.len > ss.written && ss.written < ss.size)
+	shortest_name[ss.written] = 0;
+
+    *short_len = s.len;
+    *shortest_len = ss.len;
+    return s.len > s.written || ss.len > ss.written ? -1 : 0;
+}
+
+size_t shortener_shorten_batch(const struct shortener *sh, size_t count,
+		const char *const *names, const size_t *lens,
+		const char *const *langs,
+		char *arena, size_t arena_size,
+		struct shortener_result *results)
+{
+    struct out s, ss;
+    struct dict_sel sel;
+    char tmp[512];
+    size_t i, pos = 0, avail, len;
+
+    dict_select(sh, NULL, &sel);
+
+    for (i = 0; i < count; i ++) {
+	STATS_BEGIN();
+
+	if (langs)
+	    dict_select(sh, langs[i], &sel);
+
+	/*
+	 * Both outputs are produced at the same time, so the short form gets
+	 * all of the free space and the shortest form, usually only a few
+	 * bytes long, goes to @tmp first and is copied to right after it.
+	 * Only a shortest form too long for @tmp needs a second pass, now
+	 * that the short form's length is known.
+	 */
+	avail = arena_size - pos;
+	s = (struct out) { arena + pos, avail };
+	ss = (struct out) { tmp, sizeof(tmp) };
+	shorten(&sel, names[i], names[i] + lens[i], &s, &ss);
+	if (s.len + ss.len <= avail && ss.len > ss.written) {
+	    len = s.len;
+	    s = (struct out) { arena + pos, len };
+	    ss = (struct out) { arena + pos + len, avail - len };
+	    shorten(&sel, names[i], names[i] + lens[i], &s, &ss);
+	} else if (s.len + ss.len <= avail)
+	    memcpy(arena + pos + s.len, tmp, ss.len);
+	STATS_END(sh, lens[i]);
+
+	if (s.len + ss.len > avail) {
+	    /* Tell the caller how much the first name needs */
+	    if (!i) {
+		results[0].short_offset = 0;
+		results[0].short_len = s.len;
+		results[0].shortest_offset = s.len;
+		results[0].shortest_len = ss.len;
 	    }
-        if (i < ARRAY_SIZE(given_names))
+	    break;
+	}
+
+	results[i].short_offset = pos;
+	results[i].short_len = s.len;
+	results[i].shortest_offset = pos + s.len;
+	results[i].shortest_len = ss.len;
+	pos += s.len + ss.len;
+    }
+
+    return i;
+}
+
+int shortener_ladder(const struct shortener *sh,
+		const char *name, size_t len, const char *langs,
+		char *buf, size_t size, struct shortener_step *steps)
+{
+    struct out o[SHORTENER_STEPS];
+    struct dict_sel sel;
+    size_t pos = 0, part = size / SHORTENER_STEPS;
+    int i, ret = 0;
+
+    for (i = 0; i < SHORTENER_STEPS; i ++)
+	o[i] = (struct out) { buf + i * part, part };
+
+    STATS_BEGIN();
+    dict_select(sh, langs, &sel);
+    ladder(&sel, name, name + len, o);
+    STATS_END(sh, len);
+
+    /* Move them all down to right after each other */
+    for (i = 0; i < SHORTENER_STEPS; i ++) {
+	steps[i].len = o[i].len;
+	if (o[i].len > o[i].written) {
+	    ret = -1;
 	    continue;
+	}
 
-        /* Nothing matched, copy the current word as-is */
-        while (iswalnum_l(*cur_word, l))
-	    *cur_short_word ++ = *cur_shortest_word ++ = *cur_word ++;
-	unabbrev += 1;
+	memmove(buf + pos, o[i].buf, o[i].len);
+	steps[i].offset = pos;
+	pos += o[i].len;
+    }
+
+    return ret;
+}
+
+size_t shortener_spans(const struct shortener *sh,
+		const char *name, size_t len, const char *langs,
+		struct shortener_span *spans, size_t max_spans)
+{
+    struct dict_sel sel;
+    size_t count;
+
+    if (len > 0xffffffff)
+	return 0;
+
+    STATS_BEGIN();
+    dict_select(sh, langs, &sel);
+    count = list_spans(&sel, name, name + len, spans, max_spans);
+    STATS_END(sh, len);
+
+    return count;
+}
+
+/*
+ * The counters are read without stopping the other threads, so the totals
+ * are only consistent with each other once they're done.
+ */
+int shortener_stats(const struct shortener *sh, struct shortener_stats *st)
+{
+#ifdef SHORTENER_STATS
+    const struct stats_slot *slot;
+    int i, j;
+#endif
+
+    memset(st, 0, sizeof(*st));
+
+#ifdef SHORTENER_STATS
+    st->n_entries = sh->n_entries;
+    st->n_names = sh->n_names;
+    st->entry_hits = calloc(sh->n_entries + sh->n_names + 1,
+		    sizeof(unsigned long));
+    if (!st->entry_hits)
+	return -1;
+    st->name_hits = st->entry_hits + sh->n_entries;
+
+    for (i = 0; i < STATS_SLOTS; i ++) {
+	slot = sh->stats[i];
+	st->calls += __atomic_load_n(&slot->calls, __ATOMIC_RELAXED);
+	st->bytes += __atomic_load_n(&slot->bytes, __ATOMIC_RELAXED);
+	st->copied += __atomic_load_n(&slot->copied, __ATOMIC_RELAXED);
+	for (j = 0; j < SHORTENER_LATENCY_BUCKETS; j ++)
+	    st->latency[j] += __atomic_load_n(&slot->latency[j],
+			    __ATOMIC_RELAXED);
+	for (j = 0; j < sh->n_entries; j ++)
+	    st->entry_hits[j] += __atomic_load_n(&slot->entry_hits[j],
+			    __ATOMIC_RELAXED);
+	for (j = 0; j < sh->n_names; j ++)
+	    st->name_hits[j] += __atomic_load_n(&slot->name_hits[j],
+			    __ATOMIC_RELAXED);
     }
 
-    *cur_short_word = 0;
-    *cur_shortest_word = 0;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void shortener_stats_free(struct shortener_stats *st)
+{
+    free(st->entry_hits);
+    st->entry_hits = st->name_hits = NULL;
+}
+
+/* The phrase of abbreviation @i, and what it's abbreviated to */
+const char *shortener_stats_entry(const struct shortener *sh, size_t i,
+		const char **abbrev)
+{
+    if (i >= sh->n_entries)
+	return NULL;
+
+    if (abbrev)
+	*abbrev = sh->strings + sh->entries[i].abbrev;
+    return sh->strings + sh->entries[i].phrase;
+}
+
+/* The given name @i, in lower case */
+const char *shortener_stats_name(const struct shortener *sh, size_t i)
+{
+    if (i >= sh->n_names)
+	return NULL;
 
-    wchar_ptr = w_short_name;
-    wcsrtombs_l(short_name, &wchar_ptr, 512, NULL, l);
-    wchar_ptr = w_shortest_name;
-    wcsrtombs_l(shortest_name, &wchar_ptr, 512, NULL, l);
+    return sh->strings + sh->names[i].key;
 }
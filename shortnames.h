@@ -4,10 +4,280 @@
  * Code in this file is for now licensed under the 2-clause BSD license.
  */
 
+#include <stddef.h>
+
 void utf_init(void);
 void utf_done(void);
 
+/*
+ * Replace the dictionary used by shorten_name() with one compiled by
+ * mkdict, see shortener_live_swap().  Returns -1 if it can't be loaded.
+ */
+int utf_reload(const char *path);
+
 void shorten_name(const char *name,
 		char short_name[512], char shortest_name[512]);
 
+/*
+ * Reentrant interface: a struct shortener holds the compiled dictionaries
+ * and is never modified after shortener_new(), so it can be shared by any
+ * number of threads.  shorten_name() uses one set up by utf_init().
+ */
+struct shortener;
+
+struct shortener *shortener_new(void);
+void shortener_free(struct shortener *sh);
+
+/*
+ * Use a dictionary compiled by mkdict instead of the built-in one, either
+ * a file which gets mmapped, or an image already in memory, 8-byte aligned
+ * and valid until the context is freed.  Return NULL if the dictionary is
+ * not valid.
+ */
+struct shortener *shortener_load(const char *path);
+struct shortener *shortener_new_image(const void *image, size_t size);
+
+/*
+ * A context that can be replaced at runtime by a new one, e.g. one loaded
+ * from a fixed dictionary file, while other threads keep using it.  It
+ * takes ownership of @sh, also on failure.  shortener_live_get() returns
+ * the current context, to be used until the matching shortener_live_put()
+ * with the same @ticket, and its generation, which grows with every swap,
+ * if @generation is not NULL.  Neither ever waits or takes a lock.
+ * shortener_live_swap() publishes @sh and frees the old context once all
+ * the calls that might be using it are done, it returns -1 and does
+ * nothing if @sh is NULL, so shortener_live_swap(live, shortener_load(path))
+ * is enough to reload.  A cache made for a live context, see
+ * shortener_cache_new_live(), ignores the results from older generations.
+ */
+struct shortener_live;
+
+struct shortener_live *shortener_live_new(struct shortener *sh);
+void shortener_live_free(struct shortener_live *live);
+
+const struct shortener *shortener_live_get(struct shortener_live *live,
+		unsigned int *ticket, unsigned long *generation);
+void shortener_live_put(struct shortener_live *live, unsigned int ticket);
+int shortener_live_swap(struct shortener_live *live, struct shortener *sh);
+
+void shortener_shorten(const struct shortener *sh, const char *name,
+		char short_name[512], char shortest_name[512]);
+
+/*
+ * Only use the dictionaries for the languages in @langs, a list of codes
+ * like in OSM tags ("pl", "ru;uk").  NULL or "" means all of them.
+ */
+void shortener_shorten_lang(const struct shortener *sh, const char *name,
+		const char *langs,
+		char short_name[512], char shortest_name[512]);
+
+/*
+ * Same as above for a name @len bytes long, which needs no NUL.  The two
+ * forms are written to the caller's buffers of @short_size and
+ * @shortest_size bytes, without NUL terminators, and their lengths are
+ * returned in @short_len and @shortest_len.  If either didn't fit, -1 is
+ * returned and the lengths are the sizes needed, so the call can be
+ * repeated with large enough buffers.  The buffer of a form that didn't
+ * fit still has as much of it as fits, cut at a character boundary like
+ * in shortener_shorten(), followed by a NUL if there's room.  Otherwise
+ * returns 0.
+ */
+int shortener_shorten_n(const struct shortener *sh,
+		const char *name, size_t len, const char *langs,
+		char *short_name, size_t short_size, size_t *short_len,
+		char *shortest_name, size_t shortest_size, size_t *shortest_len);
+
+/*
+ * Abbreviation ladder: a series of successively shorter forms of the name
+ * from a single pass of matching, for label placement to try in order
+ * until one fits.  The steps abbreviate:
+ *   SHORTENER_STEP_TYPES: only the types of streets and places,
+ *   SHORTENER_STEP_TITLES: also titles and all the other phrases,
+ *   SHORTENER_STEP_GIVEN_NAMES: also given names to their initials,
+ *   SHORTENER_STEP_STEM: and the last one drops all of them.
+ * A step may be the same as the one before it.  @name is @len bytes long
+ * and needs no NUL.  The steps are placed one after another in @buf, of
+ * @size bytes, without NUL terminators.  If it's too small -1 is returned
+ * and the lengths in @steps are those needed, a buffer SHORTENER_STEPS
+ * times the longest of them is always enough.  Otherwise returns 0.
+ */
+enum shortener_step_level {
+    SHORTENER_STEP_TYPES,
+    SHORTENER_STEP_TITLES,
+    SHORTENER_STEP_GIVEN_NAMES,
+    SHORTENER_STEP_STEM,
+    SHORTENER_STEPS,
+};
+
+struct shortener_step {
+    size_t offset, len;
+};
+
+int shortener_ladder(const struct shortener *sh,
+		const char *name, size_t len, const char *langs,
+		char *buf, size_t size, struct shortener_step *steps);
+
+/*
+ * The matching itself, as spans pointing into the input instead of any
+ * output strings, so that a renderer can build whatever form it wants
+ * without running the shortener again.  Every word of the name is covered
+ * by one span:
+ *   SHORTENER_SPAN_PHRASE: a phrase from the abbreviations, which may be
+ *     several words, or the head of a compound word ("straße" in
+ *     "Hauptstraße"), which then directly follows the WORD span of the rest
+ *     of the word,
+ *   SHORTENER_SPAN_GIVEN_NAME: a given name,
+ *   SHORTENER_SPAN_WORD: a word that matched nothing, part of the stem.
+ * Whatever is between the spans are separators.  @replacement is the
+ * abbreviation, or the initial of a given name, @replacement_len bytes
+ * long, without a NUL and possibly empty, and points into the dictionary
+ * so it stays valid until the context is freed.  The flags say if the
+ * first letter of the replacement should be capitalised, the class of the
+ * phrase for the ladder and whether it's discardable, i.e. left out of the
+ * shortest form.  @name is @len bytes long and needs no NUL.  Up to
+ * @max_spans spans are written to @spans and the number of spans in the
+ * name is returned, so a call with too few can be repeated with enough.
+ * Names of 4 GiB or more have no spans.
+ */
+enum shortener_span_kind {
+    SHORTENER_SPAN_PHRASE,
+    SHORTENER_SPAN_GIVEN_NAME,
+    SHORTENER_SPAN_WORD,
+};
+
+#define SHORTENER_SPAN_CAPITAL		1
+#define SHORTENER_SPAN_DISCARDABLE	2
+#define SHORTENER_SPAN_TYPE		4	/* Class of the phrase */
+#define SHORTENER_SPAN_TITLE		8
+
+struct shortener_span {
+    const char *replacement;
+    unsigned int offset, len;		/* In the input */
+    unsigned int replacement_len;
+    unsigned char kind, flags;
+};
+
+size_t shortener_spans(const struct shortener *sh,
+		const char *name, size_t len, const char *langs,
+		struct shortener_span *spans, size_t max_spans);
+
+/*
+ * Width-budgeted shortening.  A struct shortener_widths holds the advance
+ * widths of a font's glyphs, built once per font from @count code points
+ * and their advances, in any units.  Code points not listed have
+ * @default_advance.  shortener_fit() writes the longest of the name itself
+ * and the ladder steps that is at most @max_width wide to @buf, without a
+ * NUL.  It returns 0 for the unchanged name or 1 + the SHORTENER_STEP_* of
+ * the step chosen, with its length in @out_len and its width in @width.
+ * If nothing fits the last step is chosen.  Returns -1 if @buf of @size
+ * bytes is too small, with the length needed in @out_len.
+ */
+struct shortener_widths;
+
+struct shortener_widths *shortener_widths_new(const unsigned int *codepoints,
+		const unsigned short *advances, size_t count,
+		unsigned short default_advance);
+void shortener_widths_free(struct shortener_widths *w);
+
+unsigned long shortener_width(const struct shortener_widths *w,
+		const char *str, size_t len);
+int shortener_fit(const struct shortener *sh,
+		const struct shortener_widths *w,
+		const char *name, size_t len, const char *langs,
+		unsigned long max_width, char *buf, size_t size,
+		size_t *out_len, unsigned long *width);
+
+/*
+ * Batch interface: shortens @count names given as pointers and lengths
+ * (no NUL needed) and places both forms of every name one after another
+ * in @arena, without NUL terminators.  @langs is either NULL or has the
+ * languages of every name as above.  Returns the number of names done,
+ * which is less than @count if the arena filled up.  The remaining names
+ * can be passed again with a new arena.  If not even the first name fits,
+ * 0 is returned and the lengths in @results[0] are those it needs.
+ */
+struct shortener_result {
+    size_t short_offset, short_len;
+    size_t shortest_offset, shortest_len;
+};
+
+size_t shortener_shorten_batch(const struct shortener *sh, size_t count,
+		const char *const *names, const size_t *lens,
+		const char *const *langs,
+		char *arena, size_t arena_size,
+		struct shortener_result *results);
+
+/*
+ * Statistics of a context, only collected when the library is built with
+ * SHORTENER_STATS defined (make STATS=1), otherwise shortener_stats()
+ * returns -1.  Every call of the entry points above counts, with the bytes
+ * of the name and the time it took in @latency, where bucket i has the calls
+ * that took from 2^i to 2^(i+1) - 1 nanoseconds.  @copied counts the words
+ * that matched nothing and were copied as they are.  @entry_hits and
+ * @name_hits are allocated and have the number of matches of every
+ * abbreviation and every given name, labelled by shortener_stats_entry()
+ * and shortener_stats_name().  They must be released with
+ * shortener_stats_free().
+ */
+#define SHORTENER_LATENCY_BUCKETS	32
+
+struct shortener_stats {
+    unsigned long calls, bytes, copied;
+    unsigned long latency[SHORTENER_LATENCY_BUCKETS];
+    size_t n_entries, n_names;
+    unsigned long *entry_hits, *name_hits;
+};
+
+int shortener_stats(const struct shortener *sh, struct shortener_stats *st);
+void shortener_stats_free(struct shortener_stats *st);
+const char *shortener_stats_entry(const struct shortener *sh, size_t i,
+		const char **abbrev);
+const char *shortener_stats_name(const struct shortener *sh, size_t i);
+
+/*
+ * Optional cache of results in front of a struct shortener, bounded to
+ * roughly @max_entries names.  It can be used from any number of threads.
+ * shortener_cache_shorten() works like shortener_shorten_lang() except that
+ * @name is @len bytes long and needs no NUL.  The counters are for the
+ * whole lifetime of the cache.  shortener_cache_new_live() makes a cache
+ * in front of whichever context @live has at the time of each call, whose
+ * entries stop matching once it's swapped and are gradually replaced.
+ */
+struct shortener_cache;
+
+struct shortener_cache *shortener_cache_new(const struct shortener *sh,
+		size_t max_entries);
+struct shortener_cache *shortener_cache_new_live(struct shortener_live *live,
+		size_t max_entries);
+void shortener_cache_free(struct shortener_cache *cache);
+
+void shortener_cache_shorten(struct shortener_cache *cache,
+		const char *name, size_t len, const char *langs,
+		char short_name[512], char shortest_name[512]);
+void shortener_cache_stats(struct shortener_cache *cache,
+		unsigned long *hits, unsigned long *misses);
+
+/*
+ * Client of the shrtnmsd daemon listening on the Unix socket @path, which
+ * lets processes share one dictionary and one warm cache.  The calls work
+ * like shortener_shorten_lang() and shortener_shorten_batch() but return
+ * -1 if the daemon can't be reached or the name is over 65535 bytes.  The
+ * batch call sends as many names as fit in one request and stores how
+ * many were done in @done.  A client is a single connection and must
+ * not be used from more than one thread at a time.
+ */
+struct shortener_client;
+
+struct shortener_client *shortener_client_new(const char *path);
+void shortener_client_free(struct shortener_client *client);
+
+int shortener_client_shorten(struct shortener_client *client,
+		const char *name, const char *langs,
+		char short_name[512], char shortest_name[512]);
+int shortener_client_shorten_batch(struct shortener_client *client,
+		size_t count, const char *const *names, const size_t *lens,
+		const char *const *langs,
+		char *arena, size_t arena_size,
+		struct shortener_result *results, size_t *done);
+
 #define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
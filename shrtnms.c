@@ -0,0 +1,657 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Command line filter: reads names, one per line, and prints
+ * "name<TAB>short<TAB>shortest" lines in the same order.  With -l only
+ * the dictionaries of the given languages are used, and with -d a
+ * dictionary compiled by mkdict is used instead of the built-in one.  With
+ * -c the results for up to that many different names are cached and the
+ * hit rate is printed at the end.  With -s all the steps of the
+ * abbreviation ladder are printed instead of the two forms, and with -w
+ * only the longest form at most that many characters long.  -S prints the
+ * library's statistics at the end, when it's built with them.  With -u the
+ * names are sent to a shrtnmsd listening on the given socket instead of
+ * being shortened in this process, one connection per worker thread, and
+ * the two forms are cut at 511 bytes as in shortener_shorten().
+ *
+ * The input is mmapped when it's a regular file, otherwise read in large
+ * blocks, and cut into blocks at line boundaries.  A pool of worker threads
+ * takes whole blocks and shortens them into per-block output buffers, which
+ * a writer thread outputs in input order while the next blocks are being
+ * read and processed.  The number of blocks in flight is bounded so memory
+ * use doesn't depend on the input size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shortnames.h"
+
+enum block_state {
+    BLOCK_FREE,
+    BLOCK_READ,		/* Waiting for a worker */
+    BLOCK_DONE,		/* Waiting for the writer */
+};
+
+struct block {
+    enum block_state state;
+    const char *in;
+    size_t in_len;
+    char *buf;		/* Input when not mmapped */
+    size_t buf_size;
+    char *out;
+    size_t out_len, out_size;
+};
+
+/* Per worker buffers for the batch interface */
+struct worker {
+    const char **names;
+    const char **langs;
+    size_t *lens;
+    struct shortener_result *results;
+    size_t n_names;
+    char *arena;
+    size_t arena_size;
+    struct shortener_client *client;
+};
+
+static struct shortener *sh;
+static struct shortener_cache *cache;
+static int ladder;
+static struct shortener_widths *widths;
+static unsigned long max_width;
+static const char *langs;
+static const char *socket_path;
+static struct block *blocks;
+static int n_blocks;
+static size_t block_size = 1 << 20;
+
+/* Everything below is protected by the lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static unsigned long n_read, n_taken, n_written;
+static int eof;
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    return ptr;
+}
+
+static void out_append(struct block *b, const char *str, size_t len)
+{
+    if (b->out_len + len > b->out_size) {
+	b->out_size = (b->out_len + len) * 2;
+	b->out = xrealloc(b->out, b->out_size);
+    }
+    memcpy(b->out + b->out_len, str, len);
+    b->out_len += len;
+}
+
+/*
+ * Same without the batch interface, one name at a time through the cache.
+ * The cache's outputs are capped at 511 bytes, so the few names that could
+ * be shortened to more than that don't go through it.
+ */
+static void process_block_cached(struct worker *w, struct block *b)
+{
+    const char *line = b->in, *end = b->in + b->in_len, *nl;
+    char short_name[512], shortest_name[512];
+    size_t short_len, shortest_len, half;
+
+    b->out_len = 0;
+    while (line < end) {
+	nl = memchr(line, '\n', end - line);
+	if (!nl)
+	    nl = end;
+
+	out_append(b, line, nl - line);
+	out_append(b, "\t", 1);
+
+	if (nl - line < 256) {
+	    shortener_cache_shorten(cache, line, nl - line, langs,
+			    short_name, shortest_name);
+	    out_append(b, short_name, strlen(short_name));
+	    out_append(b, "\t", 1);
+	    out_append(b, shortest_name, strlen(shortest_name));
+	} else {
+	    half = w->arena_size / 2;
+	    while (shortener_shorten_n(sh, line, nl - line, langs,
+				    w->arena, half, &short_len,
+				    w->arena + half, half, &shortest_len)) {
+		w->arena_size *= 2;
+		w->arena = xrealloc(w->arena, w->arena_size);
+		half = w->arena_size / 2;
+	    }
+	    out_append(b, w->arena, short_len);
+	    out_append(b, "\t", 1);
+	    out_append(b, w->arena + half, shortest_len);
+	}
+
+	out_append(b, "\n", 1);
+	line = nl + 1;
+    }
+}
+
+/* With -w print the longest form that fits in the width */
+static void process_block_fit(struct worker *w, struct block *b)
+{
+    const char *line = b->in, *end = b->in + b->in_len, *nl;
+    unsigned long width;
+    size_t len;
+
+    b->out_len = 0;
+    while (line < end) {
+	nl = memchr(line, '\n', end - line);
+	if (!nl)
+	    nl = end;
+
+	while (shortener_fit(sh, widths, line, nl - line, langs, max_width,
+				w->arena, w->arena_size, &len, &width) < 0) {
+	    w->arena_size *= 2;
+	    w->arena = xrealloc(w->arena, w->arena_size);
+	}
+
+	out_append(b, line, nl - line);
+	out_append(b, "\t", 1);
+	out_append(b, w->arena, len);
+	out_append(b, "\n", 1);
+	line = nl + 1;
+    }
+}
+
+/* With -s print all the steps of the abbreviation ladder instead */
+static void process_block_ladder(struct worker *w, struct block *b)
+{
+    const char *line = b->in, *end = b->in + b->in_len, *nl;
+    struct shortener_step steps[SHORTENER_STEPS];
+    int i;
+
+    b->out_len = 0;
+    while (line < end) {
+	nl = memchr(line, '\n', end - line);
+	if (!nl)
+	    nl = end;
+
+	while (shortener_ladder(sh, line, nl - line, langs,
+				w->arena, w->arena_size, steps)) {
+	    w->arena_size *= 2;
+	    w->arena = xrealloc(w->arena, w->arena_size);
+	}
+
+	out_append(b, line, nl - line);
+	for (i = 0; i < SHORTENER_STEPS; i ++) {
+	    out_append(b, "\t", 1);
+	    out_append(b, w->arena + steps[i].offset, steps[i].len);
+	}
+	out_append(b, "\n", 1);
+	line = nl + 1;
+    }
+}
+
+static void process_block(struct worker *w, struct block *b)
+{
+    const char *line = b->in, *end = b->in + b->in_len, *nl;
+    struct shortener_result *r;
+    size_t count = 0, done = 0, i, k;
+
+    while (line < end) {
+	nl = memchr(line, '\n', end - line);
+	if (!nl)
+	    nl = end;
+
+	if (count == w->n_names) {
+	    w->n_names = w->n_names * 2 + 1024;
+	    w->names = xrealloc(w->names, w->n_names * sizeof(*w->names));
+	    w->lens = xrealloc(w->lens, w->n_names * sizeof(*w->lens));
+	    w->langs = xrealloc(w->langs, w->n_names * sizeof(*w->langs));
+	    w->results = xrealloc(w->results,
+			    w->n_names * sizeof(*w->results));
+	}
+	w->langs[count] = langs;
+	w->names[count] = line;
+	w->lens[count ++] = nl - line;
+	line = nl + 1;
+    }
+
+    b->out_len = 0;
+    while (done < count) {
+	if (w->client) {
+	    if (shortener_client_shorten_batch(w->client, count - done,
+				    w->names + done, w->lens + done,
+				    w->langs + done, w->arena, w->arena_size,
+				    w->results, &k)) {
+		fprintf(stderr, "%s: Request failed\n", socket_path);
+		exit(1);
+	    }
+	} else
+	    k = shortener_shorten_batch(sh, count - done, w->names + done,
+			    w->lens + done, w->langs + done,
+			    w->arena, w->arena_size, w->results);
+	if (!k) {
+	    w->arena_size *= 2;
+	    if (!w->client && w->arena_size < w->results[0].short_len +
+		    w->results[0].shortest_len)
+		w->arena_size = w->results[0].short_len +
+			w->results[0].shortest_len;
+	    w->arena = xrealloc(w->arena, w->arena_size);
+	    continue;
+	}
+
+	for (i = 0, r = w->results; i < k; i ++, r ++) {
+	    out_append(b, w->names[done + i], w->lens[done + i]);
+	    out_append(b, "\t", 1);
+	    out_append(b, w->arena + r->short_offset, r->short_len);
+	    out_append(b, "\t", 1);
+	    out_append(b, w->arena + r->shortest_offset, r->shortest_len);
+	    out_append(b, "\n", 1);
+	}
+	done += k;
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker w = { .arena_size = 1 << 16 };
+    struct block *b;
+
+    w.arena = xrealloc(NULL, w.arena_size);
+    if (socket_path) {
+	w.client = shortener_client_new(socket_path);
+	if (!w.client) {
+	    perror(socket_path);
+	    exit(1);
+	}
+    }
+
+    while (1) {
+	pthread_mutex_lock(&lock);
+	while (n_taken == n_read && !eof)
+	    pthread_cond_wait(&cond, &lock);
+	if (n_taken == n_read) {
+	    pthread_mutex_unlock(&lock);
+	    break;
+	}
+	b = &blocks[n_taken ++ % n_blocks];
+	pthread_mutex_unlock(&lock);
+
+	if (w.client)
+	    process_block(&w, b);
+	else if (widths)
+	    process_block_fit(&w, b);
+	else if (ladder)
+	    process_block_ladder(&w, b);
+	else if (cache)
+	    process_block_cached(&w, b);
+	else
+	    process_block(&w, b);
+
+	pthread_mutex_lock(&lock);
+	b->state = BLOCK_DONE;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+    }
+
+    free(w.names);
+    free(w.langs);
+    free(w.lens);
+    free(w.results);
+    free(w.arena);
+    shortener_client_free(w.client);
+    return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct block *b;
+    const char *p;
+    ssize_t ret;
+    size_t len;
+
+    while (1) {
+	b = &blocks[n_written % n_blocks];
+
+	pthread_mutex_lock(&lock);
+	while (!(n_written == n_read && eof) && b->state != BLOCK_DONE)
+	    pthread_cond_wait(&cond, &lock);
+	if (b->state != BLOCK_DONE) {
+	    pthread_mutex_unlock(&lock);
+	    break;
+	}
+	pthread_mutex_unlock(&lock);
+
+	for (p = b->out, len = b->out_len; len; p += ret, len -= ret) {
+	    ret = write(1, p, len);
+	    if (ret < 0 && errno == EINTR)
+		ret = 0;
+	    else if (ret < 0) {
+		perror("write");
+		exit(1);
+	    }
+	}
+
+	pthread_mutex_lock(&lock);
+	b->state = BLOCK_FREE;
+	n_written ++;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+/* Wait for the next block to be free, the caller then fills it in */
+static struct block *next_block(void)
+{
+    struct block *b = &blocks[n_read % n_blocks];
+
+    pthread_mutex_lock(&lock);
+    while (b->state != BLOCK_FREE)
+	pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+
+    return b;
+}
+
+static void queue_block(struct block *b)
+{
+    pthread_mutex_lock(&lock);
+    b->state = BLOCK_READ;
+    n_read ++;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Cut a mapped file into blocks, no copying needed */
+static void read_mapped(const char *data, size_t size)
+{
+    const char *end = data + size, *cut;
+    struct block *b;
+
+    while (data < end) {
+	cut = data + block_size < end ? data + block_size : end;
+	if (cut < end) {
+	    cut = memchr(cut, '\n', end - cut);
+	    cut = cut ? cut + 1 : end;
+	}
+
+	b = next_block();
+	b->in = data;
+	b->in_len = cut - data;
+	queue_block(b);
+	data = cut;
+    }
+}
+
+/* Read until @buf is full or end of file, returns the length read */
+static size_t read_full(int fd, char *buf, size_t size)
+{
+    size_t len = 0;
+    ssize_t ret;
+
+    while (len < size) {
+	ret = read(fd, buf + len, size - len);
+	if (ret < 0 && errno == EINTR)
+	    continue;
+	if (ret < 0) {
+	    perror("read");
+	    exit(1);
+	}
+	if (!ret)
+	    break;
+	len += ret;
+    }
+
+    return len;
+}
+
+/*
+ * Read from a pipe or similar.  Whatever follows the last newline in a
+ * block is carried over to the start of the next one.
+ */
+static void read_stream(int fd)
+{
+    char *carry = NULL;
+    size_t carry_len = 0, len, cut;
+    struct block *b;
+    int at_eof = 0;
+
+    while (!at_eof) {
+	b = next_block();
+	if (b->buf_size < block_size + carry_len) {
+	    b->buf_size = block_size + carry_len;
+	    b->buf = xrealloc(b->buf, b->buf_size);
+	}
+	memcpy(b->buf, carry, carry_len);
+	len = carry_len;
+
+	while (1) {
+	    len += read_full(fd, b->buf + len, b->buf_size - len);
+	    if (len < b->buf_size) {
+		at_eof = 1;
+		cut = len;
+		break;
+	    }
+
+	    for (cut = len; cut && b->buf[cut - 1] != '\n'; cut --);
+	    if (cut)
+		break;
+
+	    /* A single line longer than the block */
+	    b->buf_size *= 2;
+	    b->buf = xrealloc(b->buf, b->buf_size);
+	}
+
+	carry_len = len - cut;
+	carry = xrealloc(carry, carry_len + 1);
+	memcpy(carry, b->buf + cut, carry_len);
+
+	b->in = b->buf;
+	b->in_len = cut;
+	if (cut)
+	    queue_block(b);
+    }
+
+    free(carry);
+}
+
+/*
+ * Every abbreviation and given name is listed, including those that never
+ * matched, in dictionary order.
+ */
+static void dump_stats(void)
+{
+    struct shortener_stats st;
+    const char *phrase, *abbrev;
+    size_t i;
+
+    if (shortener_stats(sh, &st)) {
+	fprintf(stderr, "No statistics, build with make STATS=1\n");
+	return;
+    }
+
+    fprintf(stderr, "Calls: %lu, bytes: %lu, words copied: %lu\n",
+		    st.calls, st.bytes, st.copied);
+    fprintf(stderr, "Latency:\n");
+    for (i = 0; i < SHORTENER_LATENCY_BUCKETS; i ++)
+	if (st.latency[i])
+	    fprintf(stderr, "\t< %lu ns\t%lu\n", 2ul << i, st.latency[i]);
+
+    fprintf(stderr, "Abbreviations:\n");
+    for (i = 0; i < st.n_entries; i ++) {
+	phrase = shortener_stats_entry(sh, i, &abbrev);
+	fprintf(stderr, "\t%lu\t%s\t%s\n", st.entry_hits[i], phrase, abbrev);
+    }
+
+    fprintf(stderr, "Given names:\n");
+    for (i = 0; i < st.n_names; i ++)
+	fprintf(stderr, "\t%lu\t%s\n", st.name_hits[i],
+			shortener_stats_name(sh, i));
+
+    shortener_stats_free(&st);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-j <threads>] [-b <block KiB>] "
+		    "[-l <languages>] [-d <dictionary>] [-c <entries>] [-s] "
+		    "[-w <characters>] [-S] [-u <socket>] [<file>]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t *workers, writer;
+    const char *dict = NULL;
+    size_t cache_size = 0;
+    unsigned long hits, misses;
+    int n_workers, fd = 0, opt, i, stats = 0;
+    void *map = MAP_FAILED;
+    struct stat st;
+    char *end;
+
+    n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_workers < 1)
+	n_workers = 1;
+
+    while ((opt = getopt(argc, argv, "j:b:l:d:c:sw:Su:")) != -1)
+	switch (opt) {
+	case 'j':
+	    n_workers = atoi(optarg);
+	    break;
+	case 'b':
+	    block_size = (size_t) atoi(optarg) << 10;
+	    break;
+	case 'l':
+	    langs = optarg;
+	    break;
+	case 'd':
+	    dict = optarg;
+	    break;
+	case 'c':
+	    cache_size = atol(optarg);
+	    break;
+	case 's':
+	    ladder = 1;
+	    break;
+	case 'w':
+	    max_width = strtoul(optarg, &end, 10);
+	    if (!max_width || *end || !isdigit((unsigned char) *optarg))
+		usage(argv[0]);
+	    break;
+	case 'S':
+	    stats = 1;
+	    break;
+	case 'u':
+	    socket_path = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    if (optind + 1 < argc || n_workers < 1 || !block_size)
+	usage(argv[0]);
+
+    if (optind < argc) {
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+	    perror(argv[optind]);
+	    return 1;
+	}
+    }
+
+    if (dict) {
+	sh = shortener_load(dict);
+	if (!sh) {
+	    fprintf(stderr, "%s: Can't load dictionary\n", dict);
+	    return 1;
+	}
+    } else {
+	sh = shortener_new();
+	if (!sh) {
+	    fprintf(stderr, "Out of memory\n");
+	    return 1;
+	}
+    }
+
+    /* Every character counts as one */
+    if (max_width) {
+	widths = shortener_widths_new(NULL, NULL, 0, 1);
+	if (!widths) {
+	    fprintf(stderr, "Out of memory\n");
+	    return 1;
+	}
+    }
+
+    if (cache_size) {
+	cache = shortener_cache_new(sh, cache_size);
+	if (!cache) {
+	    fprintf(stderr, "Out of memory\n");
+	    return 1;
+	}
+    }
+
+    n_blocks = n_workers * 4;
+    blocks = calloc(n_blocks, sizeof(*blocks));
+    workers = calloc(n_workers, sizeof(*workers));
+    if (!blocks || !workers) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+
+    for (i = 0; i < n_workers; i ++)
+	pthread_create(&workers[i], NULL, worker_thread, NULL);
+    pthread_create(&writer, NULL, writer_thread, NULL);
+
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	read_mapped(map, st.st_size);
+    } else
+	read_stream(fd);
+
+    pthread_mutex_lock(&lock);
+    eof = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < n_workers; i ++)
+	pthread_join(workers[i], NULL);
+    pthread_join(writer, NULL);
+
+    if (map != MAP_FAILED)
+	munmap(map, st.st_size);
+    for (i = 0; i < n_blocks; i ++) {
+	free(blocks[i].buf);
+	free(blocks[i].out);
+    }
+    free(blocks);
+    free(workers);
+    if (cache) {
+	shortener_cache_stats(cache, &hits, &misses);
+	fprintf(stderr, "Cache: %lu hits, %lu misses\n", hits, misses);
+	shortener_cache_free(cache);
+    }
+    if (stats)
+	dump_stats();
+    shortener_widths_free(widths);
+    shortener_free(sh);
+
+    return 0;
+}
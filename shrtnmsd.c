@@ -0,0 +1,589 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Daemon shortening names for other processes over a Unix socket, so that
+ * they share one dictionary and one warm cache, see proto.h for the
+ * protocol and client.c for the client side.
+ *
+ * A single thread runs an epoll loop that accepts connections, reads
+ * requests and writes responses, all non-blocking.  Every complete request
+ * frame is queued for a pool of worker threads, which shorten all the
+ * names in it through the shared cache and queue the response back for
+ * the loop, waking it through an eventfd.  Only the loop touches the
+ * connections, the workers only see copies of the frames.  A connection
+ * isn't read from while it has too much output pending so that a client
+ * that doesn't read its responses can't make the daemon grow forever.
+ *
+ * On SIGHUP the dictionary given with -d is loaded again and replaces the
+ * old one without stopping, requests already being worked on finish with
+ * the old one and the cache entries from it stop being used.  The reload
+ * runs on its own thread so the loop never waits for it.  SIGHUP is
+ * blocked everywhere except inside epoll_pwait() so that one can't slip
+ * in between checking for it and going to sleep.
+ *
+ * Usage: shrtnmsd [-j <threads>] [-c <cache entries>] [-d <dictionary>]
+ *                 <socket path>
+ */
+
+#define _GNU_SOURCE		/* accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "shortnames.h"
+#include "proto.h"
+
+#define MAX_EVENTS	64
+#define MAX_PENDING	(4 << 20)	/* Output bytes before we stop reading */
+#define MAX_JOBS	64		/* Same for requests in the workers */
+
+struct buf {
+    uint8_t *data;
+    size_t len, size;
+};
+
+struct conn {
+    int fd;			/* -1 once closed */
+    struct buf in, out;
+    size_t out_pos;
+    int refs;			/* Requests in the workers, plus one if open */
+    uint32_t events;
+    struct conn *next_dead;
+};
+
+struct job {
+    struct conn *conn;
+    struct buf frame;		/* Request, then response */
+    struct job *next;
+};
+
+static struct shortener_live *live;
+static const char *dict;
+static volatile sig_atomic_t reload;
+static struct shortener_cache *cache;
+static int epoll_fd, listen_fd, wake_fd;
+
+/*
+ * Connections are only freed after all the events returned with them by
+ * epoll_pwait() have been handled.
+ */
+static struct conn *dead;
+
+/* The job queues, protected by the lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct job *todo, **todo_tail = &todo, *done;
+
+/* Whether a reload thread is running and whether it should run again */
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static int reloading, reload_again;
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    return ptr;
+}
+
+static void buf_reserve(struct buf *b, size_t len)
+{
+    if (b->len + len > b->size) {
+	b->size = (b->len + len) * 2;
+	b->data = xrealloc(b->data, b->size);
+    }
+}
+
+static void buf_put(struct buf *b, const void *data, size_t len)
+{
+    buf_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/*
+ * Shorten all the names of the request in @job->frame and replace it with
+ * the response.  Returns -1 if the request is malformed.
+ */
+static int process_request(struct job *job, struct buf *resp)
+{
+    const uint8_t *p = job->frame.data, *end = p + job->frame.len;
+    char short_name[512], shortest_name[512], langs[PROTO_MAX_LANGS + 1];
+    size_t name_len, langs_len, short_len, shortest_len;
+    uint32_t count, i;
+    uint8_t *item;
+
+    count = proto_get32(p + 8);
+    resp->len = 0;
+    buf_put(resp, p, PROTO_HEADER_SIZE);
+    p += PROTO_HEADER_SIZE;
+
+    for (i = 0; i < count; i ++) {
+	if (end - p < 3)
+	    return -1;
+	name_len = proto_get16(p);
+	langs_len = p[2];
+	p += 3;
+	if ((size_t) (end - p) < name_len + langs_len)
+	    return -1;
+
+	memcpy(langs, p + name_len, langs_len);
+	langs[langs_len] = 0;
+	shortener_cache_shorten(cache, (const char *) p, name_len, langs,
+			short_name, shortest_name);
+	p += name_len + langs_len;
+
+	/* Answer only the names that fit, the client sends the rest again */
+	short_len = strlen(short_name);
+	shortest_len = strlen(shortest_name);
+	if (resp->len + 4 + short_len + shortest_len > 4 + PROTO_MAX_FRAME)
+	    break;
+	buf_reserve(resp, 4 + short_len + shortest_len);
+	item = resp->data + resp->len;
+	proto_put16(item, short_len);
+	proto_put16(item + 2, shortest_len);
+	memcpy(item + 4, short_name, short_len);
+	memcpy(item + 4 + short_len, shortest_name, shortest_len);
+	resp->len += 4 + short_len + shortest_len;
+    }
+    if (i == count && p != end)
+	return -1;
+
+    proto_put32(resp->data, resp->len - 4);
+    proto_put32(resp->data + 8, i);
+    return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+    struct buf resp = { 0 }, tmp;
+    struct job *job;
+    uint64_t one = 1;
+
+    while (1) {
+	pthread_mutex_lock(&lock);
+	while (!todo)
+	    pthread_cond_wait(&cond, &lock);
+	job = todo;
+	todo = job->next;
+	if (!todo)
+	    todo_tail = &todo;
+	pthread_mutex_unlock(&lock);
+
+	/* An empty frame tells the loop to close the connection */
+	if (process_request(job, &resp))
+	    resp.len = 0;
+	tmp = job->frame;
+	job->frame = resp;
+	resp = tmp;
+
+	pthread_mutex_lock(&lock);
+	job->next = done;
+	done = job;
+	pthread_mutex_unlock(&lock);
+
+	if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	    perror("eventfd");
+    }
+
+    return NULL;
+}
+
+static void conn_put(struct conn *c)
+{
+    if (!-- c->refs) {
+	c->next_dead = dead;
+	dead = c;
+    }
+}
+
+static void conn_close(struct conn *c)
+{
+    if (c->fd < 0)
+	return;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    conn_put(c);
+}
+
+/*
+ * Wait for input unless too much output or too many requests are pending,
+ * and for output if there's any.
+ */
+static int conn_busy(const struct conn *c)
+{
+    return c->out.len - c->out_pos >= MAX_PENDING || c->refs > MAX_JOBS;
+}
+
+static void conn_update(struct conn *c)
+{
+    struct epoll_event ev = { 0 };
+
+    ev.events = conn_busy(c) ? 0 : EPOLLIN;
+    if (c->out_pos < c->out.len)
+	ev.events |= EPOLLOUT;
+    if (ev.events == c->events)
+	return;
+
+    ev.data.ptr = c;
+    c->events = ev.events;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void conn_flush(struct conn *c)
+{
+    ssize_t ret;
+
+    while (c->out_pos < c->out.len) {
+	ret = write(c->fd, c->out.data + c->out_pos,
+			c->out.len - c->out_pos);
+	if (ret < 0 && errno == EINTR)
+	    continue;
+	if (ret < 0 && errno == EAGAIN)
+	    break;
+	if (ret < 0) {
+	    conn_close(c);
+	    return;
+	}
+	c->out_pos += ret;
+    }
+
+    if (c->out_pos == c->out.len)
+	c->out_pos = c->out.len = 0;
+    conn_update(c);
+}
+
+/* Queue every complete frame read so far */
+static int conn_queue_frames(struct conn *c)
+{
+    size_t pos = 0, len;
+    struct job *job, *first = NULL, **tail = &first;
+    int ret = 0;
+
+    while (c->in.len - pos >= 4) {
+	len = proto_get32(c->in.data + pos);
+	if (len < PROTO_HEADER_SIZE - 4 || len > PROTO_MAX_FRAME) {
+	    ret = -1;
+	    break;
+	}
+	if (c->in.len - pos < 4 + len)
+	    break;
+
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+	    ret = -1;
+	    break;
+	}
+	job->conn = c;
+	buf_put(&job->frame, c->in.data + pos, 4 + len);
+	c->refs ++;
+	*tail = job;
+	tail = &job->next;
+	pos += 4 + len;
+    }
+
+    memmove(c->in.data, c->in.data + pos, c->in.len - pos);
+    c->in.len -= pos;
+
+    if (first) {
+	pthread_mutex_lock(&lock);
+	*todo_tail = first;
+	todo_tail = tail;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+    }
+
+    return ret;
+}
+
+static void conn_read(struct conn *c)
+{
+    ssize_t ret;
+
+    while (!conn_busy(c)) {
+	buf_reserve(&c->in, 65536);
+	ret = read(c->fd, c->in.data + c->in.len, c->in.size - c->in.len);
+	if (ret < 0 && errno == EINTR)
+	    continue;
+	if (ret < 0 && errno == EAGAIN)
+	    break;
+	if (ret <= 0) {
+	    conn_close(c);
+	    return;
+	}
+
+	c->in.len += ret;
+	if (conn_queue_frames(c)) {
+	    conn_close(c);
+	    return;
+	}
+    }
+
+    conn_update(c);
+}
+
+static void accept_conns(void)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct conn *c;
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL,
+				    SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+	    close(fd);
+	    continue;
+	}
+	c->fd = fd;
+	c->refs = 1;
+	c->events = ev.events;
+	ev.data.ptr = c;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	    close(fd);
+	    free(c);
+	}
+    }
+}
+
+/* Responses from the workers, back in the order they were queued */
+static void finish_jobs(void)
+{
+    struct job *job, *list = NULL, *next;
+    uint64_t count;
+
+    if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+	perror("eventfd");
+
+    pthread_mutex_lock(&lock);
+    for (job = done; job; job = next) {
+	next = job->next;
+	job->next = list;
+	list = job;
+    }
+    done = NULL;
+    pthread_mutex_unlock(&lock);
+
+    for (job = list; job; job = next) {
+	next = job->next;
+	if (job->conn->fd >= 0) {
+	    if (!job->frame.len)
+		conn_close(job->conn);
+	    else {
+		buf_put(&job->conn->out, job->frame.data, job->frame.len);
+		conn_flush(job->conn);
+	    }
+	}
+	conn_put(job->conn);
+	if (job->conn->fd >= 0)
+	    conn_update(job->conn);
+	free(job->frame.data);
+	free(job);
+    }
+}
+
+static void on_sighup(int sig)
+{
+    reload = 1;
+}
+
+/*
+ * Loading the new dictionary and waiting for the readers of the old one in
+ * shortener_live_swap() can take a while, so it's done on its own thread
+ * and the loop keeps serving meanwhile.  A SIGHUP during a reload makes it
+ * run once more when done.
+ */
+static void *reload_thread(void *arg)
+{
+    int again;
+
+    do {
+	if (shortener_live_swap(live, shortener_load(dict)))
+	    fprintf(stderr, "%s: Can't load dictionary, keeping the old one\n",
+			    dict);
+
+	pthread_mutex_lock(&reload_lock);
+	again = reload_again;
+	reload_again = 0;
+	reloading = again;
+	pthread_mutex_unlock(&reload_lock);
+    } while (again);
+
+    return NULL;
+}
+
+static void reload_dict(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    reload = 0;
+    if (!dict) {
+	fprintf(stderr, "Using the built-in dictionary, nothing to reload\n");
+	return;
+    }
+
+    pthread_mutex_lock(&reload_lock);
+    if (reloading)
+	reload_again = 1;
+    else {
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, reload_thread, NULL))
+	    fprintf(stderr, "Can't start the reload thread\n");
+	else
+	    reloading = 1;
+	pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_unlock(&reload_lock);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-j <threads>] [-c <cache entries>] "
+		    "[-d <dictionary>] <socket path>\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct sigaction sa = { .sa_handler = on_sighup };
+    sigset_t hup, wait_mask;
+    size_t cache_size = 1 << 18;
+    struct conn *c;
+    pthread_t thread;
+    int n_workers, opt, i, n;
+
+    n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_workers < 1)
+	n_workers = 1;
+
+    while ((opt = getopt(argc, argv, "j:c:d:")) != -1)
+	switch (opt) {
+	case 'j':
+	    n_workers = atoi(optarg);
+	    break;
+	case 'c':
+	    cache_size = atol(optarg);
+	    break;
+	case 'd':
+	    dict = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    if (optind + 1 != argc || n_workers < 1 ||
+	    strlen(argv[optind]) >= sizeof(addr.sun_path))
+	usage(argv[0]);
+
+    live = shortener_live_new(dict ? shortener_load(dict) : shortener_new());
+    if (!live) {
+	fprintf(stderr, "Can't load the dictionary\n");
+	return 1;
+    }
+    cache = shortener_cache_new_live(live, cache_size);
+    if (!cache) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+
+    /* The workers inherit the mask, so SIGHUP only ever reaches the loop */
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, &wait_mask);
+    sigdelset(&wait_mask, SIGHUP);
+    sigaction(SIGHUP, &sa, NULL);
+
+    /* A socket left over by a previous instance is replaced */
+    strcpy(addr.sun_path, argv[optind]);
+    unlink(addr.sun_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 ||
+	    bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(listen_fd, 128) < 0) {
+	perror(addr.sun_path);
+	return 1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wake_fd < 0) {
+	perror("epoll");
+	return 1;
+    }
+
+    /* The listening socket and the eventfd are told apart by data.ptr */
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.ptr = &wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+    for (i = 0; i < n_workers; i ++)
+	if (pthread_create(&thread, NULL, worker_thread, NULL)) {
+	    fprintf(stderr, "Can't start threads\n");
+	    return 1;
+	}
+
+    while (1) {
+	if (reload)
+	    reload_dict();
+
+	n = epoll_pwait(epoll_fd, events, MAX_EVENTS, -1, &wait_mask);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0) {
+	    perror("epoll_pwait");
+	    return 1;
+	}
+
+	for (i = 0; i < n; i ++) {
+	    c = events[i].data.ptr;
+
+	    if (events[i].data.ptr == &listen_fd)
+		accept_conns();
+	    else if (events[i].data.ptr == &wake_fd)
+		finish_jobs();
+	    else if (c->fd < 0)
+		continue;
+	    else if (events[i].events & (EPOLLERR | EPOLLHUP) &&
+		    !(events[i].events & EPOLLIN))
+		conn_close(c);
+	    else {
+		if (events[i].events & EPOLLOUT)
+		    conn_flush(c);
+		if (c->fd >= 0 && events[i].events & EPOLLIN)
+		    conn_read(c);
+	    }
+	}
+
+	while (dead) {
+	    c = dead;
+	    dead = c->next_dead;
+	    free(c->in.data);
+	    free(c->out.data);
+	    free(c);
+	}
+    }
+}
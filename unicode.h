@@ -0,0 +1,153 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Character classification and case mapping without going through the
+ * libc locale machinery.  The data lives in unicode-tables.c, generated by
+ * gen-unicode.pl, as a two-level table: uc_index1 maps a block of
+ * 1 << UC_SHIFT code points to a block in uc_index2 (identical blocks are
+ * shared), which in turn gives a record with the properties of every code
+ * point.  Code points from UC_LIMIT up have no properties.
+ */
+
+#include <wchar.h>
+
+#define UC_SHIFT	7
+#define UC_LIMIT	0x40000
+
+#define UC_ALNUM	1
+#define UC_SPACE	2
+#define UC_UPPER	4
+
+struct uc_record {
+    unsigned char flags;
+    int lower, upper;		/* Case mappings as offsets */
+};
+
+extern const unsigned short uc_index1[UC_LIMIT >> UC_SHIFT];
+extern const unsigned char uc_index2[];
+extern const struct uc_record uc_records[];
+
+static inline const struct uc_record *uc_lookup(wchar_t c)
+{
+    if ((unsigned int) c >= UC_LIMIT)
+	return uc_records;
+
+    return &uc_records[uc_index2[(uc_index1[c >> UC_SHIFT] << UC_SHIFT) |
+	    (c & ((1 << UC_SHIFT) - 1))]];
+}
+
+static inline int uc_isalnum(wchar_t c)
+{
+    return uc_lookup(c)->flags & UC_ALNUM;
+}
+
+static inline int uc_isspace(wchar_t c)
+{
+    return uc_lookup(c)->flags & UC_SPACE;
+}
+
+static inline int uc_isupper(wchar_t c)
+{
+    return uc_lookup(c)->flags & UC_UPPER;
+}
+
+static inline wchar_t uc_tolower(wchar_t c)
+{
+    return c + uc_lookup(c)->lower;
+}
+
+static inline wchar_t uc_toupper(wchar_t c)
+{
+    return c + uc_lookup(c)->upper;
+}
+
+/*
+ * Decode one character at @str.  Returns 0 at the end of the string and
+ * also for anything that is not valid UTF-8, so an invalid sequence
+ * terminates the input just like it would stop mbsrtowcs().  The length of
+ * the sequence is stored in @len, 1 for an invalid lead byte.
+ */
+static inline wchar_t utf8_get(const char *str, int *len)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    wchar_t c;
+    int i;
+
+    if (s[0] < 0x80) {
+	*len = 1;
+	return s[0];
+    }
+
+    if (s[0] < 0xc2 || s[0] >= 0xf5) {
+	*len = 1;
+	return 0;
+    } else if (s[0] < 0xe0) {
+	*len = 2;
+	c = s[0] & 0x1f;
+    } else if (s[0] < 0xf0) {
+	*len = 3;
+	c = s[0] & 0x0f;
+    } else {
+	*len = 4;
+	c = s[0] & 0x07;
+    }
+
+    for (i = 1; i < *len; i ++) {
+	if ((s[i] & 0xc0) != 0x80)
+	    return 0;
+	c = (c << 6) | (s[i] & 0x3f);
+    }
+
+    /* Overlong forms, surrogates and values beyond Unicode */
+    if ((*len == 3 && c < 0x800) || (*len == 4 && c < 0x10000) ||
+	    (c >= 0xd800 && c < 0xe000) || c > 0x10ffff)
+	return 0;
+
+    return c;
+}
+
+/* Same as utf8_get() but stops at @end instead of at a NUL */
+static inline wchar_t utf8_get_n(const char *str, const char *end, int *len)
+{
+    unsigned char lead;
+
+    if (str >= end) {
+	*len = 0;
+	return 0;
+    }
+
+    lead = *str;
+    if (end - str < (lead < 0xe0 ? 2 : lead < 0xf0 ? 3 : 4) && lead >= 0x80) {
+	*len = 1;
+	return 0;
+    }
+
+    return utf8_get(str, len);
+}
+
+static inline int utf8_put(char *str, wchar_t c)
+{
+    if (c < 0x80) {
+	str[0] = c;
+	return 1;
+    } else if (c < 0x800) {
+	str[0] = 0xc0 | (c >> 6);
+	str[1] = 0x80 | (c & 0x3f);
+	return 2;
+    } else if (c < 0x10000) {
+	str[0] = 0xe0 | (c >> 12);
+	str[1] = 0x80 | ((c >> 6) & 0x3f);
+	str[2] = 0x80 | (c & 0x3f);
+	return 3;
+    } else {
+	str[0] = 0xf0 | (c >> 18);
+	str[1] = 0x80 | ((c >> 12) & 0x3f);
+	str[2] = 0x80 | ((c >> 6) & 0x3f);
+	str[3] = 0x80 | (c & 0x3f);
+	return 4;
+    }
+}
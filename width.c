@@ -0,0 +1,159 @@
+/*
+ * Written by: Andrzej Zaborowski <andrew.zaborowski@intel.com>
+ *
+ * Code in this file is for now licensed under the 2-clause BSD license.
+ */
+
+/*
+ * Width-budgeted shortening: picks the longest of the name and the steps
+ * of the abbreviation ladder that fits in a given width, measured with
+ * the advance widths of a font.  The widths are kept in a two-level table,
+ * blocks of WIDTH_BLOCK code points that only exist where the font has any
+ * glyphs, so that the lookup is two loads.  Kerning and shaping are not
+ * taken into account, the caller's budget should leave some margin.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "shortnames.h"
+#include "unicode.h"
+
+#define WIDTH_SHIFT	6
+#define WIDTH_BLOCK	(1 << WIDTH_SHIFT)
+#define WIDTH_LIMIT	0x30000		/* The rest always gets the default */
+
+struct shortener_widths {
+    unsigned short index[WIDTH_LIMIT >> WIDTH_SHIFT];
+    unsigned short (*blocks)[WIDTH_BLOCK];	/* Block 0 is all default */
+    int n_blocks;
+    unsigned short default_advance;
+};
+
+struct shortener_widths *shortener_widths_new(const unsigned int *codepoints,
+		const unsigned short *advances, size_t count,
+		unsigned short default_advance)
+{
+    struct shortener_widths *w = calloc(1, sizeof(*w));
+    unsigned short (*blocks)[WIDTH_BLOCK];
+    unsigned int c;
+    size_t i;
+    int j;
+
+    if (!w)
+	return NULL;
+
+    w->default_advance = default_advance;
+    w->blocks = malloc(sizeof(*w->blocks));
+    if (!w->blocks)
+	goto err;
+    w->n_blocks = 1;
+    for (j = 0; j < WIDTH_BLOCK; j ++)
+	w->blocks[0][j] = default_advance;
+
+    for (i = 0; i < count; i ++) {
+	c = codepoints[i];
+	if (c >= WIDTH_LIMIT)
+	    continue;
+
+	if (!w->index[c >> WIDTH_SHIFT]) {
+	    if (w->n_blocks == 0x10000)
+		goto err;
+	    blocks = realloc(w->blocks, (w->n_blocks + 1) * sizeof(*blocks));
+	    if (!blocks)
+		goto err;
+	    w->blocks = blocks;
+	    memcpy(w->blocks[w->n_blocks], w->blocks[0], sizeof(*blocks));
+	    w->index[c >> WIDTH_SHIFT] = w->n_blocks ++;
+	}
+
+	w->blocks[w->index[c >> WIDTH_SHIFT]][c & (WIDTH_BLOCK - 1)] =
+		advances[i];
+    }
+
+    return w;
+
+err:
+    shortener_widths_free(w);
+    return NULL;
+}
+
+void shortener_widths_free(struct shortener_widths *w)
+{
+    if (!w)
+	return;
+
+    free(w->blocks);
+    free(w);
+}
+
+unsigned long shortener_width(const struct shortener_widths *w,
+		const char *str, size_t len)
+{
+    const char *end = str + len;
+    unsigned long width = 0;
+    wchar_t c;
+    int n;
+
+    for (; (c = utf8_get_n(str, end, &n)); str += n)
+	if (c < WIDTH_LIMIT)
+	    width += w->blocks[w->index[c >> WIDTH_SHIFT]]
+		    [c & (WIDTH_BLOCK - 1)];
+	else
+	    width += w->default_advance;
+
+    return width;
+}
+
+int shortener_fit(const struct shortener *sh,
+		const struct shortener_widths *w,
+		const char *name, size_t len, const char *langs,
+		unsigned long max_width, char *buf, size_t size,
+		size_t *out_len, unsigned long *width)
+{
+    struct shortener_step steps[SHORTENER_STEPS];
+    char scratch[2048], *ladder = scratch;
+    size_t ladder_size = sizeof(scratch), max;
+    const char *form = name;
+    int i, ret = 0;
+
+    *out_len = len;
+    *width = shortener_width(w, name, len);
+
+    if (*width > max_width) {
+	while (shortener_ladder(sh, name, len, langs,
+				ladder, ladder_size, steps)) {
+	    for (i = 0, max = 0; i < SHORTENER_STEPS; i ++)
+		if (steps[i].len > max)
+		    max = steps[i].len;
+
+	    if (ladder != scratch)
+		free(ladder);
+	    ladder_size = max * SHORTENER_STEPS;
+	    ladder = malloc(ladder_size);
+	    if (!ladder) {
+		*out_len = 0;
+		return -1;
+	    }
+	}
+
+	/* The first step that fits, or the last one if none does */
+	for (i = 0; i < SHORTENER_STEPS; i ++) {
+	    form = ladder + steps[i].offset;
+	    *out_len = steps[i].len;
+	    *width = shortener_width(w, form, *out_len);
+	    ret = i + 1;
+	    if (*width <= max_width)
+		break;
+	}
+    }
+
+    if (*out_len > size)
+	ret = -1;
+    else
+	memcpy(buf, form, *out_len);
+
+    if (ladder != scratch)
+	free(ladder);
+    return ret;
+}